@@ -61,6 +61,23 @@
 #PORT           = /dev/ttyUSB0
 #PROGRAMMER     = "<undefined>"
 
+# make CPU=65c02 builds the VM and the assembler for the 65C02 instruction set
+ifeq ($(CPU),65c02)
+DEFS += -DVM_65C02
+endif
+
+# make SAMPLES=n samples the 6502 PC every n (up to 255) scanlines while a
+# program runs, see the PROF shell command
+ifdef SAMPLES
+DEFS += -DPC_SAMPLES=$(SAMPLES)
+endif
+
+# make TRACE=n keeps the last n (a power of 2) instructions run, see the TRACE
+# shell command
+ifdef TRACE
+DEFS += -DVM_TRACE=$(TRACE)
+endif
+
 # You should not have to change anything below here.
 
 CC             = avr-gcc
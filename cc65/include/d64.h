@@ -24,6 +24,17 @@ extern uint8_t __fastcall__ putt(uint8_t *tile);
 extern uint8_t _rand();
 extern uint8_t _srand(uint16_t seed);
 extern void wait_vsync();
+extern uint8_t __fastcall__ sys_cycles(uint32_t *dest);
+
+// interrupt sources, the handlers are at 0xfffe (IRQ) and 0xfffa (NMI)
+#define IRQ_FRAME	1
+#define IRQ_KEYB	2
+#define NMI_FRAME	4
+
+extern uint8_t __fastcall__ sys_irq(uint8_t sources);
+
+// like memmove, faster than a loop for large buffers
+extern uint8_t __fastcall__ sys_move(void *dest, const void *src, uint16_t count);
 
 #endif // _D64_H
 
@@ -16,6 +16,19 @@
 .segment  "STARTUP"
 
 _init:
+.ifpc02
+		; 65C02 code needs a VM built for it (get version returns 1 in X)
+		ldx #$00
+		lda #$f0
+		sys
+		cpx #$01
+		beq @cpu_ok
+
+		lda #$00
+		sys
+
+@cpu_ok:
+.endif
         lda #<__TOPMEM__
         sta sp
         lda #>__TOPMEM__
@@ -2,7 +2,7 @@
 ;
 ;
 
-.export		_sys_exit, _sys_load, _sys_save, _putch, _cputs, _gotoxy, _clrscr, _fillscr, _write, _getch, _cgets, _read, _putt, __rand, __srand, _wait_vsync, _sys_ver
+.export		_sys_exit, _sys_load, _sys_save, _putch, _cputs, _gotoxy, _clrscr, _fillscr, _write, _getch, _cgets, _read, _putt, __rand, __srand, _wait_vsync, _sys_cycles, _sys_irq, _sys_move, _sys_ver
 
 .import popa, popax
 
@@ -165,6 +165,21 @@
 			rts
 .endproc
 
+.proc 		_sys_cycles: near
+			sys_pt #$a3
+			rts
+.endproc
+
+.proc 		_sys_irq: near
+			sys_1 #$a4
+			rts
+.endproc
+
+.proc 		_sys_move: near
+			sys_1_pt_pt #$a5
+			rts
+.endproc
+
 .proc 		_sys_ver: near
 			sys #$f0
 			rts
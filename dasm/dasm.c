@@ -25,15 +25,13 @@
 #include "vm.h"
 #include "dasm.h"
 
-#define OPCODES		153
-
 // disassembler table follows
 //     opcode: 1 byte
 //   mnemonic: 3 bytes
 // addressing: 1 byte
 const uint8_t vm_op_tbl[] PROGMEM = {
 	0x00, 'B', 'R', 'K', AT_IMPLIED, // BRK
-	0x01, 'O', 'R', 'A', AT_ZP_INDEX_X, // ORA
+	0x01, 'O', 'R', 'A', AT_INDEX_IND, // ORA
 	0x02, 'S', 'Y', 'S', AT_IMPLIED, // SYS
 	0x05, 'O', 'R', 'A', AT_ZEROP, // ORA
 	0x06, 'A', 'S', 'L', AT_ZEROP, // ASL
@@ -51,7 +49,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0x1d, 'O', 'R', 'A', AT_ABS_INDEX_X, // ORA
 	0x1e, 'A', 'S', 'L', AT_ABS_INDEX_X, // ASL
 	0x20, 'J', 'S', 'R', AT_ABSOLUTE, // JSR
-	0x21, 'A', 'N', 'D', AT_ZP_INDEX_X, // AND
+	0x21, 'A', 'N', 'D', AT_INDEX_IND, // AND
 	0x24, 'B', 'I', 'T', AT_ZEROP, // BIT
 	0x25, 'A', 'N', 'D', AT_ZEROP, // AND
 	0x26, 'R', 'O', 'L', AT_ZEROP, // ROL
@@ -67,7 +65,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0x36, 'R', 'O', 'L', AT_ZP_INDEX_X, // ROL
 	0x38, 'S', 'E', 'C', AT_IMPLIED, // SEC
 	0x39, 'A', 'N', 'D', AT_ABS_INDEX_Y, // AND
-	0x3d, 'O', 'R', 'A', AT_ABS_INDEX_X, // ORA
+	0x3d, 'A', 'N', 'D', AT_ABS_INDEX_X, // AND
 	0x3e, 'R', 'O', 'L', AT_ABS_INDEX_X, // ROL
 	0x40, 'R', 'T', 'I', AT_IMPLIED, // RTI
 	0x41, 'E', 'O', 'R', AT_INDEX_IND, // EOR
@@ -88,7 +86,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0x5d, 'E', 'O', 'R', AT_ABS_INDEX_X, // EOR
 	0x5e, 'L', 'S', 'R', AT_ABS_INDEX_X, // LSR
 	0x60, 'R', 'T', 'S', AT_IMPLIED, // RTS
-	0x61, 'A', 'D', 'C', AT_ZP_INDEX_X, // ADC
+	0x61, 'A', 'D', 'C', AT_INDEX_IND, // ADC
 	0x65, 'A', 'D', 'C', AT_ZEROP, // ADC
 	0x66, 'R', 'O', 'R', AT_ZEROP, // ROR
 	0x68, 'P', 'L', 'A', AT_IMPLIED, // PLA
@@ -124,7 +122,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0x9a, 'T', 'X', 'S', AT_IMPLIED, // TXS
 	0x9d, 'S', 'T', 'A', AT_ABS_INDEX_X, // STA
 	0xa0, 'L', 'D', 'Y', AT_IMMEDIATE, // LDY
-	0xa1, 'L', 'D', 'A', AT_ZP_INDEX_X, // LDA
+	0xa1, 'L', 'D', 'A', AT_INDEX_IND, // LDA
 	0xa2, 'L', 'D', 'X', AT_IMMEDIATE, // LDX
 	0xa4, 'L', 'D', 'Y', AT_ZEROP, // LDY
 	0xa5, 'L', 'D', 'A', AT_ZEROP, // LDA
@@ -147,7 +145,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0xbd, 'L', 'D', 'A', AT_ABS_INDEX_X, // LDA
 	0xbe, 'L', 'D', 'X', AT_ABS_INDEX_Y, // LDX
 	0xc0, 'C', 'P', 'Y', AT_IMMEDIATE, // CPY
-	0xc1, 'C', 'M', 'P', AT_ZP_INDEX_X, // CMP
+	0xc1, 'C', 'M', 'P', AT_INDEX_IND, // CMP
 	0xc4, 'C', 'P', 'Y', AT_ZEROP, // CPY
 	0xc5, 'C', 'M', 'P', AT_ZEROP, // CMP
 	0xc6, 'D', 'E', 'C', AT_ZEROP, // DEC
@@ -166,7 +164,7 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0xdd, 'C', 'M', 'P', AT_ABS_INDEX_X, // CMP
 	0xde, 'D', 'E', 'C', AT_ABS_INDEX_X, // DEC
 	0xe0, 'C', 'P', 'X', AT_IMMEDIATE, // CPX
-	0xe1, 'S', 'B', 'C', AT_ZP_INDEX_X, // SBC
+	0xe1, 'S', 'B', 'C', AT_INDEX_IND, // SBC
 	0xe4, 'C', 'P', 'X', AT_ZEROP, // CPX
 	0xe5, 'S', 'B', 'C', AT_ZEROP, // SBC
 	0xe6, 'I', 'N', 'C', AT_ZEROP, // INC
@@ -183,9 +181,43 @@ const uint8_t vm_op_tbl[] PROGMEM = {
 	0xf8, 'S', 'E', 'D', AT_IMPLIED, // SED
 	0xf9, 'S', 'B', 'C', AT_ABS_INDEX_Y, // SBC
 	0xfd, 'S', 'B', 'C', AT_ABS_INDEX_X, // SBC
-	0xfe, 'I', 'N', 'C', AT_ABS_INDEX_X // INC
+	0xfe, 'I', 'N', 'C', AT_ABS_INDEX_X, // INC
+#ifdef VM_65C02
+	// 65C02
+	0x04, 'T', 'S', 'B', AT_ZEROP, // TSB
+	0x0c, 'T', 'S', 'B', AT_ABSOLUTE, // TSB
+	0x12, 'O', 'R', 'A', AT_ZP_IND, // ORA
+	0x14, 'T', 'R', 'B', AT_ZEROP, // TRB
+	0x1a, 'I', 'N', 'C', AT_ACCUMULATOR, // INC
+	0x1c, 'T', 'R', 'B', AT_ABSOLUTE, // TRB
+	0x32, 'A', 'N', 'D', AT_ZP_IND, // AND
+	0x34, 'B', 'I', 'T', AT_ZP_INDEX_X, // BIT
+	0x3a, 'D', 'E', 'C', AT_ACCUMULATOR, // DEC
+	0x3c, 'B', 'I', 'T', AT_ABS_INDEX_X, // BIT
+	0x52, 'E', 'O', 'R', AT_ZP_IND, // EOR
+	0x5a, 'P', 'H', 'Y', AT_IMPLIED, // PHY
+	0x64, 'S', 'T', 'Z', AT_ZEROP, // STZ
+	0x72, 'A', 'D', 'C', AT_ZP_IND, // ADC
+	0x74, 'S', 'T', 'Z', AT_ZP_INDEX_X, // STZ
+	0x7a, 'P', 'L', 'Y', AT_IMPLIED, // PLY
+	0x7c, 'J', 'M', 'P', AT_IND_ABS_X, // JMP
+	0x80, 'B', 'R', 'A', AT_RELATIVE, // BRA
+	0x89, 'B', 'I', 'T', AT_IMMEDIATE, // BIT
+	0x92, 'S', 'T', 'A', AT_ZP_IND, // STA
+	0x9c, 'S', 'T', 'Z', AT_ABSOLUTE, // STZ
+	0x9e, 'S', 'T', 'Z', AT_ABS_INDEX_X, // STZ
+	0xb2, 'L', 'D', 'A', AT_ZP_IND, // LDA
+	0xd2, 'C', 'M', 'P', AT_ZP_IND, // CMP
+	0xda, 'P', 'H', 'X', AT_IMPLIED, // PHX
+	0xf2, 'S', 'B', 'C', AT_ZP_IND, // SBC
+	0xfa, 'P', 'L', 'X', AT_IMPLIED // PLX
+#endif
 };
 
+#define OPCODES		(sizeof(vm_op_tbl) / 5)
+
+const uint8_t vm_op_count PROGMEM = OPCODES;
+
 static char *
 skip_whitespace(char *p)
 {
@@ -222,6 +254,7 @@ static int
 get_value(char *input, uint16_t *val)
 {
 	uint8_t len = 0;
+	unsigned int u;
 	int res, v;
 
 	if (!*input)
@@ -232,7 +265,8 @@ get_value(char *input, uint16_t *val)
 		if (!input[1])
 			return -1;
 		len++;
-		res = sscanf(input + 1, "%x", val);
+		res = sscanf(input + 1, "%x", &u);
+		*val = (uint16_t)u;
 		for (; input[len] && isxdigit(input[len]); len++);
 	}
 	else
@@ -379,8 +413,16 @@ dasm_as(uint16_t addr, char *input, uint8_t *output)
 					p = skip_whitespace(p + 1);
 					if (!*p)
 					{
-						mode = AT_IND_ABS;
-						len = 3;
+						if (val <= 0xff && find_mne((uint8_t *)mne, AT_ZP_IND) != OPCODES)
+						{
+							mode = AT_ZP_IND;
+							len = 2;
+						}
+						else
+						{
+							mode = AT_IND_ABS;
+							len = 3;
+						}
 					}
 					else
 					{
@@ -421,6 +463,13 @@ dasm_as(uint16_t addr, char *input, uint8_t *output)
 					if (*p)
 						return -1;
 
+					if (find_mne((uint8_t *)mne, AT_IND_ABS_X) != OPCODES)
+					{
+						mode = AT_IND_ABS_X;
+						len = 3;
+						break;
+					}
+
 					mode = AT_INDEX_IND;
 					len = 2;
 
@@ -455,10 +504,12 @@ dasm_as(uint16_t addr, char *input, uint8_t *output)
 						{
 							mode = AT_RELATIVE;
 							len = 2;
-							val = (uint8_t)(val - addr - 1);
+							// relative to the next instruction
+							val -= addr + 2;
 
-							if (val > 0xff)
+							if ((int16_t)val < -128 || (int16_t)val > 127)
 								return -1;
+							val &= 0xff;
 						}
 					}
 					break;
@@ -593,12 +644,20 @@ dasm_das(uint16_t addr, uint8_t *op, char *output)
 			return 2;
 
 		case AT_RELATIVE:
-			sprintf(output + 4, "$%04x", addr + 1 + (int8_t)op[1]);
+			sprintf(output + 4, "$%04x", (uint16_t)(addr + 2 + (int8_t)op[1]));
 			return 2;
 
 		case AT_ACCUMULATOR:
 			strcat(output, "A");
 			return 1;
+
+		case AT_ZP_IND:
+			sprintf(output + 4, "($%02x)", op[1]);
+			return 2;
+
+		case AT_IND_ABS_X:
+			sprintf(output + 4, "($%04x,X)", addr16(op[1], op[2]));
+			return 3;
 	}
 
 	// shouldn't happen
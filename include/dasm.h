@@ -54,9 +54,17 @@ enum addr_enum {
 	AT_INDEX_IND,
 	AT_IND_INDEX,
 	AT_RELATIVE,
-	AT_ACCUMULATOR
+	AT_ACCUMULATOR,
+	// 65C02
+	AT_ZP_IND,
+	AT_IND_ABS_X
 };
 
+// opcode, mnemonic (3 chars) and addressing mode per entry, vm_op_count
+// entries
+extern const uint8_t vm_op_tbl[] PROGMEM;
+extern const uint8_t vm_op_count PROGMEM;
+
 uint8_t dasm_das(uint16_t addr, uint8_t *op, char *output);
 int dasm_as(uint16_t addr, char *input, uint8_t *output);
 
@@ -0,0 +1,102 @@
+/*
+ * jit.h
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#ifndef _JIT_H
+#define _JIT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#ifdef VM_SINGLE
+#error "the JIT is for the host build only"
+#endif
+
+// times a block is interpreted before it is compiled
+#ifndef JIT_HOT
+#define JIT_HOT				8
+#endif
+
+// blocks dropped this many times because of writes to them are not compiled again
+#ifndef JIT_SMC_LIMIT
+#define JIT_SMC_LIMIT		4
+#endif
+
+// executable arena size, everything is flushed when it is full
+#define JIT_ARENA			(4 * 1024 * 1024)
+
+// page flags
+#define JIT_PAGE_CODE		1	// has compiled code, writes go through the VM
+#define JIT_PAGE_IO			2	// memory mapped, writes go through the VM
+#define JIT_PAGE_NOJIT		4	// never compiled
+
+struct jit_state
+{
+	// flat memory followed by the page flags, the generated code relies on it
+	uint8_t ram[0x10000];
+	uint8_t pages[256];
+
+	// registers while running native code
+	uint32_t regs[12];
+
+	// interpreter for the code that is not compiled, ram_read, ram_write and
+	// data are set by jit_init(), the syscall callback is up to the caller
+	struct vm_state vm;
+
+	// called after a write to a JIT_PAGE_IO page (optional)
+	void (*io_write)(struct jit_state *jit, uint16_t addr, uint8_t *src, uint8_t size);
+	// for the callbacks
+	void *data;
+
+	// native code per PC (NULL when not compiled) and the length of its block
+	void *code[0x10000];
+	uint8_t len[0x10000];
+	// times interpreted and times dropped per PC
+	uint8_t hot[0x10000];
+	uint8_t smc[0x10000];
+	// compiled blocks per page
+	uint16_t blocks[256];
+
+	// never writable and executable at once: RW while compiling, RX while
+	// running; NULL when the host doesn't allow executable memory
+	uint8_t *arena;
+	uint8_t writable;
+	uint32_t used, base;
+	uint8_t *exit;
+	void (*enter)(struct jit_state *jit, void *code);
+};
+
+// the state is big (about 850 KB), better not on the stack; 0 on error.
+// Without an executable arena (mmap or mprotect denied) everything runs in
+// the interpreter
+uint8_t jit_init(struct jit_state *jit);
+void jit_free(struct jit_state *jit);
+// mark memory as memory mapped (the zero page and the stack can't be)
+void jit_io(struct jit_state *jit, uint16_t addr, uint16_t size);
+// for callbacks changing memory directly (size 0 is the whole memory)
+void jit_invalidate(struct jit_state *jit, uint16_t addr, uint16_t size);
+// same as vm_run(), including jit->vm.ran
+uint8_t jit_run(struct jit_state *jit, uint16_t budget);
+
+#endif // _JIT_H
@@ -0,0 +1,77 @@
+/*
+ * journal.h
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+#ifdef VM_SINGLE
+#error "the journal is for the host build only"
+#endif
+
+// Syscall results recorded to a file and fed back to the VM instead of
+// running the syscalls. Per syscall: PC after SYS (word), function, the
+// JOURNAL_ARGS bytes on top of the stack (where the arguments are), the
+// memory writes as (size, address, bytes) ending with a size 0, a mask of
+// the registers changed and their values (A, X, Y, SP, S, PC word, cycles
+// 32-bit). The syscall must write memory through vm->ram_write.
+
+#define JOURNAL_VERSION		2
+
+// the most argument bytes a syscall takes
+#define JOURNAL_ARGS		6
+
+struct journal
+{
+	FILE *fd;
+	uint8_t replay;
+
+	// wrapped callbacks
+	void (*syscall)(struct vm_state *vm, uint8_t func);
+	void (*ram_write)(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size);
+
+	// memory write being recorded, contiguous ones are merged
+	uint16_t addr;
+	uint8_t len;
+	uint8_t buf[255];
+
+	// syscalls so far and the last function
+	uint32_t count;
+	uint8_t func;
+	// replay diverged from the journal (PC, function or arguments) or the
+	// journal ended
+	uint8_t error;
+};
+
+// both wrap the VM callbacks and return 0 on success, -1 on error
+int journal_record(struct journal *j, struct vm_state *vm, const char *filename);
+int journal_replay(struct journal *j, struct vm_state *vm, const char *filename);
+// restores the callbacks
+void journal_close(struct journal *j, struct vm_state *vm);
+
+#endif // _JOURNAL_H
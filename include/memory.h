@@ -30,6 +30,45 @@
 void sram_write(uint16_t addr, const uint8_t *data, uint16_t size);
 void sram_read(uint16_t addr, uint8_t *data, uint16_t size);
 void sram_set(uint16_t addr, uint8_t c, uint16_t times);
+// copies len bytes from src to dst, the areas may overlap (like memmove);
+// it goes through the cache storage, so the cache is written back and empty
+// after it
+void sram_move(uint16_t dst, uint16_t src, uint16_t len);
+
+// SRAM commands, also the direction of a stream
+#define SRAM_READ			0x03
+#define SRAM_WRITE			0x02
+
+// sequential access one byte at a time, without a transaction per byte;
+// nothing else can use the SPI until sram_stream_end(). The transaction stays
+// open between bytes, so sram_stream_begin() turns the video off (video_on()
+// after sram_stream_end())
+void sram_stream_begin(uint16_t addr, uint8_t dir);
+// writes b in a write stream, returns the next byte in a read stream
+uint8_t sram_stream_byte(uint8_t b);
+void sram_stream_end();
+
+// direct-mapped write-back cache in front of the SRAM (video RAM is not cached)
+#ifndef CACHE_LINES
+#define CACHE_LINES			8
+#endif
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE		32
+#endif
+
+#ifdef CACHE_STATS
+extern uint32_t cache_hits, cache_misses;
+#endif
+
+void cache_read(uint16_t addr, uint8_t *dst, uint16_t size);
+void cache_write(uint16_t addr, const uint8_t *src, uint16_t size);
+// write back the dirty lines
+void cache_flush();
+// write back and drop all the lines (after the SRAM was changed directly)
+void cache_invalidate();
+// cache_invalidate() and lend the storage of the lines (CACHE_LINES *
+// CACHE_LINE_SIZE bytes) until the next cache access
+uint8_t *cache_borrow();
 
 #endif // _MEMORY_H
 
@@ -0,0 +1,69 @@
+/*
+ * prof.h
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#ifndef _PROF_H
+#define _PROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+#ifdef VM_SINGLE
+#error "the profiler is for the host build only"
+#endif
+
+#define PROF_LABELS			2048
+// hot loops in the report
+#define PROF_LOOPS			5
+
+struct prof_label
+{
+	uint16_t addr;
+	char name[32];
+	// instructions and cycles from the label to the next one
+	uint64_t count, cycles;
+};
+
+struct prof_state
+{
+	// instructions run and their cycles per PC
+	uint32_t count[0x10000];
+	uint64_t cycles[0x10000];
+
+	// from the label file of the program (ld65 -Ln), sorted by address
+	struct prof_label labels[PROF_LABELS];
+	int nlabels;
+};
+
+void prof_init(struct prof_state *prof);
+// returns the number of labels found, -1 on error
+int prof_load(struct prof_state *prof, const char *filename);
+// as vm_run(), an instruction at a time
+uint8_t prof_run(struct prof_state *prof, struct vm_state *vm, uint16_t budget);
+// flat profile by label and the hot loops disassembled (reading the code
+// from the VM memory)
+void prof_report(struct prof_state *prof, struct vm_state *vm, FILE *fd);
+
+#endif // _PROF_H
@@ -0,0 +1,58 @@
+/*
+ * rt.h
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#ifndef _RT_H
+#define _RT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#ifdef VM_SINGLE
+#error "the native runtime is for the host build only"
+#endif
+
+// native versions of the cc65 runtime helpers in cc65/lib/rt.lib, found by
+// address in the label file of the program (ld65 -Ln)
+struct rt_state
+{
+	// the VM gets a pointer to this, it must be first
+	uint8_t traps[0x10000 / 8];
+
+	// routine per address (0 for none)
+	uint8_t fn[0x10000];
+	// zero page variables and other addresses from the label file
+	uint16_t sym[16];
+
+	// routines run natively
+	uint32_t calls;
+};
+
+void rt_init(struct rt_state *rt);
+// returns the number of routines found, -1 on error
+int rt_load(struct rt_state *rt, const char *filename);
+// run the routines natively in the VM (NULL runs them as 6502 code)
+void rt_attach(struct rt_state *rt, struct vm_state *vm);
+
+#endif // _RT_H
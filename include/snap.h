@@ -0,0 +1,88 @@
+/*
+ * snap.h
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#ifndef _SNAP_H
+#define _SNAP_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#ifdef VM_SINGLE
+#error "snapshots are for the host build only"
+#endif
+
+// a 256 byte memory page shared by the memories and snapshots holding it;
+// refs is only changed atomically, so forks can run on separate threads
+struct snap_page
+{
+	uint32_t refs;
+	uint8_t data[256];
+};
+
+// 64 KB of VM memory, a page is copied before writing to it when it is
+// shared (a NULL page reads as zeros)
+struct snap_mem
+{
+	struct snap_page *pages[256];
+
+	// pages copied or allocated on write
+	uint32_t copies;
+};
+
+// registers and callbacks of a VM plus its memory
+struct snap
+{
+	uint8_t a, x, y, sp, s;
+	uint16_t pc;
+	uint32_t cycles;
+	uint8_t irq, nmi;
+	uint16_t sys_pc;
+	uint32_t sys_cycles;
+	uint8_t idle;
+
+	void (*syscall)(struct vm_state *vm, uint8_t func);
+	void *sys_data;
+	const uint8_t *traps;
+	uint8_t (*trap)(struct vm_state *vm);
+
+	struct snap_mem mem;
+};
+
+// an empty (all zeros) memory
+void snap_mem_init(struct snap_mem *mem);
+void snap_mem_free(struct snap_mem *mem);
+void snap_mem_load(struct snap_mem *mem, uint16_t addr, const uint8_t *src, uint32_t size);
+// the VM uses the memory (sets ram_read, ram_write and data)
+void snap_attach(struct snap_mem *mem, struct vm_state *vm);
+
+// the VM must use a snap_mem, taking a snapshot is sharing its pages
+void snap_take(struct snap *snap, const struct vm_state *vm);
+void snap_restore(const struct snap *snap, struct vm_state *vm);
+void snap_free(struct snap *snap);
+// n VMs from a snapshot, each with its memory in mems (to be freed); they
+// can run on separate threads, but they share the syscall's sys_data
+void snap_fork(const struct snap *snap, struct vm_state *vms, struct snap_mem *mems, int n);
+
+#endif // _SNAP_H
@@ -30,6 +30,8 @@
 #define VIDEO_ADDR				0x0200
 
 #define PAL_CYCLES_SCANLINE		((64 * F_CPU / 1000000) - 1)
+// 5.25us
+#define PAL_CYCLES_HSYNC		(21 * F_CPU / 4000000)
 
 #define CHARS_WIDTH				32
 #define CHARS_HEIGHT			24
@@ -40,10 +42,34 @@
 #define PAL_LINES_DBEGIN		((PAL_LINES_PER_FRAME / 2) - (PAL_LINES_CHARS / 2) + 8)
 #define PAL_LINES_DEND			(PAL_LINES_DBEGIN + PAL_LINES_CHARS)
 
+// VM interrupts raised by the video ISR (see video_irq)
+#define VIDEO_IRQ_FRAME			1	// IRQ on each frame
+#define VIDEO_IRQ_KEYB			2	// IRQ while there's keyboard input
+#define VIDEO_NMI_FRAME			4	// NMI on each frame
+
 #define wait_spi_done()			loop_until_bit_is_set(SPSR, SPIF)
 
+extern volatile uint8_t video_irq;
+// set while the video ISR won't use the SPI for a few scanlines (always with
+// the video off)
+extern volatile uint8_t spi_free;
+#ifdef PC_SAMPLES
+// set to stop the VM every PC_SAMPLES scanlines, to sample its PC
+extern volatile uint8_t video_sample;
+#endif
+
 void video_init();
 void video_wait();
+// waits until the SPI can be used and returns how many of size bytes can be
+// moved now in one transaction; in the few lines without video before the
+// display (spi_free is down already) it returns with the interrupts disabled
+// to end before the next line, restore sreg after it. The video lines have
+// no room for one, it waits for spi_free after them.
+// Call it with the interrupts enabled (not from an ISR), it sleeps until
+// the bus is free
+uint16_t video_bus(uint16_t size, uint8_t *sreg);
+void video_wait_frame();
+void video_sleep();
 void video_off();
 void video_on();
 void video_cls(uint8_t c);
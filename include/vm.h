@@ -28,7 +28,7 @@
 #include <stdint.h>
 
 #define addr16(x, y)		((x) | ((y) << 8))
-#define sbit(x)				(1 << x)
+#define sbit(x)				(1 << (x))
 #define testZ(x)			((x) ?  0 : sbit(Zf))
 #define testN(x)            ((x) & sbit(Nf))
 #define testC(x)            ((x) & sbit(Cf))
@@ -45,8 +45,158 @@
 
 #define PROG_START			0x1a00
 
+// size of the instruction prefetch window (3 to 255 bytes)
+#ifndef VM_PREFETCH
+#define VM_PREFETCH			32
+#endif
+
+// the pre-decoded block cache uses the threaded handlers
+#if defined(VM_BLOCKS) && !defined(VM_THREADED)
+#define VM_THREADED
+#endif
+
+// block cache size: slots (power of 2) and instructions per block
+#ifndef VM_BLOCK_SLOTS
+#define VM_BLOCK_SLOTS		1024
+#endif
+#ifndef VM_BLOCK_LEN
+#define VM_BLOCK_LEN		16
+#endif
+
+// with VM_TRACE defined (entries, a power of 2 up to 256) the VM can keep a
+// ring of the last instructions run (see trace in struct vm_state)
+
+// a syscall run again from the same PC within this many cycles is polled
+// from an idle loop (see idle in struct vm_state)
+#ifndef VM_IDLE_CYCLES
+#define VM_IDLE_CYCLES		64
+#endif
+
+// vm_run() return codes
+#define VM_BUDGET			0	// all the instructions in the budget were run
+#define VM_SYS				1	// a syscall was run
+#define VM_HALT				2	// invalid opcode, PC points to it
+#define VM_EVENT			3	// event was set and no interrupt could be taken
+
+// raise an interrupt, vectored through 0xfffe (IRQ) or 0xfffa (NMI) before the
+// next instruction; safe to use from an ISR
+#define vm_irq(vm)			do { (vm)->irq = 1; (vm)->event = 1; } while (0)
+#define vm_nmi(vm)			do { (vm)->nmi = 1; (vm)->event = 1; } while (0)
+
+// the firmware runs a single static VM instance
+#if defined(AVR) && !defined(VM_SINGLE)
+#define VM_SINGLE
+#endif
+
+#ifdef VM_BLOCKS
+// a decoded instruction, a NULL handler ends the block
+struct vm_insn
+{
+	const void *handler;
+	uint8_t cycles;
+	uint8_t bytes[3];
+};
+
+// a decoded basic block: len code bytes starting at pc
+struct vm_block
+{
+	uint16_t pc;
+	uint8_t len;
+	struct vm_insn ins[VM_BLOCK_LEN + 1];
+};
+#endif
+
+#ifdef VM_TRACE
+// an instruction and the registers before running it
+struct vm_trace
+{
+	uint16_t pc;
+	uint8_t op, a, x, y, sp, s;
+};
+#endif
+
+struct vm_state
+{
+	uint8_t a, x, y, sp, s;
+	uint16_t pc;
+
+	// 6502 cycles run since vm_init()
+	uint32_t cycles;
+
+	// set to make vm_run() return before the next instruction, cleared
+	// by the VM; raising an interrupt sets it too
+	volatile uint8_t event;
+
+	// pending interrupts, set them and event (see vm_irq() and vm_nmi());
+	// an IRQ waits while the I flag is set
+	volatile uint8_t irq, nmi;
+
+	// prefetch window: win_len code bytes starting at win_addr
+	uint8_t win[VM_PREFETCH];
+	uint16_t win_addr;
+	uint8_t win_len;
+
+	// PC of the last syscall and cycles when it returned; idle counts the
+	// times in a row it was run again from the same PC within
+	// VM_IDLE_CYCLES, so the syscall can wait for an event instead
+	uint16_t sys_pc;
+	uint32_t sys_cycles;
+	uint8_t idle;
+
+#ifdef VM_TRACE
+	// set to record the instructions in traces, trace_pos is the next entry
+	// and trace_len the ones recorded since vm_init() (up to VM_TRACE)
+	uint8_t trace;
+	uint8_t trace_pos, trace_len;
+	struct vm_trace traces[VM_TRACE];
+#endif
+
+#ifdef VM_BLOCKS
+	// decoded blocks indexed by PC and the pages with code in them
+	// (a few hundred KB, better not on the stack)
+	struct vm_block blocks[VM_BLOCK_SLOTS];
+	uint8_t code_pages[256 / 8];
+#endif
+
+#ifndef VM_SINGLE
+	// memory and syscall callbacks
+	void (*ram_read)(struct vm_state *vm, uint16_t addr, uint8_t *dst, uint8_t size);
+	void (*ram_write)(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size);
+	void (*syscall)(struct vm_state *vm, uint8_t func);
+
+	// for the callbacks
+	void *data;
+	// for a layer wrapping the syscall callback (see journal.h)
+	void *sys_data;
+
+	// optional native routines: a JSR or JMP to an address with its bit set
+	// in traps calls trap instead, that returns 0 to run the code anyway
+	const uint8_t *traps;
+	uint8_t (*trap)(struct vm_state *vm);
+
+	// instructions run by the last vm_run(), including the SYS or invalid
+	// opcode it returned on (an event counts as one)
+	uint16_t ran;
+#endif
+};
+
+#ifdef VM_SINGLE
+// uses vm_ram_read(), vm_ram_write() and vm_syscall()
+extern struct vm_state vm;
+
 void vm_init();
+// run up to budget instructions
+uint8_t vm_run(uint16_t budget);
+// run one instruction, 0 on halt
 uint8_t vm_exec();
+#else // not VM_SINGLE
+// doesn't change the callbacks
+void vm_init(struct vm_state *vm);
+uint8_t vm_run(struct vm_state *vm, uint16_t budget);
+uint8_t vm_exec(struct vm_state *vm);
+// for callbacks changing code out of the VM (size 0 is the whole memory)
+void vm_invalidate(struct vm_state *vm, uint16_t addr, uint16_t size);
+#endif // VM_SINGLE
 
 #endif // _VM_H
 
@@ -51,26 +51,24 @@ uint8_t prog_exit = 0;
 // cursor position
 uint8_t x = 0, y = 0;
 
+#ifdef PC_SAMPLES
+#define SAMPLES_TOP 8
+
+// PC samples per 6502 page (halved when one is full) and the most sampled
+// addresses of the last run
+uint8_t samples[256];
+uint16_t samples_pc[SAMPLES_TOP], samples_count[SAMPLES_TOP];
+#endif
+
 void
 scroll_up()
 {
-	uint8_t b[64];
-	uint16_t i, j, src = VIDEO_ADDR + CHARS_WIDTH * 8, dst = VIDEO_ADDR;
-
 	video_wait();
 
-	for (i = 0; i < CHARS_HEIGHT - 1; i++)
-	{
-		for (j = 0; j < 4; j++)
-		{
-			sram_read(src + j * (CHARS_WIDTH << 1), b, CHARS_WIDTH << 1);
-			sram_write(dst + j * (CHARS_WIDTH << 1), b, CHARS_WIDTH << 1);
-		}
-		src += CHARS_WIDTH * 8;
-		dst += CHARS_WIDTH * 8;
-	}
-	for (j = 0; j < 4; j++)
-		sram_set(dst + j * (CHARS_WIDTH << 1), 0, CHARS_WIDTH << 1);
+	// all the text lines but the first one go up, and the last is cleared
+	sram_move(VIDEO_ADDR, VIDEO_ADDR + CHARS_WIDTH * 8,
+			CHARS_WIDTH * 8 * (CHARS_HEIGHT - 1));
+	sram_set(VIDEO_ADDR + CHARS_WIDTH * 8 * (CHARS_HEIGHT - 1), 0, CHARS_WIDTH * 8);
 }
 
 uint8_t
@@ -301,23 +299,19 @@ put_string(const char *fmt, ...)
 void
 load_data_write(uint8_t byte, void *arg)
 {
-	uint16_t *addr = (uint16_t *)arg;
-
-	sram_write(*addr, &byte, 1);
-	(*addr)++;
+	// the video is off, the stream runs until the end of the load
+	sram_stream_byte(byte);
 }
 
 uint8_t
 load(uint16_t dest_addr, uint8_t quiet)
 {
 	struct decoder_struct dec;
-	uint16_t addr;
 	uint8_t byte;
 	uint32_t timeout;
 	char c;
 
-    addr = dest_addr;
-    init_decoder(&dec, &load_data_write, &addr);
+    init_decoder(&dec, &load_data_write, NULL);
 
 	if (!quiet)
 	{
@@ -342,6 +336,7 @@ load(uint16_t dest_addr, uint8_t quiet)
 
 	// enable audio in
 	ain_on();
+	sram_stream_begin(dest_addr, SRAM_WRITE);
 
 	timeout = LOAD_TIMEOUT;
 	while(1)
@@ -351,6 +346,8 @@ load(uint16_t dest_addr, uint8_t quiet)
 
 		if (!timeout)
 		{
+			// the screen uses the SRAM too
+			sram_stream_end();
 			if (!quiet)
 			{
 				strcpy_P((char *)buffer, text_err_time);
@@ -363,6 +360,7 @@ load(uint16_t dest_addr, uint8_t quiet)
 		byte = ain_get();
 		if (decode(&dec, byte))
 		{
+			sram_stream_end();
 			if (!quiet)
 			{
 				strcpy_P((char *)buffer, text_err_io);
@@ -373,6 +371,7 @@ load(uint16_t dest_addr, uint8_t quiet)
 
 		if (dec.control == C_END)
 		{
+			sram_stream_end();
 			if (!quiet)
 			{
 				strcpy_P((char *)buffer, text_bytes_ready);
@@ -431,11 +430,13 @@ save(uint16_t start_addr, uint16_t end_addr, uint8_t quiet)
 
 	encode_header(&enc, data_len);
 
+	sram_stream_begin(start_addr, SRAM_READ);
 	for (i = 0; i < data_len && !aout_err(); i++)
 	{
-		sram_read(start_addr++, &byte, 1);
+		byte = sram_stream_byte(0);
 		encode_byte(&enc, byte);
 	}
+	sram_stream_end();
 
 	// don't encode the end if there was an error
 	if (!aout_err())
@@ -545,12 +546,73 @@ cmd_load()
 	load(PROG_START, 0);
 }
 
+#ifdef PC_SAMPLES
+void
+sample(uint16_t pc)
+{
+	uint8_t i = 0, min = 0;
+
+	if (++samples[pc >> 8] == 0xff)
+		do
+			samples[i] >>= 1;
+		while (++i);
+
+	// a new address replaces the least sampled one, so the hot ones stay
+	for (i = 0; i < SAMPLES_TOP; i++)
+	{
+		if (samples_pc[i] == pc)
+			break;
+		if (samples_count[i] < samples_count[min])
+			min = i;
+	}
+	if (i == SAMPLES_TOP)
+	{
+		i = min;
+		samples_pc[i] = pc;
+	}
+	if (++samples_count[i] == 0xffff)
+		for (min = 0; min < SAMPLES_TOP; min++)
+			samples_count[min] >>= 1;
+}
+#endif
+
 void
 cmd_run()
 {
+#ifdef PC_SAMPLES
+	uint8_t rc;
+#endif
+
+	// the shell may have changed the SRAM since the last run
+	cache_invalidate();
+#ifdef CACHE_STATS
+	cache_hits = cache_misses = 0;
+#endif
+
 	vm_init();
 	prog_exit = 0;
-	while (!prog_exit && vm_exec());
+	video_irq = 0;
+	// the VM returns on syscalls, so prog_exit is checked after each of them
+#ifdef PC_SAMPLES
+	memset(samples, 0, sizeof(samples));
+	memset(samples_count, 0, sizeof(samples_count));
+	// the ISR stops the VM to take a sample
+	video_sample = 1;
+	while (!prog_exit && (rc = vm_run(0xffff)) != VM_HALT)
+		if (rc == VM_EVENT)
+			sample(vm.pc);
+	video_sample = 0;
+#else
+	while (!prog_exit && vm_run(0xffff) != VM_HALT);
+#endif
+	video_irq = 0;
+
+	// leave the SRAM up to date for the shell
+	cache_flush();
+
+#ifdef CACHE_STATS
+	put_string("cache: %lu hits, %lu misses\n", cache_hits, cache_misses);
+#endif
 }
 
 void
@@ -717,14 +779,107 @@ cmd_as()
 	}
 }
 
+#ifdef PC_SAMPLES
+void
+cmd_prof()
+{
+	uint16_t count[SAMPLES_TOP];
+	uint8_t i, j, top, hits, pages[4];
+
+	memcpy(count, samples_count, sizeof(count));
+
+	// hot addresses, most sampled first
+	for (j = 0; j < SAMPLES_TOP; j++)
+	{
+		top = 0;
+		for (i = 1; i < SAMPLES_TOP; i++)
+			if (count[i] > count[top])
+				top = i;
+		if (!count[top])
+			break;
+
+		put_string(" %04x: %5u  ", samples_pc[top], count[top]);
+		// as the VM reads it, zero page and stack are in the local memory
+		vm_ram_read(samples_pc[top], buffer, 3);
+		dasm_das(samples_pc[top], buffer, (char *)buffer + 3);
+		put_string("%s\n", buffer + 3);
+		count[top] = 0;
+	}
+
+	// and the hot pages
+	for (j = 0; j < 4; j++)
+	{
+		top = hits = 0;
+		i = 0;
+		do
+		{
+			if (samples[i] > hits && !memchr(pages, i, j))
+			{
+				top = i;
+				hits = samples[i];
+			}
+		}
+		while (++i);
+		if (!hits)
+			break;
+
+		pages[j] = top;
+		put_string(" %02xxx: %3u", top, hits);
+	}
+	put_string("\n");
+}
+#endif
+
+#ifdef VM_TRACE
+void
+cmd_trace()
+{
+	uint16_t on = 0xffff;
+	uint8_t i, op[3];
+	struct vm_trace *tr;
+
+	// no parameter leaves on as it is
+	if ((buffer[5] != 0 && buffer[5] != ' ') || get_param(buffer + 5, &on) < 0
+			|| (on != 0xffff && on > 1))
+	{
+		strcpy_P((char *)buffer, text_err_cmd);
+		put_string((const char *)buffer);
+		return;
+	}
+
+	if (on != 0xffff)
+	{
+		vm.trace = on;
+		return;
+	}
+
+	// the last instructions run, oldest first
+	put_string("PC   OP          A  X  Y  SP S\n");
+	for (i = vm.trace_len; i; i--)
+	{
+		tr = &vm.traces[(uint8_t)(vm.trace_pos - i) & (VM_TRACE - 1)];
+		// the operands as they are now, read as the VM does (zero page and
+		// stack are in the local memory)
+		vm_ram_read(tr->pc, op, 3);
+		*op = tr->op;
+		dasm_das(tr->pc, op, (char *)buffer);
+		put_string("%04x %-11s %02x %02x %02x %02x %02x\n", tr->pc, buffer,
+				tr->a, tr->x, tr->y, tr->sp, tr->s);
+	}
+}
+#endif
+
 void
 cmd_help()
 {
 	strcpy_P((char *)buffer, text_cmd_help);
 	put_string((const char *)buffer);
+#if defined(PC_SAMPLES) || defined(VM_TRACE)
+	strcpy_P((char *)buffer, text_cmd_help_extra);
+	put_string((const char *)buffer);
+#endif
 }
 
-#define CMD_COUNT 9
 const Cmd cmds[] PROGMEM = {
 	{ text_run, cmd_run, 0 },
 	{ text_cls, cmd_cls, 0 },
@@ -734,8 +889,15 @@ const Cmd cmds[] PROGMEM = {
 	{ text_save, cmd_save, 1 },
 	{ text_list, cmd_list, 1 },
 	{ text_as, cmd_as, 1 },
+#ifdef PC_SAMPLES
+	{ text_prof, cmd_prof, 0 },
+#endif
+#ifdef VM_TRACE
+	{ text_trace, cmd_trace, 1 },
+#endif
 	{ text_help, cmd_help, 0 }
 };
+#define CMD_COUNT (sizeof(cmds) / sizeof(Cmd))
 
 int
 main()
@@ -34,11 +34,28 @@ const char text_save[] PROGMEM = "save";
 const char text_help[] PROGMEM = "help";
 const char text_list[] PROGMEM = "list";
 const char text_as[] PROGMEM = "as";
+#ifdef PC_SAMPLES
+const char text_prof[] PROGMEM = "prof";
+#endif
+#ifdef VM_TRACE
+const char text_trace[] PROGMEM = "trace";
+#endif
 
 const char text_bytes_ready[] PROGMEM = "%i bytes\nReady\n";
 const char text_press[] PROGMEM = "Press <ENTER> when ready,\n<ESC> to cancel...\n";
 
 const char text_cmd_help[] PROGMEM = " LOAD, SAVE [addr [addr]], RUN\n LIST [addr], AS [addr]\n PEEK [addr], POKE [addr],\n CLS, HELP\n";
+#if defined(PC_SAMPLES) || defined(VM_TRACE)
+// the optional commands
+const char text_cmd_help_extra[] PROGMEM = ""
+#ifdef PC_SAMPLES
+	" PROF"
+#endif
+#ifdef VM_TRACE
+	" TRACE [0|1]"
+#endif
+	"\n";
+#endif
 
 const char text_err_ok[] PROGMEM = "Ok\n";
 const char text_err_addr[] PROGMEM = "ERR: ADDR\n";
@@ -62,11 +79,20 @@ extern const char text_poke[] PROGMEM;
 extern const char text_load[] PROGMEM;
 extern const char text_save[] PROGMEM;
 extern const char text_help[] PROGMEM;
+#ifdef PC_SAMPLES
+extern const char text_prof[] PROGMEM;
+#endif
+#ifdef VM_TRACE
+extern const char text_trace[] PROGMEM;
+#endif
 
 extern const char text_bytes_ready[] PROGMEM;
 extern const char text_press[] PROGMEM;
 
 extern const char text_cmd_help[] PROGMEM;
+#if defined(PC_SAMPLES) || defined(VM_TRACE)
+extern const char text_cmd_help_extra[] PROGMEM;
+#endif
 
 extern const char text_err_ok[] PROGMEM;
 extern const char text_err_addr[] PROGMEM;
@@ -46,12 +46,34 @@ extern uint8_t prog_exit;
 // cursor position
 extern uint8_t x, y;
 
-// VM registers used by syscall
-extern uint8_t r_sp, r_a;
-
 // use local SRAM for zp and hardware stack
 static uint8_t local[512];
 
+// polls in a row (see VM_IDLE_CYCLES) before the loop is considered idle
+#define IDLE_POLLS		4
+
+// get char from an idle loop: sleeps a scanline at a time until there is a
+// key or an interrupt (for up to a frame) and counts each as one iteration
+// of the loop
+static uint8_t
+idle_keyboard_asc()
+{
+	uint32_t loop = vm.cycles - vm.sys_cycles;
+	uint16_t lines = 0;
+	uint8_t c;
+
+	do
+	{
+		video_sleep();
+		c = keyboard_asc();
+	}
+	while (!c && !vm.event && ++lines < PAL_LINES_PER_FRAME);
+
+	vm.cycles += loop * lines;
+
+	return c;
+}
+
 void
 vm_ram_read(uint16_t addr, uint8_t *dst, uint8_t size)
 {
@@ -70,14 +92,12 @@ vm_ram_read(uint16_t addr, uint8_t *dst, uint8_t size)
 		memcpy(dst, local + addr, part);
 	}
 
-	if (size)
-	{
-		addr += part;
-		dst += part;
-		size -= part;
+	addr += part;
+	dst += part;
+	size -= part;
 
-		sram_read(addr, dst, size);
-	}
+	if (size)
+		cache_read(addr, dst, size);
 }
 
 void
@@ -98,13 +118,47 @@ vm_ram_write(uint16_t addr, uint8_t *src, uint8_t size)
 		memcpy(local + addr, src, part);
 	}
 
+	addr += part;
+	src += part;
+	size -= part;
+
 	if (size)
+		cache_write(addr, src, size);
+}
+
+// like memmove, through buffer
+static void
+ram_move(uint16_t dst, uint16_t src, uint16_t count)
+{
+	uint8_t part;
+	// the destination overlaps the end of the source, move from the end
+	uint8_t back = (uint16_t)(dst - src) < count;
+
+	if (back)
 	{
-		addr += part;
-		src += part;
-		size -= part;
+		dst += count;
+		src += count;
+	}
+
+	while (count)
+	{
+		part = count > 128 ? 128 : count;
+		count -= part;
+
+		if (back)
+		{
+			dst -= part;
+			src -= part;
+		}
 
-		sram_write(addr, src, size);
+		vm_ram_read(src, buffer, part);
+		vm_ram_write(dst, buffer, part);
+
+		if (!back)
+		{
+			dst += part;
+			src += part;
+		}
 	}
 }
 
@@ -112,7 +166,7 @@ void
 vm_syscall(uint8_t func)
 {
 	uint8_t v[6];
-	uint16_t addr, count, fd, size, i;
+	uint16_t addr, count, fd, size, src, i;
 
 	switch(func)
 	{
@@ -121,7 +175,7 @@ vm_syscall(uint8_t func)
 			//  in: exit code
 			// ret: -
 			prog_exit = 1;
-			vm_ram_read(addr16(r_sp + 1, 1), v, 1);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 1);
 			if (*v)
 			{
 				strcpy_P((char *)buffer, text_err_prg);
@@ -137,55 +191,59 @@ vm_syscall(uint8_t func)
 			// load data
 			//  in: addr to destination
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 2);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
 			addr = addr16(v[1], v[0]);
+			// load writes to the SRAM directly
+			cache_invalidate();
 			// quiet = 1, suppress error output
-			r_a = load(addr, 1);
+			vm.a = load(addr, 1);
 			break;
 		case 0x02:
 			// save data
 			//  in: addr of start, number bytes to save
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 4);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 4);
 			addr = addr16(v[1], v[0]);
 			count = addr16(v[3], v[2]);
+			// save reads from the SRAM directly
+			cache_flush();
 			// quiet = 1, suppress error output
-			r_a = save(addr, addr + count, 1);
+			vm.a = save(addr, addr + count, 1);
 			break;
 		case 0x10:
 			// put char
 			//  in: character
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 1);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 1);
 			video_put_char(x, y, *v);
-			r_a = 0;
+			vm.a = 0;
 			break;
 		case 0x11:
 			// put string
 			//  in: addr to zstring
 			// ret: number of printed characters
-			vm_ram_read(addr16(r_sp + 1, 1), v, 2);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
 			addr = addr16(v[1], v[0]);
-			r_a = 0;
+			vm.a = 0;
 			while(1)
 			{
 				vm_ram_read(addr++, v, 1);
 				if (!*v)
 					break;
 				put_char(*v);
-				r_a++;
+				vm.a++;
 			}
 			break;
 		case 0x12:
 			// set cursor position
 			//  in: x, y
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 2);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
 			if (v[0] > 31 || v[1] > 23)
-				r_a = 1;
+				vm.a = 1;
 			else
 			{
-				r_a = 0;
+				vm.a = 0;
 				x = v[0];
 				y = v[1];
 			}
@@ -194,16 +252,16 @@ vm_syscall(uint8_t func)
 			// fill screen
 			//  in: character
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 1);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 1);
 			video_cls(*v);
-			r_a = x = y = 0;
+			vm.a = x = y = 0;
 			break;
 		case 0x14:
 			// write
 			//  in: fd, buffer addr, count
 			// ret: bytes written, 0 on error
-			r_a = 0;
-			vm_ram_read(addr16(r_sp + 1, 1), v, 6);
+			vm.a = 0;
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 6);
 			fd = addr16(v[1], v[0]);
 			addr = addr16(v[3], v[2]);
 			count = addr16(v[5], v[4]);
@@ -211,7 +269,7 @@ vm_syscall(uint8_t func)
 			// only stdout and stderr
 			if (fd > 0 && fd < 3 && count)
 			{
-				r_a += count;
+				vm.a += count;
 				while (count)
 				{
 					size = count < 64 ? count : 64;
@@ -227,7 +285,9 @@ vm_syscall(uint8_t func)
 			// get char
 			//  in: -
 			// ret: character ascii or 0
-			r_a = keyboard_asc();
+			vm.a = keyboard_asc();
+			if (!vm.a && vm.idle >= IDLE_POLLS)
+				vm.a = idle_keyboard_asc();
 			break;
 		case 0x21:
 			// get input
@@ -235,17 +295,17 @@ vm_syscall(uint8_t func)
 			// ret: number of characters read
 			//
 			// The size of the buffer is limited to 64 chars
-			vm_ram_read(addr16(r_sp + 1, 1), v, 3);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 3);
 			addr = addr16(v[1], v[0]);
-			r_a = buffered_input(buffer, v[2] < 64 ? v[2] : 64);
-			vm_ram_write(addr, buffer, r_a);
+			vm.a = buffered_input(buffer, v[2] < 64 ? v[2] : 64);
+			vm_ram_write(addr, buffer, vm.a);
 			break;
 		case 0x22:
 			// read
 			//  in: fd, buffer addr, count
 			// ret: bytes read, 0 on error
-			r_a = 0;
-			vm_ram_read(addr16(r_sp + 1, 1), v, 6);
+			vm.a = 0;
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 6);
 			fd = addr16(v[1], v[0]);
 			addr = addr16(v[3], v[2]);
 			count = addr16(v[5], v[4]);
@@ -264,7 +324,7 @@ vm_syscall(uint8_t func)
 							*v = '\n';
 						vm_ram_write(addr++, v, 1);
 						count--;
-						r_a++;
+						vm.a++;
 					}
 				}
 			}
@@ -273,7 +333,7 @@ vm_syscall(uint8_t func)
 			// put tile
 			//  in: addr to tile definition (8 bytes)
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 2);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
 			addr = addr16(v[1], v[0]);
 			vm_ram_read(addr, buffer, 8);
 			video_put_tile(x, y, buffer);
@@ -282,27 +342,78 @@ vm_syscall(uint8_t func)
 			// get random
 			//  in: -
 			// ret: random byte
-			r_a = rand() & 0xff;
+			vm.a = rand() & 0xff;
 			break;
 		case 0xa1:
 			// wait for vsync
 			//  in: -
 			// ret: 0 on success
-			video_wait();
+			//
+			// Called again right away it waits for the next frame instead
+			// of returning until the current vsync ends
+			if (vm.idle)
+				video_wait_frame();
+			else
+				video_wait();
 			break;
 		case 0xa2:
 			// srand
 			//  in: random seed
 			// ret: 0 on success
-			vm_ram_read(addr16(r_sp + 1, 1), v, 2);
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
 			srand(addr16(v[1], v[0]));
-			r_a = 0;
+			vm.a = 0;
+			break;
+		case 0xa3:
+			// get cycles
+			//  in: addr to destination (4 bytes)
+			// ret: 0 on success
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 2);
+			addr = addr16(v[1], v[0]);
+			v[0] = (uint8_t)vm.cycles;
+			v[1] = (uint8_t)(vm.cycles >> 8);
+			v[2] = (uint8_t)(vm.cycles >> 16);
+			v[3] = (uint8_t)(vm.cycles >> 24);
+			vm_ram_write(addr, v, 4);
+			vm.a = 0;
+			break;
+		case 0xa4:
+			// set interrupts
+			//  in: sources
+			// ret: 0 on success
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 1);
+			video_irq = *v & (VIDEO_IRQ_FRAME | VIDEO_IRQ_KEYB | VIDEO_NMI_FRAME);
+			vm.a = 0;
+			break;
+		case 0xa5:
+			// move memory
+			//  in: addr to destination, addr to source, number of bytes
+			// ret: 0 on success
+			vm_ram_read(addr16(vm.sp + 1, 1), v, 6);
+			addr = addr16(v[1], v[0]);
+			src = addr16(v[3], v[2]);
+			count = addr16(v[5], v[4]);
+			if (addr < 512 || src < 512 || (uint32_t)addr + count > 0x10000
+					|| (uint32_t)src + count > 0x10000)
+				// local memory or wrapping around
+				ram_move(addr, src, count);
+			else
+				// from the SRAM to the SRAM, it writes back and drops the
+				// cached lines
+				sram_move(addr, src, count);
+			vm.a = 0;
 			break;
 		case 0xf0:
 			// get version
 			//  in: _
-			// ret: version (x.y as (x | (y << 4)))
-			r_a = 1;
+			// ret: version (x.y as (x | (y << 4))), X is 1 when the VM runs
+			//      65C02 code
+			vm.a = 1;
+#ifdef VM_65C02
+			vm.x = 1;
+#else
+			vm.x = 0;
+#endif
 			break;
 		default:
 			prog_exit = 1;
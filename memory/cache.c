@@ -0,0 +1,165 @@
+/*
+ * cache.c (write-back line cache for the external SRAM)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include "hardware.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "video.h"
+#include "memory.h"
+
+// the video RAM is read directly by the video ISR, keep it out of the cache
+#define CACHE_START		(VIDEO_ADDR + CHARS_WIDTH * PAL_LINES_CHARS)
+
+#define LINE_VALID		1
+#define LINE_DIRTY		2
+
+#if (CACHE_LINES & (CACHE_LINES - 1)) || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1))
+#error "CACHE_LINES and CACHE_LINE_SIZE must be powers of 2"
+#endif
+
+static uint8_t lines[CACHE_LINES][CACHE_LINE_SIZE];
+static uint16_t tags[CACHE_LINES];
+static uint8_t state[CACHE_LINES];
+
+#ifdef CACHE_STATS
+uint32_t cache_hits, cache_misses;
+#endif
+
+static uint8_t *
+cache_line(uint16_t addr, uint8_t write)
+{
+	uint16_t base = addr & ~(CACHE_LINE_SIZE - 1);
+	uint8_t i = (addr / CACHE_LINE_SIZE) & (CACHE_LINES - 1);
+
+	if (!(state[i] & LINE_VALID) || tags[i] != base)
+	{
+#ifdef CACHE_STATS
+		cache_misses++;
+#endif
+		if (state[i] & LINE_DIRTY)
+			sram_write(tags[i], lines[i], CACHE_LINE_SIZE);
+
+		sram_read(base, lines[i], CACHE_LINE_SIZE);
+		tags[i] = base;
+		state[i] = LINE_VALID;
+	}
+#ifdef CACHE_STATS
+	else
+		cache_hits++;
+#endif
+
+	if (write)
+		state[i] |= LINE_DIRTY;
+
+	return lines[i] + (addr & (CACHE_LINE_SIZE - 1));
+}
+
+void
+cache_read(uint16_t addr, uint8_t *dst, uint16_t size)
+{
+	uint16_t part;
+
+	while (size)
+	{
+		if (addr < CACHE_START)
+		{
+			part = CACHE_START - addr;
+			if (part > size)
+				part = size;
+
+			sram_read(addr, dst, part);
+		}
+		else
+		{
+			part = CACHE_LINE_SIZE - (addr & (CACHE_LINE_SIZE - 1));
+			if (part > size)
+				part = size;
+
+			memcpy(dst, cache_line(addr, 0), part);
+		}
+
+		addr += part;
+		dst += part;
+		size -= part;
+	}
+}
+
+void
+cache_write(uint16_t addr, const uint8_t *src, uint16_t size)
+{
+	uint16_t part;
+
+	while (size)
+	{
+		if (addr < CACHE_START)
+		{
+			part = CACHE_START - addr;
+			if (part > size)
+				part = size;
+
+			sram_write(addr, src, part);
+		}
+		else
+		{
+			part = CACHE_LINE_SIZE - (addr & (CACHE_LINE_SIZE - 1));
+			if (part > size)
+				part = size;
+
+			memcpy(cache_line(addr, 1), src, part);
+		}
+
+		addr += part;
+		src += part;
+		size -= part;
+	}
+}
+
+void
+cache_flush()
+{
+	uint8_t i;
+
+	for (i = 0; i < CACHE_LINES; i++)
+		if (state[i] & LINE_DIRTY)
+		{
+			sram_write(tags[i], lines[i], CACHE_LINE_SIZE);
+			state[i] &= ~LINE_DIRTY;
+		}
+}
+
+void
+cache_invalidate()
+{
+	cache_flush();
+	memset(state, 0, CACHE_LINES);
+}
+
+uint8_t *
+cache_borrow()
+{
+	cache_invalidate();
+	return lines[0];
+}
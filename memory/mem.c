@@ -30,99 +30,184 @@
 #include "video.h"
 #include "memory.h"
 
-void
-sram_write(uint16_t addr, const uint8_t *data, uint16_t size)
+// selects the SRAM and sends the command and the address
+static void
+sram_open(uint8_t cmd, uint16_t addr)
 {
-	uint16_t pt;
-
-	video_wait();
+	if (cmd == SRAM_READ)
+	{
+		// enable DATA
+		PORTD &= ~_BV(PORTD2);
+		PORTD |= _BV(PORTD5);
+	}
 
 	// select SRAM
 	PORTD &= ~_BV(PORTD6);
 
-	// WRITE to SRAM
-	SPDR = 0x02;
+	SPDR = cmd;
 	wait_spi_done();
 
 	SPDR = (uint8_t)(addr >> 8);
 	wait_spi_done();
 	SPDR = (uint8_t)(addr);
 	wait_spi_done();
+}
 
-	for (pt = 0; pt < size; pt++)
-	{
-		SPDR = data[pt];
-		wait_spi_done();
-	}
-
+static void
+sram_close(uint8_t cmd)
+{
 	// deselect SRAM
 	PORTD |= _BV(PORTD6);
+
+	if (cmd == SRAM_READ)
+	{
+		// disable DATA
+		PORTD |= _BV(PORTD2);
+		PORTD &= ~_BV(PORTD5);
+	}
 }
 
+// the transfers are split in as many transactions as video_bus() allows, so
+// they can run between the video lines; it may disable the interrupts for
+// one, so the state it saved is restored after closing it
+
 void
-sram_set(uint16_t addr, uint8_t c, uint16_t times)
+sram_write(uint16_t addr, const uint8_t *data, uint16_t size)
 {
-	uint16_t i;
+	uint16_t part;
+	uint8_t sreg;
 
-	video_wait();
-
-	// select SRAM
-	PORTD &= ~_BV(PORTD6);
-
-	// WRITE to SRAM
-	SPDR = 0x02;
-	wait_spi_done();
+	while (size)
+	{
+		part = video_bus(size, &sreg);
+		sram_open(SRAM_WRITE, addr);
+		addr += part;
+		size -= part;
+
+		while (part--)
+		{
+			SPDR = *data++;
+			wait_spi_done();
+		}
+
+		sram_close(SRAM_WRITE);
+		SREG = sreg;
+	}
+}
 
-	SPDR = (uint8_t)(addr >> 8);
-	wait_spi_done();
-	SPDR = (uint8_t)(addr);
-	wait_spi_done();
+void
+sram_set(uint16_t addr, uint8_t c, uint16_t times)
+{
+	uint16_t part;
+	uint8_t sreg;
 
-	for (i = 0; i < times; i++)
+	while (times)
 	{
-		SPDR = c;
-		wait_spi_done();
+		part = video_bus(times, &sreg);
+		sram_open(SRAM_WRITE, addr);
+		addr += part;
+		times -= part;
+
+		while (part--)
+		{
+			SPDR = c;
+			wait_spi_done();
+		}
+
+		sram_close(SRAM_WRITE);
+		SREG = sreg;
 	}
-
-	// deselect SRAM
-	PORTD |= _BV(PORTD6);
 }
 
 void
 sram_read(uint16_t addr, uint8_t *data, uint16_t size)
 {
-	uint16_t pt;
+	uint16_t part;
+	uint8_t sreg;
 
-	video_wait();
-
-	// enable DATA
-	PORTD &= ~_BV(PORTD2);
-	PORTD |= _BV(PORTD5);
+	while (size)
+	{
+		part = video_bus(size, &sreg);
+		sram_open(SRAM_READ, addr);
+		addr += part;
+		size -= part;
+
+		while (part--)
+		{
+			SPDR = 0xff;
+			wait_spi_done();
+			*data++ = SPDR;
+		}
+
+		sram_close(SRAM_READ);
+		SREG = sreg;
+	}
+}
 
-	// select SRAM
-	PORTD &= ~_BV(PORTD6);
+// sram_move() stages the data in the cache lines, the largest buffer there
+// is and no extra stack for the syscalls calling it (put_char() ->
+// scroll_up()); each part is as many transactions as video_bus() grants
+#define MOVE_BUFFER		(CACHE_LINES * CACHE_LINE_SIZE)
 
-	// READ from SRAM
-	SPDR = 0x03;
-	wait_spi_done();
+void
+sram_move(uint16_t dst, uint16_t src, uint16_t len)
+{
+	uint8_t *buffer = cache_borrow();
+	uint16_t part;
+	// the destination overlaps the end of the source, move from the end
+	uint8_t back = (uint16_t)(dst - src) < len;
 
-	SPDR = (uint8_t)(addr >> 8);
-	wait_spi_done();
-	SPDR = (uint8_t)(addr);
-	wait_spi_done();
+	if (back)
+	{
+		dst += len;
+		src += len;
+	}
 
-	for (pt = 0; pt < size; pt++)
+	while (len)
 	{
-		SPDR = 0xff;
-		wait_spi_done();
-		data[pt] = SPDR;
+		part = len > MOVE_BUFFER ? MOVE_BUFFER : len;
+		len -= part;
+
+		if (back)
+		{
+			dst -= part;
+			src -= part;
+		}
+
+		sram_read(src, buffer, part);
+		sram_write(dst, buffer, part);
+
+		if (!back)
+		{
+			dst += part;
+			src += part;
+		}
 	}
+}
 
-	// deselect SRAM
-	PORTD |= _BV(PORTD6);
+static uint8_t stream_dir;
 
-	// disable DATA
-	PORTD |= _BV(PORTD2);
-	PORTD &= ~_BV(PORTD5);
+void
+sram_stream_begin(uint16_t addr, uint8_t dir)
+{
+	// the video ISR would select the SRAM in the middle of the transaction
+	video_off();
+
+	stream_dir = dir;
+	sram_open(dir, addr);
 }
 
+uint8_t
+sram_stream_byte(uint8_t b)
+{
+	SPDR = stream_dir == SRAM_READ ? 0xff : b;
+	wait_spi_done();
+
+	return SPDR;
+}
+
+void
+sram_stream_end()
+{
+	sram_close(stream_dir);
+}
@@ -0,0 +1,270 @@
+#!/usr/bin/env python
+
+from argparse import ArgumentParser
+import struct
+
+__version__ = "1.0"
+
+# cc65 object format (ar65 library of ca65 objects, version 17)
+LIB_MAGIC = 0x7a55616e
+OBJ_MAGIC = 0x616e7a55
+
+FRAG_TYPEMASK = 0x38
+FRAG_BYTEMASK = 0x07
+FRAG_LITERAL = 0x00
+FRAG_EXPR = 0x08
+FRAG_SEXPR = 0x10
+FRAG_FILL = 0x20
+
+EXPR_LITERAL = 0x81
+EXPR_SYMBOL = 0x82
+EXPR_SECTION = 0x83
+
+EXP_EXPR = 0x10
+EXP_SIZE = 0x08
+EXP_CONDES_MASK = 0x07
+
+
+class Reader(object):
+
+    def __init__(self, data, pos=0):
+        self.data = data
+        self.pos = pos
+
+    def u8(self):
+        value = self.data[self.pos]
+        self.pos += 1
+        return value
+
+    def u16(self):
+        value = struct.unpack_from("<H", self.data, self.pos)[0]
+        self.pos += 2
+        return value
+
+    def u32(self):
+        value = struct.unpack_from("<I", self.data, self.pos)[0]
+        self.pos += 4
+        return value
+
+    def var(self):
+        value = shift = 0
+        while True:
+            b = self.u8()
+            value |= (b & 0x7f) << shift
+            shift += 7
+            if not b & 0x80:
+                return value
+
+    def string(self):
+        size = self.var()
+        value = self.data[self.pos:self.pos + size]
+        self.pos += size
+        return value.decode("latin-1")
+
+    def skip_list(self):
+        for _ in range(self.var()):
+            self.var()
+
+    def expr(self):
+        op = self.u8()
+        if op == 0:
+            return None
+        if op == EXPR_LITERAL:
+            return ("lit", struct.unpack("<i", struct.pack("<I", self.u32()))[0])
+        if op == EXPR_SYMBOL:
+            return ("sym", self.var())
+        if op == EXPR_SECTION:
+            return ("sec", self.var())
+        if op & 0x80:
+            raise ValueError("unsupported expression leaf %02x" % op)
+        return (op, self.expr(), self.expr())
+
+
+class Module(object):
+
+    def __init__(self, name, data):
+        self.name = name
+        r = Reader(data, 8)
+        sections = [(r.u32(), r.u32()) for _ in range(11)]
+
+        r.pos = sections[7][0]
+        strings = [r.string() for _ in range(r.var())]
+
+        r.pos = sections[3][0]
+        self.imports = []
+        for _ in range(r.var()):
+            r.u8()
+            self.imports.append(strings[r.var()])
+            r.skip_list()
+            r.skip_list()
+
+        r.pos = sections[4][0]
+        self.exports = {}
+        for _ in range(r.var()):
+            kind = r.var()
+            r.u8()
+            for _ in range(kind & EXP_CONDES_MASK):
+                r.u8()
+            name = strings[r.var()]
+            if kind & EXP_EXPR:
+                value = r.expr()
+            else:
+                value = ("lit", r.u32())
+            if kind & EXP_SIZE:
+                r.var()
+            r.skip_list()
+            r.skip_list()
+            self.exports[name] = value
+
+        r.pos = sections[2][0]
+        self.segments = []
+        for _ in range(r.var()):
+            size = r.u32()
+            start = r.pos
+            name = strings[r.var()]
+            r.var()
+            seg_size = r.var()
+            r.var()
+            r.u8()
+            frags = []
+            for _ in range(r.var()):
+                kind = r.u8()
+                if kind & FRAG_TYPEMASK == FRAG_LITERAL:
+                    n = r.var()
+                    frags.append(("lit", r.data[r.pos:r.pos + n]))
+                    r.pos += n
+                elif kind & FRAG_TYPEMASK in (FRAG_EXPR, FRAG_SEXPR):
+                    frags.append(("expr", kind & FRAG_BYTEMASK, r.expr()))
+                elif kind & FRAG_TYPEMASK == FRAG_FILL:
+                    frags.append(("lit", bytearray(r.var())))
+                else:
+                    raise ValueError("unsupported fragment %02x" % kind)
+                r.skip_list()
+            self.segments.append((name, seg_size, frags))
+            r.pos = start + size
+        self.base = [0] * len(self.segments)
+
+
+def read_lib(filename):
+    with open(filename, "rb") as fd:
+        data = bytearray(fd.read())
+
+    r = Reader(data)
+    if r.u32() != LIB_MAGIC:
+        raise ValueError("%s is not a cc65 library" % filename)
+    r.u16()
+    r.u16()
+    r.pos = r.u32()
+
+    modules = []
+    for _ in range(r.var()):
+        name = r.string()
+        r.u16()
+        r.u32()
+        offset = r.u32()
+        size = r.u32()
+        if struct.unpack_from("<I", data, offset)[0] != OBJ_MAGIC:
+            raise ValueError("%s: bad object %s" % (filename, name))
+        modules.append(Module(name, data[offset:offset + size]))
+
+    return modules
+
+
+def link(modules, names, start):
+    exports = {}
+    for mod in modules:
+        for name in mod.exports:
+            exports.setdefault(name, mod)
+
+    linked = []
+    pending = list(names)
+    while pending:
+        name = pending.pop(0)
+        if name not in exports:
+            raise ValueError("unresolved symbol %s" % name)
+        mod = exports[name]
+        if mod not in linked:
+            linked.append(mod)
+            pending.extend(mod.imports)
+
+    # the zero page at 0, then the program segments in the d64.cfg order
+    zp, addr = 0, start
+    for seg in ("ZEROPAGE", "CODE", "RODATA", "DATA", "BSS"):
+        for mod in linked:
+            for i, (name, size, _) in enumerate(mod.segments):
+                if name != seg:
+                    continue
+                if seg == "ZEROPAGE":
+                    mod.base[i] = zp
+                    zp += size
+                else:
+                    mod.base[i] = addr
+                    addr += size
+        if seg == "DATA":
+            end = addr
+
+    def value(mod, expr):
+        if expr[0] == "lit":
+            return expr[1]
+        if expr[0] == "sec":
+            return mod.base[expr[1]]
+        if expr[0] == "sym":
+            name = mod.imports[expr[1]]
+            return value(exports[name], exports[name].exports[name])
+        left, right = value(mod, expr[1]), value(mod, expr[2])
+        if expr[0] == 0x01:
+            return left + right
+        if expr[0] == 0x02:
+            return left - right
+        raise ValueError("unsupported expression operator %02x" % expr[0])
+
+    image = bytearray(end - start)
+    for mod in linked:
+        for i, (name, size, frags) in enumerate(mod.segments):
+            if name in ("ZEROPAGE", "BSS") or not frags:
+                continue
+            pos = mod.base[i] - start
+            for frag in frags:
+                if frag[0] == "lit":
+                    data = frag[1]
+                else:
+                    v = value(mod, frag[2]) & ((1 << (8 * frag[1])) - 1)
+                    data = bytearray(struct.pack("<I", v)[:frag[1]])
+                image[pos:pos + len(data)] = data
+                pos += len(data)
+
+    labels = {}
+    for mod in linked:
+        for name, expr in mod.exports.items():
+            labels[name] = value(mod, expr)
+
+    return image, labels
+
+
+def main():
+
+    parser = ArgumentParser(description="Links cc65 runtime routines from a library",
+                            epilog="Copyright (C) 2015 Juan J Martinez <jjm@usebox.net>",
+                            )
+
+    parser.add_argument("--version", action="version", version="%(prog)s "  + __version__)
+    parser.add_argument("-s", "--start", dest="start", default="0x1a00",
+                        help="code address (default: 0x1a00)")
+    parser.add_argument("lib", help="cc65 library (rt.lib)")
+    parser.add_argument("output", help="binary file to write")
+    parser.add_argument("labels", help="label file to write (same as ld65 -Ln)")
+    parser.add_argument("symbols", nargs="+", help="symbols to link")
+
+    args = parser.parse_args()
+
+    image, labels = link(read_lib(args.lib), args.symbols, int(args.start, 0))
+
+    with open(args.output, "wb") as fd:
+        fd.write(image)
+
+    with open(args.labels, "w") as fd:
+        for name, addr in sorted(labels.items(), key=lambda x: (x[1], x[0])):
+            fd.write("al %06X .%s\n" % (addr, name))
+
+if __name__ == "__main__":
+    main()
@@ -34,17 +34,101 @@
 
 #include "memory.h"
 #include "video.h"
+#include "vm.h"
 #include "font.h"
 
 volatile uint8_t vsync;
+volatile uint8_t spi_free;
 volatile uint16_t scanline;
 volatile uint8_t adj_pal_lines;
 volatile uint8_t cursor = 0;
+volatile uint8_t video_irq = 0;
+#ifdef PC_SAMPLES
+volatile uint8_t video_sample = 0;
+static uint8_t sample_lines = PC_SAMPLES;
+#endif
 
 void
 video_wait()
 {
-	while(!vsync);
+	while(!vsync)
+		video_sleep();
+}
+
+// cycles from the timer overflow to the ISR dropping the sync (its prologue);
+// an estimate, not measured on the board. The sync pulse of the lines with
+// no video also stretches by the latency of the TIMER1_COMPB ISR, that can
+// be late by an instruction or another ISR running (video_bus() windows end
+// at HSYNC_END, so they only add to it if the estimate is short)
+#define HSYNC_ENTRY		32
+#define HSYNC_END		(HSYNC_ENTRY + PAL_CYCLES_HSYNC)
+
+// a transaction between two scanlines: the cycles to set it up (about 20
+// per command and address byte, the rest is margin for the ISR to start on
+// time) and the cycles per byte moved
+#define BUS_SETUP		128
+#define BUS_BYTE		32
+// bytes in a transaction out of the video lines, it has to end in the
+// scanlines between spi_free going down and the first video line
+#define BUS_MAX			128
+
+uint16_t
+video_bus(uint16_t size, uint8_t *sreg)
+{
+	uint16_t left, now;
+	uint8_t hsync;
+
+	if (size > BUS_MAX)
+		size = BUS_MAX;
+
+	*sreg = SREG;
+	while (1)
+	{
+		cli();
+		if (spi_free)
+		{
+			SREG = *sreg;
+			return size;
+		}
+
+		// only the lines without video where TIMER1_COMPB ends the sync have
+		// room for a transaction; on a video line the ISR takes ~950 of its
+		// 1024 cycles (hsync 200, fetch 630), so those wait for spi_free.
+		// The time to the next scanline, or to the end of the sync pulse,
+		// unless one of the ISRs is already due
+		now = TCNT1;
+		hsync = TIMSK1 & _BV(OCIE1B);
+		if (hsync && !(TIFR1 & (_BV(TOV1) | _BV(OCF1B))))
+		{
+			left = now < HSYNC_END ? HSYNC_END - now : ICR1 - now;
+			if (left >= BUS_SETUP + BUS_BYTE)
+			{
+				left = (left - BUS_SETUP) / BUS_BYTE;
+				return left < size ? left : size;
+			}
+		}
+
+		SREG = *sreg;
+		video_sleep();
+	}
+}
+
+// waits for the next vsync even if in one already
+void
+video_wait_frame()
+{
+	while(vsync && (TIMSK1 & _BV(TOIE1)))
+		video_sleep();
+	video_wait();
+}
+
+// sleeps until the next scanline interrupt, or returns with the video off;
+// waking up from idle mode also makes the ISR start with no jitter
+void
+video_sleep()
+{
+	if (TIMSK1 & _BV(TOIE1))
+		sleep_mode();
 }
 
 void
@@ -71,6 +155,11 @@ video_init()
 
 	TCNT1 = 0;
 	ICR1 = PAL_CYCLES_SCANLINE;
+	// end of the sync pulse in the lines without video
+	OCR1B = HSYNC_END;
+
+	// the timer and the USART run in idle mode
+	set_sleep_mode(SLEEP_MODE_IDLE);
 
 	video_on();
 }
@@ -78,8 +167,9 @@ video_init()
 void
 video_off()
 {
-    TIMSK1 &= ~_BV(TOIE1);
+    TIMSK1 &= ~(_BV(TOIE1) | _BV(OCIE1B));
 	vsync = 1;
+	spi_free = 1;
 }
 
 void
@@ -87,6 +177,7 @@ video_on()
 {
 	adj_pal_lines = 1;
 	vsync = 0;
+	spi_free = 0;
 	scanline = 310;
 
 	// set the timer overflow interrupt
@@ -162,19 +253,35 @@ video_put_tile(uint8_t x, uint8_t y, const uint8_t *tile)
 	}
 }
 
+// ends the sync pulse of the lines without video, so the ISR doesn't wait
+// for it; it doesn't change any register or the flags
+ISR(TIMER1_COMPB_vect, ISR_NAKED)
+{
+	PORTD |= _BV(PORTD7);
+	reti();
+}
+
 ISR(TIMER1_OVF_vect)
 {
 	uint8_t column = CHARS_WIDTH;
 	uint16_t addr;
 
-	if (scanline > 5 && scanline < 310)
+	if (scanline >= PAL_LINES_DBEGIN && scanline < PAL_LINES_DEND)
 	{
-		// horizontal sync
+		// horizontal sync, the video follows it
 		PORTD &= ~_BV(PORTD7);
+		TIMSK1 = _BV(TOIE1);
 		_delay_us(5.25);
 		PORTD |= _BV(PORTD7);
 		_delay_us(7.0);
 	}
+	else if (scanline > 5 && scanline < 310)
+	{
+		// horizontal sync, TIMER1_COMPB ends it
+		PORTD &= ~_BV(PORTD7);
+		TIFR1 = _BV(OCF1B);
+		TIMSK1 = _BV(TOIE1) | _BV(OCIE1B);
+	}
 	else
 	{
 		// extra delay to avoid first line artifacts
@@ -184,14 +291,23 @@ ISR(TIMER1_OVF_vect)
 		PORTD |= _BV(PORTD7);
 		_delay_us(10);
 		PORTD &= ~_BV(PORTD7);
+		TIMSK1 = _BV(TOIE1);
 
 		if (scanline == 310)
+		{
 			vsync = 1;
+			spi_free = 1;
+
+			if (video_irq & VIDEO_IRQ_FRAME)
+				vm_irq(&vm);
+			if (video_irq & VIDEO_NMI_FRAME)
+				vm_nmi(&vm);
+		}
 	}
 
 	// the RAM needs extra time :(
 	if (scanline + 6 == PAL_LINES_DBEGIN)
-		vsync = 0;
+		vsync = spi_free = 0;
 
 	if (scanline >= PAL_LINES_DBEGIN && scanline < PAL_LINES_DEND)
 	{
@@ -209,17 +325,32 @@ ISR(TIMER1_OVF_vect)
 		SPDR = (uint8_t)(addr);
 		wait_spi_done();
 
-		do
-		{
-			SPDR = 0xff;
-			_delay_us(0.752);
-		}
-		while(--column);
+		// a byte every 17 cycles: the SPI takes 16 to shift it out and
+		// writing SPDR before that drops the byte (WCOL), so 1 of margin
+		__asm__ __volatile__ (
+			"1:" "\n\t"
+			"out %[spdr], %[pixels]" "\n\t"
+			"rjmp .+0" "\n\t"
+			"rjmp .+0" "\n\t"
+			"rjmp .+0" "\n\t"
+			"rjmp .+0" "\n\t"
+			"rjmp .+0" "\n\t"
+			"rjmp .+0" "\n\t"
+			"nop" "\n\t"
+			"dec %[column]" "\n\t"
+			"brne 1b" "\n\t"
+			: [column] "+r" (column)
+			: [spdr] "I" (_SFR_IO_ADDR(SPDR)), [pixels] "r" ((uint8_t)0xff)
+		);
 
 		// deselect SRAM
 		PORTD |= _BV(PORTD6);
 
 		wait_spi_done();
+
+		// no more video lines in this frame
+		if (scanline == PAL_LINES_DEND - 1)
+			spi_free = 1;
 	}
 
 	if (scanline == 6)
@@ -232,5 +363,18 @@ ISR(TIMER1_OVF_vect)
 	scanline++;
 	if (scanline > PAL_LINES_PER_FRAME)
 		scanline = 1;
+
+	// until the program reads the keyboard
+	if ((video_irq & VIDEO_IRQ_KEYB) && (UCSR0A & _BV(RXC0)))
+		vm_irq(&vm);
+
+#ifdef PC_SAMPLES
+	// vm_run() returns before the next instruction with PC up to date
+	if (video_sample && !--sample_lines)
+	{
+		sample_lines = PC_SAMPLES;
+		vm.event = 1;
+	}
+#endif
 }
 
@@ -0,0 +1,1336 @@
+/*
+ * jit.c (x86-64 dynamic recompiler for the 6502 virtual machine)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+#ifndef __x86_64__
+#error "the JIT generates x86-64 code"
+#endif
+
+#ifdef VM_BLOCKS
+#error "the JIT expects the interpreter with the prefetch window"
+#endif
+
+// max instructions per block, with 3 bytes each it fits in jit_state.len
+#define JIT_BLOCK_LEN		64
+// hot value for the PCs that are not compiled
+#define JIT_NEVER			0xff
+// enough arena for a block of JIT_BLOCK_LEN instructions and its exits
+#define JIT_BLOCK_MAX		(16 * 1024)
+
+// 6502 operations
+enum { INVALID, ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BVC, BVS, CLC,
+	CLD, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP, JSR,
+	LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, ROL, ROR, RTS, SBC, SEC,
+	SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA };
+
+// addressing modes
+enum { IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IZX, IZY, IND, REL };
+
+static const uint8_t _len[] = {
+	[IMP] = 1, [ACC] = 1, [IMM] = 2, [ZP] = 2, [ZPX] = 2, [ZPY] = 2, [ABS] = 3,
+	[ABX] = 3, [ABY] = 3, [IZX] = 2, [IZY] = 2, [IND] = 3, [REL] = 2
+};
+
+struct jit_op
+{
+	uint8_t op, mode, cycles;
+};
+
+// operation, addressing mode and base cycles (same as vm.c), BRK, RTI, SYS,
+// CLI and PLP (they may unmask a pending IRQ) and the invalid opcodes are
+// left to the interpreter
+static const struct jit_op _ops[256] = {
+	[0x01] = { ORA, IZX, 6 }, [0x05] = { ORA, ZP, 3 }, [0x06] = { ASL, ZP, 5 }, [0x08] = { PHP, IMP, 3 },
+	[0x09] = { ORA, IMM, 2 }, [0x0a] = { ASL, ACC, 2 }, [0x0d] = { ORA, ABS, 4 }, [0x0e] = { ASL, ABS, 6 },
+	[0x10] = { BPL, REL, 2 }, [0x11] = { ORA, IZY, 5 }, [0x15] = { ORA, ZPX, 4 }, [0x16] = { ASL, ZPX, 6 },
+	[0x18] = { CLC, IMP, 2 }, [0x19] = { ORA, ABY, 4 }, [0x1d] = { ORA, ABX, 4 }, [0x1e] = { ASL, ABX, 7 },
+	[0x20] = { JSR, ABS, 6 }, [0x21] = { AND, IZX, 6 }, [0x24] = { BIT, ZP, 3 }, [0x25] = { AND, ZP, 3 },
+	[0x26] = { ROL, ZP, 5 }, [0x29] = { AND, IMM, 2 }, [0x2a] = { ROL, ACC, 2 },
+	[0x2c] = { BIT, ABS, 4 }, [0x2d] = { AND, ABS, 4 }, [0x2e] = { ROL, ABS, 6 }, [0x30] = { BMI, REL, 2 },
+	[0x31] = { AND, IZY, 5 }, [0x35] = { AND, ZPX, 4 }, [0x36] = { ROL, ZPX, 6 }, [0x38] = { SEC, IMP, 2 },
+	[0x39] = { AND, ABY, 4 }, [0x3d] = { AND, ABX, 4 }, [0x3e] = { ROL, ABX, 7 }, [0x41] = { EOR, IZX, 6 },
+	[0x45] = { EOR, ZP, 3 }, [0x46] = { LSR, ZP, 5 }, [0x48] = { PHA, IMP, 3 }, [0x49] = { EOR, IMM, 2 },
+	[0x4a] = { LSR, ACC, 2 }, [0x4c] = { JMP, ABS, 3 }, [0x4d] = { EOR, ABS, 4 }, [0x4e] = { LSR, ABS, 6 },
+	[0x50] = { BVC, REL, 2 }, [0x51] = { EOR, IZY, 5 }, [0x55] = { EOR, ZPX, 4 }, [0x56] = { LSR, ZPX, 6 },
+	[0x59] = { EOR, ABY, 4 }, [0x5d] = { EOR, ABX, 4 }, [0x5e] = { LSR, ABX, 7 },
+	[0x60] = { RTS, IMP, 6 }, [0x61] = { ADC, IZX, 6 }, [0x65] = { ADC, ZP, 3 }, [0x66] = { ROR, ZP, 5 },
+	[0x68] = { PLA, IMP, 4 }, [0x69] = { ADC, IMM, 2 }, [0x6a] = { ROR, ACC, 2 }, [0x6c] = { JMP, IND, 5 },
+	[0x6d] = { ADC, ABS, 4 }, [0x6e] = { ROR, ABS, 6 }, [0x70] = { BVS, REL, 2 }, [0x71] = { ADC, IZY, 5 },
+	[0x75] = { ADC, ZPX, 4 }, [0x76] = { ROR, ZPX, 6 }, [0x78] = { SEI, IMP, 2 }, [0x79] = { ADC, ABY, 4 },
+	[0x7d] = { ADC, ABX, 4 }, [0x7e] = { ROR, ABX, 7 }, [0x81] = { STA, IZX, 6 }, [0x84] = { STY, ZP, 3 },
+	[0x85] = { STA, ZP, 3 }, [0x86] = { STX, ZP, 3 }, [0x88] = { DEY, IMP, 2 }, [0x8a] = { TXA, IMP, 2 },
+	[0x8c] = { STY, ABS, 4 }, [0x8d] = { STA, ABS, 4 }, [0x8e] = { STX, ABS, 4 }, [0x90] = { BCC, REL, 2 },
+	[0x91] = { STA, IZY, 6 }, [0x94] = { STY, ZPX, 4 }, [0x95] = { STA, ZPX, 4 }, [0x96] = { STX, ZPY, 4 },
+	[0x98] = { TYA, IMP, 2 }, [0x99] = { STA, ABY, 5 }, [0x9a] = { TXS, IMP, 2 }, [0x9d] = { STA, ABX, 5 },
+	[0xa0] = { LDY, IMM, 2 }, [0xa1] = { LDA, IZX, 6 }, [0xa2] = { LDX, IMM, 2 }, [0xa4] = { LDY, ZP, 3 },
+	[0xa5] = { LDA, ZP, 3 }, [0xa6] = { LDX, ZP, 3 }, [0xa8] = { TAY, IMP, 2 }, [0xa9] = { LDA, IMM, 2 },
+	[0xaa] = { TAX, IMP, 2 }, [0xac] = { LDY, ABS, 4 }, [0xad] = { LDA, ABS, 4 }, [0xae] = { LDX, ABS, 4 },
+	[0xb0] = { BCS, REL, 2 }, [0xb1] = { LDA, IZY, 5 }, [0xb4] = { LDY, ZPX, 4 }, [0xb5] = { LDA, ZPX, 4 },
+	[0xb6] = { LDX, ZPY, 4 }, [0xb8] = { CLV, IMP, 2 }, [0xb9] = { LDA, ABY, 4 }, [0xba] = { TSX, IMP, 2 },
+	[0xbc] = { LDY, ABX, 4 }, [0xbd] = { LDA, ABX, 4 }, [0xbe] = { LDX, ABY, 4 }, [0xc0] = { CPY, IMM, 2 },
+	[0xc1] = { CMP, IZX, 6 }, [0xc4] = { CPY, ZP, 3 }, [0xc5] = { CMP, ZP, 3 }, [0xc6] = { DEC, ZP, 5 },
+	[0xc8] = { INY, IMP, 2 }, [0xc9] = { CMP, IMM, 2 }, [0xca] = { DEX, IMP, 2 }, [0xcc] = { CPY, ABS, 4 },
+	[0xcd] = { CMP, ABS, 4 }, [0xce] = { DEC, ABS, 6 }, [0xd0] = { BNE, REL, 2 }, [0xd1] = { CMP, IZY, 5 },
+	[0xd5] = { CMP, ZPX, 4 }, [0xd6] = { DEC, ZPX, 6 }, [0xd8] = { CLD, IMP, 2 }, [0xd9] = { CMP, ABY, 4 },
+	[0xdd] = { CMP, ABX, 4 }, [0xde] = { DEC, ABX, 7 }, [0xe0] = { CPX, IMM, 2 }, [0xe1] = { SBC, IZX, 6 },
+	[0xe4] = { CPX, ZP, 3 }, [0xe5] = { SBC, ZP, 3 }, [0xe6] = { INC, ZP, 5 }, [0xe8] = { INX, IMP, 2 },
+	[0xe9] = { SBC, IMM, 2 }, [0xea] = { NOP, IMP, 2 }, [0xec] = { CPX, ABS, 4 }, [0xed] = { SBC, ABS, 4 },
+	[0xee] = { INC, ABS, 6 }, [0xf0] = { BEQ, REL, 2 }, [0xf1] = { SBC, IZY, 5 }, [0xf5] = { SBC, ZPX, 4 },
+	[0xf6] = { INC, ZPX, 6 }, [0xf8] = { SED, IMP, 2 }, [0xf9] = { SBC, ABY, 4 }, [0xfd] = { SBC, ABX, 4 },
+	[0xfe] = { INC, ABX, 7 }
+};
+
+// x86-64 registers
+enum { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+// register allocation while running native code, rax, rcx and rdx are scratch
+#define REG_A				r12
+#define REG_X				r13
+#define REG_Y				r14
+#define REG_SP				rbp
+#define REG_C				r8		// 0 or 1
+#define REG_N				r9		// N is bit 7
+#define REG_Z				r10		// Z when 0
+#define REG_S				r11		// the rest of the status register
+#define REG_MEM				rbx		// the jit_state, that starts with the RAM
+#define REG_BUDGET			rsi
+#define REG_CYCLES			rdi
+
+// jit_state.regs
+enum { J_A, J_X, J_Y, J_SP, J_C, J_N, J_Z, J_S, J_PC, J_BUDGET, J_CYCLES, J_REASON };
+
+static const uint8_t _regs[] = {
+	[J_A] = REG_A, [J_X] = REG_X, [J_Y] = REG_Y, [J_SP] = REG_SP, [J_C] = REG_C,
+	[J_N] = REG_N, [J_Z] = REG_Z, [J_S] = REG_S, [J_BUDGET] = REG_BUDGET,
+	[J_CYCLES] = REG_CYCLES
+};
+
+// why the native code returned
+#define EXIT_LOOKUP			0	// no native code for PC
+#define EXIT_BUDGET			1	// not enough budget for the block at PC
+#define EXIT_EVENT			2	// the VM event is set
+#define EXIT_INTERP			3	// the instruction at PC must be run by the interpreter
+
+// x86 condition codes
+#define CC_O				0x0
+#define CC_C				0x2
+#define CC_NC				0x3
+#define CC_Z				0x4
+#define CC_NZ				0x5
+
+// x86 ALU operations (the /digit of the 0x81 family)
+#define ALU_ADD				0
+#define ALU_OR				1
+#define ALU_AND				4
+#define ALU_SUB				5
+#define ALU_XOR				6
+#define ALU_CMP				7
+
+// emitter flags
+#define OP_W				1	// 64-bit operand
+#define OP_B				2	// 8-bit operand, always with REX so spl..dil are used
+
+#define OFF(field)			((int32_t)offsetof(struct jit_state, field))
+#define REG_OFF(r)			(OFF(regs) + (r) * 4)
+
+// memory operand or register
+struct mem
+{
+	int8_t base, index;
+	uint8_t scale;
+	int32_t disp;
+};
+
+#define DIRECT				-2
+#define NONE				-1
+#define R(r)				((struct mem){ r, DIRECT, 0, 0 })
+#define M(b, d)				((struct mem){ b, NONE, 0, d })
+#define MI(b, i, s, d)		((struct mem){ b, i, s, d })
+
+// exits are generated after the block code
+struct exit
+{
+	uint8_t *patch;
+	uint16_t pc;
+	uint8_t reason, dynamic;
+	uint32_t refund, cycles;
+};
+
+struct emit
+{
+	struct jit_state *jit;
+	uint8_t *p, *entry;
+
+	// block being compiled
+	uint16_t start, pc, n, i;
+	uint32_t cycles;
+
+	struct exit exits[2 * JIT_BLOCK_LEN + 8];
+	uint16_t nexits;
+};
+
+static void
+_byte(struct emit *e, uint8_t v)
+{
+	*e->p++ = v;
+}
+
+static void
+_dword(struct emit *e, uint32_t v)
+{
+	memcpy(e->p, &v, 4);
+	e->p += 4;
+}
+
+// opcode (1 or 2 bytes) with a ModRM operand
+static void
+_rm(struct emit *e, uint8_t flags, uint16_t opc, uint8_t reg, struct mem m)
+{
+	uint8_t rex = 0x40 | (flags & OP_W ? 8 : 0) | (reg & 8 ? 4 : 0);
+	uint8_t mod;
+
+	if (m.index == DIRECT)
+		rex |= m.base & 8 ? 1 : 0;
+	else
+		rex |= (m.index >= 0 && (m.index & 8) ? 2 : 0) | (m.base >= 0 && (m.base & 8) ? 1 : 0);
+
+	if (rex != 0x40 || (flags & OP_B))
+		_byte(e, rex);
+	if (opc > 0xff)
+		_byte(e, opc >> 8);
+	_byte(e, opc);
+
+	if (m.index == DIRECT)
+	{
+		_byte(e, 0xc0 | (reg & 7) << 3 | (m.base & 7));
+		return;
+	}
+
+	if (!m.disp && (m.base & 7) != rbp)
+		mod = 0;
+	else if (m.disp >= -128 && m.disp < 128)
+		mod = 1;
+	else
+		mod = 2;
+
+	if (m.index >= 0 || (m.base & 7) == rsp)
+	{
+		_byte(e, mod << 6 | (reg & 7) << 3 | 4);
+		_byte(e, m.scale << 6 | (m.index >= 0 ? m.index & 7 : 4) << 3 | (m.base & 7));
+	}
+	else
+		_byte(e, mod << 6 | (reg & 7) << 3 | (m.base & 7));
+
+	if (mod == 1)
+		_byte(e, m.disp);
+	else if (mod == 2)
+		_dword(e, m.disp);
+}
+
+static void
+_mov(struct emit *e, uint8_t dst, uint8_t src)
+{
+	_rm(e, 0, 0x89, src, R(dst));
+}
+
+static void
+_mov_imm(struct emit *e, uint8_t dst, uint32_t imm)
+{
+	if (dst & 8)
+		_byte(e, 0x41);
+	_byte(e, 0xb8 + (dst & 7));
+	_dword(e, imm);
+}
+
+static void
+_load32(struct emit *e, uint8_t dst, struct mem m)
+{
+	_rm(e, 0, 0x8b, dst, m);
+}
+
+static void
+_store32(struct emit *e, struct mem m, uint8_t src)
+{
+	_rm(e, 0, 0x89, src, m);
+}
+
+static void
+_movzx8(struct emit *e, uint8_t dst, struct mem m)
+{
+	_rm(e, OP_B, 0x0fb6, dst, m);
+}
+
+static void
+_movzx16(struct emit *e, uint8_t dst, struct mem m)
+{
+	_rm(e, 0, 0x0fb7, dst, m);
+}
+
+static void
+_store8(struct emit *e, struct mem m, uint8_t src)
+{
+	_rm(e, OP_B, 0x88, src, m);
+}
+
+static void
+_lea(struct emit *e, uint8_t dst, struct mem m)
+{
+	_rm(e, 0, 0x8d, dst, m);
+}
+
+// op r/m, imm (32 or 8-bit operand)
+static void
+_alu_imm(struct emit *e, uint8_t flags, uint8_t op, struct mem m, int32_t imm)
+{
+	if (flags & OP_B)
+	{
+		_rm(e, flags, 0x80, op, m);
+		_byte(e, imm);
+	}
+	else if (imm >= -128 && imm < 128)
+	{
+		_rm(e, flags, 0x83, op, m);
+		_byte(e, imm);
+	}
+	else
+	{
+		_rm(e, flags, 0x81, op, m);
+		_dword(e, imm);
+	}
+}
+
+// op dst, src (32-bit registers)
+static void
+_alu(struct emit *e, uint8_t op, uint8_t dst, uint8_t src)
+{
+	_rm(e, 0, op * 8 + 3, dst, R(src));
+}
+
+static void
+_shift(struct emit *e, uint8_t left, uint8_t reg, uint8_t n)
+{
+	_rm(e, 0, 0xc1, left ? 4 : 5, R(reg));
+	_byte(e, n);
+}
+
+static void
+_setcc(struct emit *e, uint8_t cc, uint8_t reg)
+{
+	_rm(e, OP_B, 0x0f90 + cc, 0, R(reg));
+}
+
+static void
+_test_imm8(struct emit *e, struct mem m, uint8_t imm)
+{
+	_rm(e, OP_B, 0xf6, 0, m);
+	_byte(e, imm);
+}
+
+static void
+_test(struct emit *e, uint8_t flags, uint8_t a, uint8_t b)
+{
+	_rm(e, flags, 0x85, b, R(a));
+}
+
+static uint8_t *
+_jcc(struct emit *e, uint8_t cc)
+{
+	_byte(e, 0x0f);
+	_byte(e, 0x80 + cc);
+	_dword(e, 0);
+	return e->p - 4;
+}
+
+static void
+_patch(uint8_t *patch, uint8_t *target)
+{
+	int32_t rel = target - (patch + 4);
+
+	memcpy(patch, &rel, 4);
+}
+
+static void
+_jmp(struct emit *e, uint8_t *target)
+{
+	_byte(e, 0xe9);
+	_dword(e, 0);
+	_patch(e->p - 4, target);
+}
+
+static void
+_push(struct emit *e, uint8_t reg)
+{
+	if (reg & 8)
+		_byte(e, 0x41);
+	_byte(e, 0x50 + (reg & 7));
+}
+
+static void
+_pop(struct emit *e, uint8_t reg)
+{
+	if (reg & 8)
+		_byte(e, 0x41);
+	_byte(e, 0x58 + (reg & 7));
+}
+
+// leave the native code on condition cc (no condition with cc 0xff)
+static void
+_leave(struct emit *e, uint8_t cc, uint16_t pc, uint8_t reason, uint32_t refund, uint32_t cycles, uint8_t dynamic)
+{
+	struct exit *x = &e->exits[e->nexits++];
+
+	if (cc == 0xff)
+	{
+		_byte(e, 0xe9);
+		_dword(e, 0);
+		x->patch = e->p - 4;
+	}
+	else
+		x->patch = _jcc(e, cc);
+
+	x->pc = pc;
+	x->reason = reason;
+	x->refund = refund;
+	x->cycles = cycles;
+	x->dynamic = dynamic;
+}
+
+// the current instruction is run by the interpreter
+static void
+_interp(struct emit *e, uint8_t cc)
+{
+	_leave(e, cc, e->pc, EXIT_INTERP, e->n - e->i, e->cycles, 0);
+}
+
+static void
+_flush_cycles(struct emit *e)
+{
+	if (e->cycles)
+		_alu_imm(e, 0, ALU_ADD, R(REG_CYCLES), e->cycles);
+	e->cycles = 0;
+}
+
+// continue with the block at pc
+static void
+_chain(struct emit *e, uint16_t pc)
+{
+	if (pc == e->start)
+	{
+		// a block can't be dropped while it runs, loop without the lookup
+		_jmp(e, e->entry);
+		return;
+	}
+
+	_rm(e, OP_W, 0x8b, rax, M(REG_MEM, OFF(code) + pc * 8));
+	_test(e, OP_W, rax, rax);
+	_leave(e, CC_Z, pc, EXIT_LOOKUP, 0, 0, 0);
+	_rm(e, 0, 0xff, 4, R(rax));
+}
+
+// continue with the block at the PC in ecx
+static void
+_chain_dynamic(struct emit *e)
+{
+	_rm(e, OP_W, 0x8b, rax, MI(REG_MEM, rcx, 3, OFF(code)));
+	_test(e, OP_W, rax, rax);
+	_leave(e, CC_Z, 0, EXIT_LOOKUP, 0, 0, 1);
+	_rm(e, 0, 0xff, 4, R(rax));
+}
+
+static void
+_nz(struct emit *e, uint8_t reg)
+{
+	_mov(e, REG_N, reg);
+	_mov(e, REG_Z, reg);
+}
+
+// status register in eax
+static void
+_status(struct emit *e)
+{
+	_mov(e, rax, REG_S);
+	_alu_imm(e, 0, ALU_AND, R(rax), ~(sbit(Nf) | sbit(Zf) | sbit(Cf)) & 0xff);
+	_mov(e, rdx, REG_N);
+	_alu_imm(e, 0, ALU_AND, R(rdx), sbit(Nf));
+	_alu(e, ALU_OR, rax, rdx);
+	_alu(e, ALU_OR, rax, REG_C);
+	_test(e, 0, REG_Z, REG_Z);
+	_setcc(e, CC_Z, rdx);
+	_movzx8(e, rdx, R(rdx));
+	_alu(e, ALU_ADD, rdx, rdx);
+	_alu(e, ALU_OR, rax, rdx);
+}
+
+// effective address, -1 when it is only known at run time (then it is in eax)
+static int32_t
+_ea(struct emit *e, uint8_t mode, uint16_t operand, uint8_t cross)
+{
+	uint8_t index = mode == ZPY || mode == ABY ? REG_Y : REG_X;
+
+	switch (mode)
+	{
+		case ZP:
+		case ABS:
+			return operand;
+		case ZPX:
+		case ZPY:
+			_lea(e, rax, M(index, operand));
+			_movzx8(e, rax, R(rax));
+			return -1;
+		case ABX:
+		case ABY:
+			if (cross)
+			{
+				// 1 extra cycle when crossing a page
+				_lea(e, rdx, M(index, operand & 0xff));
+				_shift(e, 0, rdx, 8);
+				_alu(e, ALU_ADD, REG_CYCLES, rdx);
+			}
+			_lea(e, rax, M(index, operand));
+			_movzx16(e, rax, R(rax));
+			return -1;
+		case IZX:
+			_lea(e, rax, M(REG_X, operand));
+			_movzx8(e, rax, R(rax));
+			_movzx16(e, rax, MI(REG_MEM, rax, 0, 0));
+			return -1;
+		case IZY:
+			_movzx16(e, rax, M(REG_MEM, operand));
+			if (cross)
+			{
+				_movzx8(e, rdx, R(rax));
+				_alu(e, ALU_ADD, rdx, REG_Y);
+				_shift(e, 0, rdx, 8);
+				_alu(e, ALU_ADD, REG_CYCLES, rdx);
+			}
+			_alu(e, ALU_ADD, rax, REG_Y);
+			_movzx16(e, rax, R(rax));
+			return -1;
+	}
+
+	return -1;
+}
+
+static struct mem
+_at(int32_t addr)
+{
+	return addr < 0 ? MI(REG_MEM, rax, 0, 0) : M(REG_MEM, addr);
+}
+
+// operand in ecx
+static void
+_operand(struct emit *e, uint8_t mode, uint16_t operand, uint8_t cross)
+{
+	if (mode == IMM)
+		_mov_imm(e, rcx, operand);
+	else
+		_movzx8(e, rcx, _at(_ea(e, mode, operand, cross)));
+}
+
+// writes to pages with code or memory mapped go through the interpreter
+static void
+_check(struct emit *e, int32_t addr)
+{
+	if (addr >= 0)
+	{
+		// the zero page and the stack are never compiled or memory mapped
+		if (addr < 0x200)
+			return;
+		_test_imm8(e, M(REG_MEM, OFF(pages) + (addr >> 8)), JIT_PAGE_CODE | JIT_PAGE_IO);
+	}
+	else
+	{
+		_mov(e, rdx, rax);
+		_shift(e, 0, rdx, 8);
+		_test_imm8(e, MI(REG_MEM, rdx, 0, OFF(pages)), JIT_PAGE_CODE | JIT_PAGE_IO);
+	}
+	_interp(e, CC_NZ);
+}
+
+static struct mem
+_stack()
+{
+	return MI(REG_MEM, REG_SP, 0, 0x100);
+}
+
+static void
+_branch(struct emit *e, uint8_t op, uint16_t operand)
+{
+	uint16_t next = e->pc + 2, target = next + (int8_t)operand;
+	uint8_t cc, *taken;
+
+	// before the test, the add changes the flags
+	_flush_cycles(e);
+
+	switch (op)
+	{
+		case BPL:
+		case BMI:
+			_test_imm8(e, R(REG_N), sbit(Nf));
+			cc = op == BPL ? CC_Z : CC_NZ;
+			break;
+		case BVC:
+		case BVS:
+			_test_imm8(e, R(REG_S), sbit(Vf));
+			cc = op == BVC ? CC_Z : CC_NZ;
+			break;
+		case BCC:
+		case BCS:
+			_test(e, 0, REG_C, REG_C);
+			cc = op == BCC ? CC_Z : CC_NZ;
+			break;
+		default:
+			// BNE, BEQ
+			_test(e, 0, REG_Z, REG_Z);
+			cc = op == BNE ? CC_NZ : CC_Z;
+			break;
+	}
+
+	taken = _jcc(e, cc);
+	_chain(e, next);
+
+	// taken branch, 1 extra cycle (2 when crossing a page)
+	_patch(taken, e->p);
+	e->cycles += ((next ^ target) & 0xff00) ? 2 : 1;
+	_flush_cycles(e);
+	_chain(e, target);
+}
+
+// returns 0 if the instruction ends the block
+static uint8_t
+_insn(struct emit *e, uint8_t opcode)
+{
+	const struct jit_op *o = &_ops[opcode];
+	uint8_t *mem = e->jit->ram;
+	uint16_t operand = mem[(uint16_t)(e->pc + 1)];
+	uint8_t reg;
+	int32_t addr;
+
+	if (_len[o->mode] == 3)
+		operand |= mem[(uint16_t)(e->pc + 2)] << 8;
+
+	switch (o->op)
+	{
+		case LDA:
+		case LDX:
+		case LDY:
+			reg = o->op == LDA ? REG_A : o->op == LDX ? REG_X : REG_Y;
+			_operand(e, o->mode, operand, 1);
+			_mov(e, reg, rcx);
+			_nz(e, reg);
+			break;
+
+		case STA:
+		case STX:
+		case STY:
+			reg = o->op == STA ? REG_A : o->op == STX ? REG_X : REG_Y;
+			addr = _ea(e, o->mode, operand, 0);
+			_check(e, addr);
+			_store8(e, _at(addr), reg);
+			break;
+
+		case ORA:
+		case AND:
+		case EOR:
+			_operand(e, o->mode, operand, 1);
+			_alu(e, o->op == ORA ? ALU_OR : o->op == AND ? ALU_AND : ALU_XOR, REG_A, rcx);
+			_nz(e, REG_A);
+			break;
+
+		case ADC:
+		case SBC:
+			// decimal mode is left to the interpreter
+			_test_imm8(e, R(REG_S), sbit(Df));
+			_interp(e, CC_NZ);
+			_operand(e, o->mode, operand, 1);
+			// x86 carry and overflow match the 6502 in binary mode, with an
+			// inverted carry (borrow) when subtracting
+			_rm(e, 0, 0x0fba, 4, R(REG_C));
+			_byte(e, 0);
+			if (o->op == ADC)
+			{
+				_rm(e, OP_B, 0x10, rcx, R(REG_A));
+				_setcc(e, CC_C, REG_C);
+			}
+			else
+			{
+				_byte(e, 0xf5);
+				_rm(e, OP_B, 0x18, rcx, R(REG_A));
+				_setcc(e, CC_NC, REG_C);
+			}
+			_setcc(e, CC_O, rax);
+			_movzx8(e, rax, R(rax));
+			_shift(e, 1, rax, Vf);
+			_alu_imm(e, 0, ALU_AND, R(REG_S), ~sbit(Vf));
+			_alu(e, ALU_OR, REG_S, rax);
+			_nz(e, REG_A);
+			break;
+
+		case CMP:
+		case CPX:
+		case CPY:
+			reg = o->op == CMP ? REG_A : o->op == CPX ? REG_X : REG_Y;
+			_operand(e, o->mode, operand, o->op == CMP);
+			_mov(e, rax, reg);
+			_rm(e, OP_B, 0x28, rcx, R(rax));
+			_setcc(e, CC_NC, REG_C);
+			_movzx8(e, REG_N, R(rax));
+			_mov(e, REG_Z, REG_N);
+			break;
+
+		case BIT:
+			_operand(e, o->mode, operand, 0);
+			_mov(e, REG_N, rcx);
+			_mov(e, REG_Z, rcx);
+			_alu(e, ALU_AND, REG_Z, REG_A);
+			_mov(e, rax, rcx);
+			_alu_imm(e, 0, ALU_AND, R(rax), sbit(Vf));
+			_alu_imm(e, 0, ALU_AND, R(REG_S), ~sbit(Vf));
+			_alu(e, ALU_OR, REG_S, rax);
+			break;
+
+		case ASL:
+		case LSR:
+		case ROL:
+		case ROR:
+		case INC:
+		case DEC:
+			if (o->mode == ACC)
+			{
+				addr = 0;
+				_mov(e, rcx, REG_A);
+			}
+			else
+			{
+				addr = _ea(e, o->mode, operand, 0);
+				_check(e, addr);
+				_movzx8(e, rcx, _at(addr));
+			}
+
+			switch (o->op)
+			{
+				case ASL:
+					_mov(e, REG_C, rcx);
+					_shift(e, 0, REG_C, 7);
+					_alu(e, ALU_ADD, rcx, rcx);
+					_movzx8(e, rcx, R(rcx));
+					break;
+				case LSR:
+					_mov(e, REG_C, rcx);
+					_alu_imm(e, 0, ALU_AND, R(REG_C), 1);
+					_shift(e, 0, rcx, 1);
+					break;
+				case ROL:
+					_lea(e, rdx, MI(REG_C, rcx, 1, 0));
+					_mov(e, REG_C, rdx);
+					_shift(e, 0, REG_C, 8);
+					_movzx8(e, rcx, R(rdx));
+					break;
+				case ROR:
+					_mov(e, rdx, REG_C);
+					_shift(e, 1, rdx, 8);
+					_alu(e, ALU_OR, rdx, rcx);
+					_mov(e, REG_C, rcx);
+					_alu_imm(e, 0, ALU_AND, R(REG_C), 1);
+					_shift(e, 0, rdx, 1);
+					_mov(e, rcx, rdx);
+					break;
+				case INC:
+					_alu_imm(e, OP_B, ALU_ADD, R(rcx), 1);
+					break;
+				case DEC:
+					_alu_imm(e, OP_B, ALU_SUB, R(rcx), 1);
+					break;
+			}
+			_nz(e, rcx);
+
+			if (o->mode == ACC)
+				_mov(e, REG_A, rcx);
+			else
+				_store8(e, _at(addr), rcx);
+			break;
+
+		case TAX:
+		case TAY:
+		case TXA:
+		case TYA:
+		case TSX:
+			reg = o->op == TAX || o->op == TSX ? REG_X : o->op == TAY ? REG_Y : REG_A;
+			_mov(e, reg, o->op == TXA ? REG_X : o->op == TYA ? REG_Y : o->op == TSX ? REG_SP : REG_A);
+			_nz(e, reg);
+			break;
+		case TXS:
+			_mov(e, REG_SP, REG_X);
+			break;
+
+		case INX:
+		case INY:
+		case DEX:
+		case DEY:
+			reg = o->op == INX || o->op == DEX ? REG_X : REG_Y;
+			_alu_imm(e, OP_B, o->op == INX || o->op == INY ? ALU_ADD : ALU_SUB, R(reg), 1);
+			_nz(e, reg);
+			break;
+
+		case CLC:
+		case SEC:
+			_mov_imm(e, REG_C, o->op == SEC);
+			break;
+		case CLV:
+		case CLD:
+			_alu_imm(e, 0, ALU_AND, R(REG_S), ~sbit(o->op == CLV ? Vf : Df));
+			break;
+		case SEI:
+		case SED:
+			_alu_imm(e, 0, ALU_OR, R(REG_S), sbit(o->op == SEI ? If : Df));
+			break;
+
+		case PHA:
+			_store8(e, _stack(), REG_A);
+			_alu_imm(e, OP_B, ALU_SUB, R(REG_SP), 1);
+			break;
+		case PHP:
+			_status(e);
+			_alu_imm(e, 0, ALU_OR, R(rax), sbit(5) | sbit(Bf));
+			_store8(e, _stack(), rax);
+			_alu_imm(e, OP_B, ALU_SUB, R(REG_SP), 1);
+			break;
+		case PLA:
+			_alu_imm(e, OP_B, ALU_ADD, R(REG_SP), 1);
+			_movzx8(e, REG_A, _stack());
+			_nz(e, REG_A);
+			break;
+
+		case NOP:
+			break;
+
+		case BPL:
+		case BMI:
+		case BVC:
+		case BVS:
+		case BCC:
+		case BCS:
+		case BNE:
+		case BEQ:
+			e->cycles += o->cycles;
+			_branch(e, o->op, operand);
+			return 0;
+
+		case JMP:
+			e->cycles += o->cycles;
+			_flush_cycles(e);
+			if (o->mode == ABS)
+				_chain(e, operand);
+			else
+			{
+				if ((operand & 0xff) == 0xff)
+				{
+					// the NMOS 6502 doesn't carry into the high byte of the
+					// pointer, same as the interpreter
+					_movzx8(e, rcx, M(REG_MEM, operand));
+					_movzx8(e, rax, M(REG_MEM, operand & 0xff00));
+					_shift(e, 1, rax, 8);
+					_alu(e, ALU_OR, rcx, rax);
+				}
+				else
+					_movzx16(e, rcx, M(REG_MEM, operand));
+				_chain_dynamic(e);
+			}
+			return 0;
+
+		case JSR:
+			e->cycles += o->cycles;
+			_rm(e, OP_B, 0xc6, 0, _stack());
+			_byte(e, (e->pc + 2) >> 8);
+			_alu_imm(e, OP_B, ALU_SUB, R(REG_SP), 1);
+			_rm(e, OP_B, 0xc6, 0, _stack());
+			_byte(e, e->pc + 2);
+			_alu_imm(e, OP_B, ALU_SUB, R(REG_SP), 1);
+			_flush_cycles(e);
+			_chain(e, operand);
+			return 0;
+
+		case RTS:
+			e->cycles += o->cycles;
+			_alu_imm(e, OP_B, ALU_ADD, R(REG_SP), 1);
+			_movzx8(e, rcx, _stack());
+			_alu_imm(e, OP_B, ALU_ADD, R(REG_SP), 1);
+			_movzx8(e, rax, _stack());
+			_shift(e, 1, rax, 8);
+			_alu(e, ALU_OR, rcx, rax);
+			_alu_imm(e, 0, ALU_ADD, R(rcx), 1);
+			_movzx16(e, rcx, R(rcx));
+			_flush_cycles(e);
+			_chain_dynamic(e);
+			return 0;
+	}
+
+	e->cycles += o->cycles;
+	return 1;
+}
+
+static uint8_t
+_compilable(struct jit_state *jit, uint8_t page)
+{
+	return !(jit->pages[page] & (JIT_PAGE_IO | JIT_PAGE_NOJIT));
+}
+
+static uint8_t
+_ends_block(uint8_t op)
+{
+	return (op >= BCC && op <= BVS && op != BIT) || op == JMP || op == JSR || op == RTS;
+}
+
+static void
+_flush(struct jit_state *jit)
+{
+	uint16_t i;
+
+	memset(jit->code, 0, sizeof(jit->code));
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	for (i = 0; i < 256; i++)
+		jit->pages[i] &= ~JIT_PAGE_CODE;
+
+	jit->used = jit->base;
+}
+
+static void
+_page_blocks(struct jit_state *jit, uint8_t page, int8_t n)
+{
+	jit->blocks[page] += n;
+	if (jit->blocks[page])
+		jit->pages[page] |= JIT_PAGE_CODE;
+	else
+		jit->pages[page] &= ~JIT_PAGE_CODE;
+}
+
+static void
+_drop_block(struct jit_state *jit, uint16_t pc)
+{
+	uint8_t first = pc >> 8, last = (uint16_t)(pc + jit->len[pc] - 1) >> 8;
+
+	jit->code[pc] = NULL;
+	_page_blocks(jit, first, -1);
+	if (last != first)
+		_page_blocks(jit, last, -1);
+}
+
+// drop the blocks including any of the bytes
+static void
+_drop(struct jit_state *jit, uint16_t addr, uint32_t size, uint8_t smc)
+{
+	uint16_t pc = addr - (JIT_BLOCK_LEN * 3 - 1);
+	uint32_t i;
+
+	// only the blocks starting up to the longest block back can include addr
+	for (i = 0; i < JIT_BLOCK_LEN * 3 - 1 + size; i++, pc++)
+		if (jit->code[pc] && ((uint16_t)(addr - pc) < jit->len[pc] || (uint16_t)(pc - addr) < size))
+		{
+			_drop_block(jit, pc);
+			if (smc && ++jit->smc[pc] >= JIT_SMC_LIMIT)
+				jit->hot[pc] = JIT_NEVER;
+		}
+}
+
+// switches the arena between RW and RX, 0 on error
+static uint8_t
+_protect(struct jit_state *jit, uint8_t writable)
+{
+	if (jit->writable == writable)
+		return 1;
+
+	if (mprotect(jit->arena, JIT_ARENA, writable ? PROT_READ | PROT_WRITE
+				: PROT_READ | PROT_EXEC))
+		return 0;
+
+	jit->writable = writable;
+	return 1;
+}
+
+// the interpreter runs everything from now on
+static void
+_unmap(struct jit_state *jit)
+{
+	munmap(jit->arena, JIT_ARENA);
+	jit->arena = NULL;
+	memset(jit->code, 0, sizeof(jit->code));
+}
+
+static void *
+_compile(struct jit_state *jit, uint16_t start)
+{
+	struct emit e;
+	const struct jit_op *o;
+	struct exit *x;
+	uint32_t pc = start;
+	uint16_t i, n, addr;
+
+	if (!jit->arena || !_compilable(jit, start >> 8))
+		return NULL;
+
+	// find the block: up to the first branch, jump, return or instruction
+	// left to the interpreter
+	for (n = 0; n < JIT_BLOCK_LEN; )
+	{
+		o = &_ops[jit->ram[pc]];
+		if (!o->op || pc + _len[o->mode] > 0x10000
+				|| !_compilable(jit, (pc + _len[o->mode] - 1) >> 8))
+			break;
+		// calls to native routines are left to the interpreter
+		if (o->mode == ABS && (o->op == JSR || o->op == JMP) && jit->vm.traps)
+		{
+			addr = addr16(jit->ram[pc + 1], jit->ram[pc + 2]);
+			if (jit->vm.traps[addr >> 3] & (1 << (addr & 7)))
+				break;
+		}
+
+		n++;
+		pc += _len[o->mode];
+		if (_ends_block(o->op))
+			break;
+	}
+
+	if (!n || !_protect(jit, 1))
+		return NULL;
+
+	if (jit->used + JIT_BLOCK_MAX > JIT_ARENA)
+		_flush(jit);
+
+	memset(&e, 0, sizeof(e));
+	e.jit = jit;
+	e.entry = e.p = jit->arena + jit->used;
+	e.start = e.pc = start;
+	e.n = n;
+
+	_rm(&e, OP_B, 0x80, ALU_CMP, M(REG_MEM, OFF(vm.event)));
+	_byte(&e, 0);
+	_leave(&e, CC_NZ, start, EXIT_EVENT, 0, 0, 0);
+	_alu_imm(&e, 0, ALU_CMP, R(REG_BUDGET), n);
+	_leave(&e, CC_C, start, EXIT_BUDGET, 0, 0, 0);
+	_alu_imm(&e, 0, ALU_SUB, R(REG_BUDGET), n);
+
+	for (i = 0; i < n; i++)
+	{
+		e.i = i;
+		if (!_insn(&e, jit->ram[e.pc]))
+			break;
+		e.pc += _len[_ops[jit->ram[e.pc]].mode];
+	}
+
+	if (i == n)
+	{
+		// the block ended before an instruction that is not compiled
+		_flush_cycles(&e);
+		_chain(&e, e.pc);
+	}
+
+	for (i = 0; i < e.nexits; i++)
+	{
+		x = &e.exits[i];
+		_patch(x->patch, e.p);
+		if (x->dynamic)
+			_store32(&e, M(REG_MEM, REG_OFF(J_PC)), rcx);
+		else
+		{
+			_rm(&e, 0, 0xc7, 0, M(REG_MEM, REG_OFF(J_PC)));
+			_dword(&e, x->pc);
+		}
+		_rm(&e, 0, 0xc7, 0, M(REG_MEM, REG_OFF(J_REASON)));
+		_dword(&e, x->reason);
+		if (x->refund)
+			_alu_imm(&e, 0, ALU_ADD, R(REG_BUDGET), x->refund);
+		if (x->cycles)
+			_alu_imm(&e, 0, ALU_ADD, R(REG_CYCLES), x->cycles);
+		_jmp(&e, jit->exit);
+	}
+
+	jit->used = e.p - jit->arena;
+	jit->code[start] = e.entry;
+	jit->len[start] = pc - start;
+	_page_blocks(jit, start >> 8, 1);
+	if ((start >> 8) != ((pc - 1) >> 8))
+		_page_blocks(jit, (pc - 1) >> 8, 1);
+
+	return e.entry;
+}
+
+// entry and exit of the native code
+static void
+_trampolines(struct jit_state *jit)
+{
+	struct emit e;
+	uint8_t i;
+
+	memset(&e, 0, sizeof(e));
+	e.p = jit->arena;
+
+	// void enter(struct jit_state *jit, void *code)
+	_push(&e, rbx);
+	_push(&e, rbp);
+	_push(&e, r12);
+	_push(&e, r13);
+	_push(&e, r14);
+	_push(&e, r15);
+	_rm(&e, OP_W, 0x89, rdi, R(REG_MEM));
+	_rm(&e, OP_W, 0x89, rsi, R(rax));
+	for (i = J_A; i <= J_CYCLES; i++)
+		if (i != J_PC)
+			_load32(&e, _regs[i], M(REG_MEM, REG_OFF(i)));
+	_rm(&e, 0, 0xff, 4, R(rax));
+
+	jit->exit = e.p;
+	for (i = J_A; i <= J_CYCLES; i++)
+		if (i != J_PC)
+			_store32(&e, M(REG_MEM, REG_OFF(i)), _regs[i]);
+	_pop(&e, r15);
+	_pop(&e, r14);
+	_pop(&e, r13);
+	_pop(&e, r12);
+	_pop(&e, rbp);
+	_pop(&e, rbx);
+	_byte(&e, 0xc3);
+
+	jit->enter = (void (*)(struct jit_state *, void *))jit->arena;
+	jit->base = jit->used = e.p - jit->arena;
+}
+
+static void
+_ram_read(struct vm_state *vm, uint16_t addr, uint8_t *dst, uint8_t size)
+{
+	struct jit_state *jit = vm->data;
+
+	while (size--)
+		*dst++ = jit->ram[addr++];
+}
+
+static void
+_ram_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	struct jit_state *jit = vm->data;
+	uint8_t flags = jit->pages[addr >> 8] | jit->pages[(uint16_t)(addr + size - 1) >> 8];
+	uint8_t *p = src;
+	uint16_t a = addr;
+	uint8_t n = size;
+
+	while (n--)
+		jit->ram[a++] = *p++;
+
+	// self-modifying code, blocks changed too often are left to the interpreter
+	if (flags & JIT_PAGE_CODE)
+		_drop(jit, addr, size, 1);
+
+	if ((flags & JIT_PAGE_IO) && jit->io_write)
+		jit->io_write(jit, addr, src, size);
+}
+
+// run native code, returns the instructions run
+static uint16_t
+_native(struct jit_state *jit, void *code, uint16_t budget)
+{
+	struct vm_state *vm = &jit->vm;
+	uint32_t *r = jit->regs;
+
+	r[J_A] = vm->a;
+	r[J_X] = vm->x;
+	r[J_Y] = vm->y;
+	r[J_SP] = vm->sp;
+	r[J_C] = vm->s & sbit(Cf);
+	r[J_N] = vm->s;
+	r[J_Z] = ~vm->s & sbit(Zf);
+	r[J_S] = vm->s;
+	r[J_BUDGET] = budget;
+	r[J_CYCLES] = vm->cycles;
+
+	jit->enter(jit, code);
+
+	vm->a = r[J_A];
+	vm->x = r[J_X];
+	vm->y = r[J_Y];
+	vm->sp = r[J_SP];
+	vm->s = (r[J_S] & ~(sbit(Nf) | sbit(Zf) | sbit(Cf))) | testN(r[J_N])
+		| testZ(r[J_Z] & 0xff) | (r[J_C] & sbit(Cf));
+	vm->pc = r[J_PC];
+	vm->cycles = r[J_CYCLES];
+
+	// native writes bypass the interpreter's prefetch window
+	vm_invalidate(vm, 0, 0);
+
+	return budget - r[J_BUDGET];
+}
+
+// instructions up to the end of the block at pc
+static uint16_t
+_block_len(struct jit_state *jit, uint16_t pc)
+{
+	const struct jit_op *o;
+	uint16_t n;
+
+	for (n = 1; n < JIT_BLOCK_LEN; n++)
+	{
+		o = &_ops[jit->ram[pc]];
+		if (!o->op || _ends_block(o->op))
+			break;
+		pc += _len[o->mode];
+	}
+
+	return n;
+}
+
+uint8_t
+jit_init(struct jit_state *jit)
+{
+	memset(jit, 0, sizeof(struct jit_state));
+
+	jit->arena = mmap(NULL, JIT_ARENA, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->arena == MAP_FAILED)
+		jit->arena = NULL;
+	else
+	{
+		jit->writable = 1;
+		_trampolines(jit);
+		// SELinux deny_execmem and hardened hosts refuse executable memory
+		if (!_protect(jit, 0))
+			_unmap(jit);
+	}
+
+	jit->pages[0] = jit->pages[1] = JIT_PAGE_NOJIT;
+
+	jit->vm.ram_read = _ram_read;
+	jit->vm.ram_write = _ram_write;
+	jit->vm.data = jit;
+	vm_init(&jit->vm);
+
+	return 1;
+}
+
+void
+jit_free(struct jit_state *jit)
+{
+	if (jit->arena)
+		_unmap(jit);
+}
+
+void
+jit_io(struct jit_state *jit, uint16_t addr, uint16_t size)
+{
+	uint32_t page, last = ((uint32_t)addr + (size ? size : 0x10000) - 1) >> 8;
+
+	for (page = addr >> 8; page <= last && page < 256; page++)
+		if (page > 1)
+			jit->pages[page] |= JIT_PAGE_IO | JIT_PAGE_NOJIT;
+
+	jit_invalidate(jit, addr, size);
+}
+
+void
+jit_invalidate(struct jit_state *jit, uint16_t addr, uint16_t size)
+{
+	uint32_t len = size ? size : 0x10000;
+
+	_drop(jit, addr, len, 0);
+	// the code may be different, give it another chance
+	memset(jit->hot + addr, 0, len > 0x10000 - addr ? 0x10000 - addr : len);
+	memset(jit->smc + addr, 0, len > 0x10000 - addr ? 0x10000 - addr : len);
+
+	vm_invalidate(&jit->vm, addr, size);
+}
+
+uint8_t
+jit_run(struct jit_state *jit, uint16_t budget)
+{
+	struct vm_state *vm = &jit->vm;
+	uint16_t n, total = budget;
+	uint8_t ret = VM_BUDGET;
+	void *code;
+
+	while (budget)
+	{
+		// the interpreter takes the interrupts
+		if (vm->event)
+		{
+			ret = vm_run(vm, 1);
+			budget -= vm->ran;
+			if (ret != VM_BUDGET)
+				break;
+			continue;
+		}
+
+		code = jit->code[vm->pc];
+		if (!code)
+		{
+			if (jit->hot[vm->pc] < JIT_HOT)
+				jit->hot[vm->pc]++;
+			else if (jit->hot[vm->pc] == JIT_HOT)
+			{
+				code = _compile(jit, vm->pc);
+				if (!code)
+					jit->hot[vm->pc] = JIT_NEVER;
+			}
+		}
+
+		// RX before entering it, if that fails the interpreter takes over
+		if (code && !_protect(jit, 0))
+		{
+			_unmap(jit);
+			code = NULL;
+		}
+
+		if (code)
+		{
+			budget -= _native(jit, code, budget);
+			switch (jit->regs[J_REASON])
+			{
+				case EXIT_BUDGET:
+					// less budget than instructions in the block
+					n = budget;
+					break;
+				case EXIT_INTERP:
+					n = 1;
+					break;
+				default:
+					continue;
+			}
+		}
+		else
+			n = _block_len(jit, vm->pc);
+
+		if (n > budget)
+			n = budget;
+
+		ret = vm_run(vm, n);
+		budget -= vm->ran;
+		if (ret != VM_BUDGET)
+			break;
+	}
+
+	vm->ran = total - budget;
+
+	return ret;
+}
@@ -0,0 +1,286 @@
+/*
+ * journal.c (syscall record and replay)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "journal.h"
+
+// registers in the mask
+enum { J_A = 1, J_X = 2, J_Y = 4, J_SP = 8, J_S = 16, J_PC = 32, J_CYCLES = 64 };
+
+static const char _magic[4] = "D64J";
+
+static void
+_put16(FILE *fd, uint16_t v)
+{
+	fputc(v & 0xff, fd);
+	fputc(v >> 8, fd);
+}
+
+static void
+_put32(FILE *fd, uint32_t v)
+{
+	_put16(fd, v & 0xffff);
+	_put16(fd, v >> 16);
+}
+
+// EOF reads as zeros, checked once per syscall with feof()
+static uint8_t
+_get8(FILE *fd)
+{
+	int c = fgetc(fd);
+
+	return c == EOF ? 0 : c;
+}
+
+static uint16_t
+_get16(FILE *fd)
+{
+	uint16_t v = _get8(fd);
+
+	return v | (_get8(fd) << 8);
+}
+
+static uint32_t
+_get32(FILE *fd)
+{
+	uint32_t v = _get16(fd);
+
+	return v | ((uint32_t)_get16(fd) << 16);
+}
+
+// the syscall arguments, wrapping inside page 1 as the stack does
+static void
+_args(struct vm_state *vm, uint8_t *dst)
+{
+	uint8_t i, sp = vm->sp;
+
+	for (i = 0; i < JOURNAL_ARGS; i++)
+		vm->ram_read(vm, addr16(++sp, 1), dst + i, 1);
+}
+
+static void
+_flush(struct journal *j)
+{
+	if (!j->len)
+		return;
+
+	fputc(j->len, j->fd);
+	_put16(j->fd, j->addr);
+	fwrite(j->buf, 1, j->len, j->fd);
+	j->len = 0;
+}
+
+static void
+_record_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	struct journal *j = vm->sys_data;
+	uint8_t part;
+
+	j->ram_write(vm, addr, src, size);
+
+	while (size)
+	{
+		if (j->len && (j->len == sizeof(j->buf) || (uint16_t)(j->addr + j->len) != addr))
+			_flush(j);
+		if (!j->len)
+			j->addr = addr;
+
+		part = sizeof(j->buf) - j->len;
+		if (part > size)
+			part = size;
+		memcpy(j->buf + j->len, src, part);
+		j->len += part;
+
+		addr += part;
+		src += part;
+		size -= part;
+	}
+}
+
+static void
+_record(struct vm_state *vm, uint8_t func)
+{
+	struct journal *j = vm->sys_data;
+	uint8_t a = vm->a, x = vm->x, y = vm->y, sp = vm->sp, s = vm->s, mask = 0;
+	uint8_t args[JOURNAL_ARGS];
+	uint16_t pc = vm->pc;
+	uint32_t cycles = vm->cycles;
+
+	_put16(j->fd, pc);
+	fputc(func, j->fd);
+	_args(vm, args);
+	fwrite(args, 1, JOURNAL_ARGS, j->fd);
+
+	vm->ram_write = _record_write;
+	j->syscall(vm, func);
+	vm->ram_write = j->ram_write;
+
+	_flush(j);
+	fputc(0, j->fd);
+
+	mask |= vm->a != a ? J_A : 0;
+	mask |= vm->x != x ? J_X : 0;
+	mask |= vm->y != y ? J_Y : 0;
+	mask |= vm->sp != sp ? J_SP : 0;
+	mask |= vm->s != s ? J_S : 0;
+	mask |= vm->pc != pc ? J_PC : 0;
+	mask |= vm->cycles != cycles ? J_CYCLES : 0;
+
+	fputc(mask, j->fd);
+	if (mask & J_A)
+		fputc(vm->a, j->fd);
+	if (mask & J_X)
+		fputc(vm->x, j->fd);
+	if (mask & J_Y)
+		fputc(vm->y, j->fd);
+	if (mask & J_SP)
+		fputc(vm->sp, j->fd);
+	if (mask & J_S)
+		fputc(vm->s, j->fd);
+	if (mask & J_PC)
+		_put16(j->fd, vm->pc);
+	if (mask & J_CYCLES)
+		_put32(j->fd, vm->cycles);
+
+	j->count++;
+	j->func = func;
+}
+
+static void
+_replay(struct vm_state *vm, uint8_t func)
+{
+	struct journal *j = vm->sys_data;
+	uint8_t buf[255], args[JOURNAL_ARGS], size, mask;
+	uint16_t addr;
+
+	if (j->error)
+		return;
+
+	if (_get16(j->fd) != vm->pc || _get8(j->fd) != func
+			|| fread(buf, 1, JOURNAL_ARGS, j->fd) != JOURNAL_ARGS)
+	{
+		j->error = 1;
+		return;
+	}
+
+	// same call with different arguments
+	_args(vm, args);
+	if (memcmp(buf, args, JOURNAL_ARGS))
+	{
+		j->error = 1;
+		return;
+	}
+
+	while ((size = _get8(j->fd)))
+	{
+		addr = _get16(j->fd);
+		if (fread(buf, 1, size, j->fd) != size)
+		{
+			j->error = 1;
+			return;
+		}
+		vm->ram_write(vm, addr, buf, size);
+	}
+
+	mask = _get8(j->fd);
+	if (mask & J_A)
+		vm->a = _get8(j->fd);
+	if (mask & J_X)
+		vm->x = _get8(j->fd);
+	if (mask & J_Y)
+		vm->y = _get8(j->fd);
+	if (mask & J_SP)
+		vm->sp = _get8(j->fd);
+	if (mask & J_S)
+		vm->s = _get8(j->fd);
+	if (mask & J_PC)
+		vm->pc = _get16(j->fd);
+	if (mask & J_CYCLES)
+		vm->cycles = _get32(j->fd);
+
+	if (feof(j->fd))
+	{
+		j->error = 1;
+		return;
+	}
+
+	j->count++;
+	j->func = func;
+}
+
+static int
+_open(struct journal *j, struct vm_state *vm, const char *filename, uint8_t replay)
+{
+	char magic[5];
+
+	memset(j, 0, sizeof(struct journal));
+	j->fd = fopen(filename, replay ? "rb" : "wb");
+	if (!j->fd)
+		return -1;
+
+	if (replay)
+	{
+		if (fread(magic, 1, 5, j->fd) != 5 || memcmp(magic, _magic, 4)
+				|| magic[4] != JOURNAL_VERSION)
+		{
+			fclose(j->fd);
+			return -1;
+		}
+	}
+	else
+	{
+		fwrite(_magic, 1, 4, j->fd);
+		fputc(JOURNAL_VERSION, j->fd);
+	}
+
+	j->replay = replay;
+	j->syscall = vm->syscall;
+	j->ram_write = vm->ram_write;
+	vm->syscall = replay ? _replay : _record;
+	vm->sys_data = j;
+
+	return 0;
+}
+
+int
+journal_record(struct journal *j, struct vm_state *vm, const char *filename)
+{
+	return _open(j, vm, filename, 0);
+}
+
+int
+journal_replay(struct journal *j, struct vm_state *vm, const char *filename)
+{
+	return _open(j, vm, filename, 1);
+}
+
+void
+journal_close(struct journal *j, struct vm_state *vm)
+{
+	vm->syscall = j->syscall;
+	vm->sys_data = NULL;
+	fclose(j->fd);
+}
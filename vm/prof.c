@@ -0,0 +1,232 @@
+/*
+ * prof.c (flat profiler for 6502 programs)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prof.h"
+#include "dasm.h"
+
+struct prof_loop
+{
+	uint16_t start, end;
+	uint64_t cycles;
+};
+
+static int
+_by_addr(const void *a, const void *b)
+{
+	return ((const struct prof_label *)a)->addr - ((const struct prof_label *)b)->addr;
+}
+
+static int
+_by_cycles(const void *a, const void *b)
+{
+	const struct prof_label *la = a, *lb = b;
+
+	return la->cycles < lb->cycles ? 1 : la->cycles > lb->cycles ? -1 : 0;
+}
+
+// the label for the address, NULL if it is before the first one
+static struct prof_label *
+_label(struct prof_state *prof, uint16_t addr)
+{
+	int lo = 0, hi = prof->nlabels - 1, mid;
+	struct prof_label *found = NULL;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (prof->labels[mid].addr <= addr)
+		{
+			found = &prof->labels[mid];
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return found;
+}
+
+// target of a backward branch or jump at addr, -1 if it isn't one
+static int
+_loop_target(uint8_t *op, uint16_t addr)
+{
+	switch (op[0])
+	{
+		case 0x10: case 0x30: case 0x50: case 0x70:
+		case 0x90: case 0xb0: case 0xd0: case 0xf0:
+#ifdef VM_65C02
+		case 0x80:
+#endif
+			if (op[1] & 0x80)
+				return (uint16_t)(addr + 2 + (int8_t)op[1]);
+			break;
+		case 0x4c:
+			if (addr16(op[1], op[2]) <= addr)
+				return addr16(op[1], op[2]);
+			break;
+	}
+
+	return -1;
+}
+
+void
+prof_init(struct prof_state *prof)
+{
+	memset(prof, 0, sizeof(struct prof_state));
+}
+
+int
+prof_load(struct prof_state *prof, const char *filename)
+{
+	char line[256], name[128];
+	unsigned int addr;
+	FILE *fd;
+
+	fd = fopen(filename, "r");
+	if (!fd)
+		return -1;
+
+	prof->nlabels = 0;
+	while (fgets(line, sizeof(line), fd) && prof->nlabels < PROF_LABELS)
+	{
+		// al 001A04 .pushax, skipping the zero page and the linker symbols
+		if (sscanf(line, "al %x .%127s", &addr, name) != 2 || addr < 0x200
+				|| addr > 0xffff || !strncmp(name, "__", 2))
+			continue;
+
+		prof->labels[prof->nlabels].addr = addr;
+		snprintf(prof->labels[prof->nlabels].name, sizeof(prof->labels[0].name), "%.31s", name);
+		prof->nlabels++;
+	}
+	fclose(fd);
+
+	qsort(prof->labels, prof->nlabels, sizeof(struct prof_label), _by_addr);
+
+	return prof->nlabels;
+}
+
+uint8_t
+prof_run(struct prof_state *prof, struct vm_state *vm, uint16_t budget)
+{
+	uint32_t cycles;
+	uint16_t pc, ran = 0;
+	uint8_t ret = VM_BUDGET;
+
+	while (budget--)
+	{
+		pc = vm->pc;
+		cycles = vm->cycles;
+		ret = vm_run(vm, 1);
+		ran++;
+		prof->count[pc]++;
+		prof->cycles[pc] += vm->cycles - cycles;
+		if (ret != VM_BUDGET)
+			break;
+	}
+
+	// as vm_run() would
+	vm->ran = ran;
+	return ret;
+}
+
+void
+prof_report(struct prof_state *prof, struct vm_state *vm, FILE *fd)
+{
+	struct prof_loop loops[PROF_LOOPS + 1], loop;
+	struct prof_label *l, none = { 0, "(no label)", 0, 0 };
+	uint64_t total = 0;
+	uint32_t addr, i;
+	uint8_t op[3], len, j;
+	char text[32];
+	int target;
+
+	memset(loops, 0, sizeof(loops));
+	for (i = 0; i < prof->nlabels; i++)
+		prof->labels[i].count = prof->labels[i].cycles = 0;
+
+	for (addr = 0; addr < 0x10000; addr++)
+	{
+		if (!prof->count[addr])
+			continue;
+
+		total += prof->cycles[addr];
+		l = _label(prof, addr);
+		if (!l)
+			l = &none;
+		l->count += prof->count[addr];
+		l->cycles += prof->cycles[addr];
+
+		// the hot loops, kept sorted by cycles
+		vm->ram_read(vm, addr, op, 3);
+		target = _loop_target(op, addr);
+		if (target < 0)
+			continue;
+
+		loop.start = target;
+		loop.end = addr;
+		loop.cycles = 0;
+		for (i = target; i <= addr; i++)
+			loop.cycles += prof->cycles[i];
+
+		for (j = PROF_LOOPS; j > 0 && loops[j - 1].cycles < loop.cycles; j--)
+			loops[j] = loops[j - 1];
+		loops[j] = loop;
+	}
+
+	if (!total)
+		return;
+
+	// the labels are sorted by address again in the next prof_load()
+	qsort(prof->labels, prof->nlabels, sizeof(struct prof_label), _by_cycles);
+
+	fprintf(fd, "%% cycles      cycles  instructions  label\n");
+	for (i = 0; i <= prof->nlabels; i++)
+	{
+		l = i < prof->nlabels ? &prof->labels[i] : &none;
+		if (l->cycles)
+			fprintf(fd, "%7.2f %11llu %13llu  %s\n", l->cycles * 100.0 / total,
+					(unsigned long long)l->cycles, (unsigned long long)l->count, l->name);
+	}
+
+	qsort(prof->labels, prof->nlabels, sizeof(struct prof_label), _by_addr);
+
+	for (j = 0; j < PROF_LOOPS && loops[j].cycles; j++)
+	{
+		l = _label(prof, loops[j].start);
+		fprintf(fd, "\nloop $%04x-$%04x (%s): %.2f%% cycles\n", loops[j].start, loops[j].end,
+				l ? l->name : none.name, loops[j].cycles * 100.0 / total);
+
+		for (addr = loops[j].start; addr <= loops[j].end; addr += len)
+		{
+			vm->ram_read(vm, addr, op, 3);
+			len = dasm_das(addr, op, text);
+			fprintf(fd, "%11u %11llu  %04x: %s\n", prof->count[addr],
+					(unsigned long long)prof->cycles[addr], addr, text);
+		}
+	}
+}
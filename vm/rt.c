@@ -0,0 +1,1083 @@
+/*
+ * rt.c (native cc65 runtime helpers)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rt.h"
+
+// Each routine leaves registers, flags and memory (zero page temporaries and
+// the bytes pushed to the hardware stack included) as the code in rt.lib
+// (cc65 V2.14) does. The addresses of the internal calls are offsets in the
+// modules of that version. Cycles are not counted.
+
+// symbols from the label file
+enum { RT_SP, RT_SREG, RT_PTR1, RT_PTR2, RT_PTR3, RT_PTR4, RT_TMP1, RT_TMP2,
+	RT_MUL8X16, RT_POPSARGS, RT_SYMS };
+
+static const char *const _syms[RT_SYMS] = {
+	"sp", "sreg", "ptr1", "ptr2", "ptr3", "ptr4", "tmp1", "tmp2",
+	"mul8x16", "popsargs"
+};
+
+// all the routines use the zero page variables
+#define RT_ZP		((1 << RT_MUL8X16) - 1)
+
+#define SP(rt)		((rt)->sym[RT_SP])
+#define ZP(rt, n)	((uint8_t)(rt)->sym[n])
+
+static uint8_t
+_rd(struct vm_state *vm, uint16_t addr)
+{
+	uint8_t v;
+
+	vm->ram_read(vm, addr, &v, 1);
+	return v;
+}
+
+static void
+_wr(struct vm_state *vm, uint16_t addr, uint8_t v)
+{
+	vm->ram_write(vm, addr, &v, 1);
+}
+
+// zero page pointer
+static uint16_t
+_rd16(struct vm_state *vm, uint8_t zp)
+{
+	return addr16(_rd(vm, zp), _rd(vm, (uint8_t)(zp + 1)));
+}
+
+static void
+_wr16(struct vm_state *vm, uint8_t zp, uint16_t v)
+{
+	_wr(vm, zp, (uint8_t)v);
+	_wr(vm, (uint8_t)(zp + 1), v >> 8);
+}
+
+static void
+_nz(struct vm_state *vm, uint8_t v)
+{
+	vm->s = (vm->s & ~(sbit(Nf) | sbit(Zf))) | testN(v) | testZ(v);
+}
+
+static void
+_cv(struct vm_state *vm, uint8_t c, uint8_t v)
+{
+	vm->s = (vm->s & ~(sbit(Cf) | sbit(Vf))) | (c ? sbit(Cf) : 0) | (v ? sbit(Vf) : 0);
+}
+
+// binary ADC, SBC is a + ~b
+static uint8_t
+_adc(struct vm_state *vm, uint8_t a, uint8_t b)
+{
+	uint16_t r = a + b + testC(vm->s);
+
+	_cv(vm, r > 0xff, ~(a ^ b) & (a ^ r) & 0x80);
+	_nz(vm, r);
+	return r;
+}
+
+// PHA without the PLA, the byte stays in the stack
+static void
+_pha(struct vm_state *vm, uint8_t v)
+{
+	_wr(vm, addr16(vm->sp, 1), v);
+}
+
+// JSR at addr, the routine runs after this and calls _rts()
+static void
+_jsr(struct vm_state *vm, uint16_t addr)
+{
+	addr += 2;
+	_wr(vm, addr16(vm->sp, 1), addr >> 8);
+	_wr(vm, addr16((uint8_t)(vm->sp - 1), 1), (uint8_t)addr);
+	vm->sp -= 2;
+}
+
+static void
+_rts(struct vm_state *vm)
+{
+	vm->sp += 2;
+}
+
+// RTS from the routine that was trapped
+static void
+_return(struct vm_state *vm)
+{
+	vm->pc = addr16(_rd(vm, addr16((uint8_t)(vm->sp + 1), 1)),
+			_rd(vm, addr16((uint8_t)(vm->sp + 2), 1))) + 1;
+	vm->sp += 2;
+}
+
+// 16-bit increment of sp, flags from the last INC
+static void
+_incsp(struct rt_state *rt, struct vm_state *vm, uint8_t n)
+{
+	uint16_t sp = _rd16(vm, SP(rt)) + n;
+
+	_wr(vm, SP(rt), (uint8_t)sp);
+	if ((uint8_t)sp < n)
+	{
+		_wr(vm, ZP(rt, RT_SP) + 1, sp >> 8);
+		_nz(vm, sp >> 8);
+	}
+	else
+		_nz(vm, sp);
+}
+
+// pushax.s
+
+static void
+_pushax(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	_pha(vm, vm->a);
+	vm->s |= sbit(Cf);
+	_wr(vm, SP(rt), _adc(vm, sp, ~2));
+	if (!testC(vm->s))
+		_wr(vm, ZP(rt, RT_SP) + 1, (sp >> 8) - 1);
+	sp -= 2;
+	vm->y = 0;
+	_wr(vm, sp + 1, vm->x);
+	_wr(vm, sp, vm->a);
+	_nz(vm, 0);
+}
+
+static void
+_pusha0(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->x = 0;
+	_pushax(rt, vm);
+}
+
+static void
+_push0(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->a = 0;
+	_pusha0(rt, vm);
+}
+
+// pusha.s
+
+static void
+_pusha(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt)) - 1;
+
+	vm->y = 0;
+	_wr(vm, SP(rt), sp);
+	if ((uint8_t)sp == 0xff)
+	{
+		_wr(vm, ZP(rt, RT_SP) + 1, sp >> 8);
+		_nz(vm, 0xff);
+	}
+	else
+		_nz(vm, 0);
+	_wr(vm, sp, vm->a);
+}
+
+static void
+_pushaysp(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->a = _rd(vm, _rd16(vm, SP(rt)) + vm->y);
+	_pusha(rt, vm);
+}
+
+static void
+_pusha0sp(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->y = 0;
+	_pushaysp(rt, vm);
+}
+
+// popa.s, incsp1.s, incsp2.s, addysp.s and incsp3-8.s
+
+static void
+_popa(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->y = 0;
+	vm->a = _rd(vm, _rd16(vm, SP(rt)));
+	_incsp(rt, vm, 1);
+}
+
+static void
+_incsp1(struct rt_state *rt, struct vm_state *vm)
+{
+	_incsp(rt, vm, 1);
+}
+
+static void
+_incsp2(struct rt_state *rt, struct vm_state *vm)
+{
+	_incsp(rt, vm, 2);
+}
+
+static void
+_popax(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	vm->y = 0;
+	vm->x = _rd(vm, sp + 1);
+	vm->a = _rd(vm, sp);
+	_incsp(rt, vm, 2);
+}
+
+static void
+_addysp(struct rt_state *rt, struct vm_state *vm)
+{
+	uint8_t lo;
+
+	_pha(vm, vm->a);
+	vm->s &= ~sbit(Cf);
+	lo = _adc(vm, vm->y, _rd(vm, SP(rt)));
+	_wr(vm, SP(rt), lo);
+	if (testC(vm->s))
+		_wr(vm, ZP(rt, RT_SP) + 1, _rd(vm, ZP(rt, RT_SP) + 1) + 1);
+	_nz(vm, vm->a);
+}
+
+static void
+_addysp1(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->y++;
+	_addysp(rt, vm);
+}
+
+#define INCSP(n) \
+	static void \
+	_incsp##n(struct rt_state *rt, struct vm_state *vm) \
+	{ \
+		vm->y = n; \
+		_addysp(rt, vm); \
+	}
+
+INCSP(3)
+INCSP(4)
+INCSP(5)
+INCSP(6)
+INCSP(7)
+INCSP(8)
+
+// ldaxsp.s and staxsp.s
+
+static void
+_ldaxysp(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	vm->x = _rd(vm, sp + vm->y);
+	vm->y--;
+	vm->a = _rd(vm, sp + vm->y);
+	_nz(vm, vm->a);
+}
+
+static void
+_ldax0sp(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->y = 1;
+	_ldaxysp(rt, vm);
+}
+
+static void
+_staxysp(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	_wr(vm, sp + vm->y, vm->a);
+	vm->y++;
+	_pha(vm, vm->a);
+	_wr(vm, sp + vm->y, vm->x);
+	_nz(vm, vm->a);
+}
+
+static void
+_stax0sp(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->y = 0;
+	_staxysp(rt, vm);
+}
+
+// add.s, sub.s and neg.s
+
+static void
+_tosaddax(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+	uint8_t lo;
+
+	vm->s &= ~sbit(Cf);
+	lo = _adc(vm, vm->a, _rd(vm, sp));
+	vm->y = 1;
+	_pha(vm, lo);
+	vm->x = _adc(vm, vm->x, _rd(vm, sp + 1));
+	vm->s &= ~sbit(Cf);
+	_wr(vm, SP(rt), _adc(vm, sp, 2));
+	if (testC(vm->s))
+		_wr(vm, ZP(rt, RT_SP) + 1, (sp >> 8) + 1);
+	vm->a = lo;
+	_nz(vm, lo);
+}
+
+static void
+_tosadda0(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->x = 0;
+	_tosaddax(rt, vm);
+}
+
+static void
+_tossubax(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+	uint8_t lo;
+
+	vm->s |= sbit(Cf);
+	lo = _adc(vm, ~vm->a, _rd(vm, sp));
+	vm->y = 1;
+	_pha(vm, lo);
+	vm->x = _adc(vm, ~vm->x, _rd(vm, sp + 1));
+	vm->a = lo;
+	_addysp1(rt, vm);
+}
+
+static void
+_tossuba0(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->x = 0;
+	_tossubax(rt, vm);
+}
+
+static void
+_negax(struct rt_state *rt, struct vm_state *vm)
+{
+	uint8_t lo;
+
+	vm->s &= ~sbit(Cf);
+	lo = _adc(vm, ~vm->a, 1);
+	_pha(vm, lo);
+	vm->x = _adc(vm, ~vm->x, 0);
+	vm->a = lo;
+	_nz(vm, lo);
+}
+
+// popsreg.s, mul.s and mul8.s
+
+static void
+_popsreg(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	_pha(vm, vm->a);
+	_wr(vm, ZP(rt, RT_SREG) + 1, _rd(vm, sp + 1));
+	vm->y = 0;
+	_wr(vm, ZP(rt, RT_SREG), _rd(vm, sp));
+	_incsp(rt, vm, 2);
+}
+
+// 8x16 bit loop, multiplier in ptr4, multiplicand in sreg and X
+static void
+_mul8x16a(struct rt_state *rt, struct vm_state *vm)
+{
+	uint8_t p4l = _rd(vm, ZP(rt, RT_PTR4)), p4h = vm->a, sl = _rd(vm, ZP(rt, RT_SREG));
+	uint8_t a = vm->a, c, v = testV(vm->s), t, pushed = 0, stacked = 0;
+	uint16_t r;
+
+	// LSR ptr4 once, then the carry comes from ROR ptr4
+	c = p4l & 1;
+	p4l >>= 1;
+	for (; vm->y; vm->y--)
+	{
+		if (c)
+		{
+			r = a + sl;
+			a = pushed = r;
+			stacked = 1;
+			r = vm->x + p4h + (r >> 8);
+			v = ~(vm->x ^ p4h) & (vm->x ^ r) & 0x80;
+			c = r >> 8;
+			p4h = r;
+		}
+		t = p4h & 1;
+		p4h = (p4h >> 1) | (c << 7);
+		c = t;
+		t = a & 1;
+		a = (a >> 1) | (c << 7);
+		c = t;
+		t = p4l & 1;
+		p4l = (p4l >> 1) | (c << 7);
+		c = t;
+	}
+
+	if (stacked)
+		_pha(vm, pushed);
+	_wr(vm, ZP(rt, RT_PTR4), p4l);
+	_wr(vm, ZP(rt, RT_PTR4) + 1, p4h);
+	vm->x = a;
+	vm->a = p4l;
+	_cv(vm, c, v);
+	_nz(vm, p4l);
+}
+
+// 8x8 bit loop, multiplier in ptr4 and multiplicand in sreg
+static void
+_mul8x8(struct rt_state *rt, struct vm_state *vm)
+{
+	uint8_t p4l = _rd(vm, ZP(rt, RT_PTR4)), sl = _rd(vm, ZP(rt, RT_SREG));
+	uint8_t a = vm->a, c, v = testV(vm->s), t;
+	uint16_t r;
+
+	c = p4l & 1;
+	p4l >>= 1;
+	for (; vm->y; vm->y--)
+	{
+		if (c)
+		{
+			r = a + sl;
+			v = ~(a ^ sl) & (a ^ r) & 0x80;
+			c = r >> 8;
+			a = r;
+		}
+		t = a & 1;
+		a = (a >> 1) | (c << 7);
+		c = t;
+		t = p4l & 1;
+		p4l = (p4l >> 1) | (c << 7);
+		c = t;
+	}
+
+	_wr(vm, ZP(rt, RT_PTR4), p4l);
+	vm->x = a;
+	vm->a = p4l;
+	_cv(vm, c, v);
+	_nz(vm, p4l);
+}
+
+// mul8x16 at addr
+static void
+_mul8x16(struct rt_state *rt, struct vm_state *vm, uint16_t addr)
+{
+	_jsr(vm, addr);
+	_popsreg(rt, vm);
+	_rts(vm);
+	vm->a = 0;
+	vm->y = 8;
+	vm->x = _rd(vm, ZP(rt, RT_SREG) + 1);
+	if (vm->x)
+		_mul8x16a(rt, vm);
+	else
+		_mul8x8(rt, vm);
+}
+
+static void
+_tosmulax(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	uint8_t p4l = vm->a, p4h, sl, sh, t1, a = 0, c, v, t, y, pushed = 0, stacked = 0;
+	uint16_t r;
+
+	_wr(vm, ZP(rt, RT_PTR4), p4l);
+	vm->a = vm->x;
+	if (!vm->x)
+	{
+		_mul8x16(rt, vm, rt->sym[RT_MUL8X16]);
+		return;
+	}
+
+	p4h = vm->x;
+	_wr(vm, ZP(rt, RT_PTR4) + 1, p4h);
+	_jsr(vm, pc + 7);
+	_popsreg(rt, vm);
+	_rts(vm);
+
+	sl = _rd(vm, ZP(rt, RT_SREG));
+	sh = _rd(vm, ZP(rt, RT_SREG) + 1);
+	vm->a = 0;
+	if (!sh)
+	{
+		// 16x8 bit, swap the operands
+		_wr(vm, ZP(rt, RT_SREG), p4l);
+		_wr(vm, ZP(rt, RT_PTR4), sl);
+		vm->x = p4h;
+		vm->y = 8;
+		_mul8x16a(rt, vm);
+		return;
+	}
+
+	// 16x16 bit
+	t1 = 0;
+	v = testV(vm->s);
+	c = p4h & 1;
+	p4h >>= 1;
+	t = p4l & 1;
+	p4l = (p4l >> 1) | (c << 7);
+	c = t;
+	for (y = 16; y; y--)
+	{
+		if (c)
+		{
+			r = a + sl;
+			a = pushed = r;
+			stacked = 1;
+			r = sh + t1 + (r >> 8);
+			v = ~(sh ^ t1) & (sh ^ r) & 0x80;
+			c = r >> 8;
+			t1 = r;
+		}
+		t = t1 & 1;
+		t1 = (t1 >> 1) | (c << 7);
+		c = t;
+		t = a & 1;
+		a = (a >> 1) | (c << 7);
+		c = t;
+		t = p4h & 1;
+		p4h = (p4h >> 1) | (c << 7);
+		c = t;
+		t = p4l & 1;
+		p4l = (p4l >> 1) | (c << 7);
+		c = t;
+	}
+
+	if (stacked)
+		_pha(vm, pushed);
+	_wr(vm, ZP(rt, RT_TMP1), t1);
+	_wr(vm, ZP(rt, RT_PTR4), p4l);
+	_wr(vm, ZP(rt, RT_PTR4) + 1, p4h);
+	vm->a = p4l;
+	vm->x = p4h;
+	vm->y = 0;
+	_cv(vm, c, v);
+	_nz(vm, p4h);
+}
+
+static void
+_tosmula0(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_wr(vm, ZP(rt, RT_PTR4), vm->a);
+	_mul8x16(rt, vm, pc + 2);
+}
+
+// udiv.s, umod.s, shelp.s, div.s and mod.s
+
+// dividend in sreg, divisor in ptr4; quotient in sreg, remainder in ptr1
+static void
+_udiv16(struct rt_state *rt, struct vm_state *vm)
+{
+	uint8_t p4l = _rd(vm, ZP(rt, RT_PTR4)), p4h = _rd(vm, ZP(rt, RT_PTR4) + 1);
+	uint8_t sl = _rd(vm, ZP(rt, RT_SREG)), sh = _rd(vm, ZP(rt, RT_SREG) + 1);
+	uint8_t a = 0, p1h = 0, pushed = 0, c, v = testV(vm->s), t;
+	uint16_t r;
+
+	for (vm->y = 16; vm->y; vm->y--)
+	{
+		c = sl >> 7;
+		sl <<= 1;
+		t = sh >> 7;
+		sh = (sh << 1) | c;
+		c = t;
+		t = a >> 7;
+		a = (a << 1) | c;
+		c = t;
+
+		if (p4h)
+		{
+			// 16-bit divisor
+			t = p1h >> 7;
+			p1h = (p1h << 1) | c;
+			pushed = a;
+			r = p1h + (uint8_t)~p4h + (a >= p4l);
+			v = ~(p1h ^ ~p4h) & (p1h ^ r) & 0x80;
+			c = r >> 8;
+			if (c)
+			{
+				p1h = r;
+				r = a + (uint8_t)~p4l + 1;
+				v = ~(a ^ ~p4l) & (a ^ r) & 0x80;
+				c = r >> 8;
+				a = pushed = r;
+				sl++;
+			}
+			a = pushed;
+		}
+		else if (c || a >= p4l)
+		{
+			// 8-bit divisor, the carry of ROL A or CMP is set
+			r = a + (uint8_t)~p4l + 1;
+			v = ~(a ^ ~p4l) & (a ^ r) & 0x80;
+			c = r >> 8;
+			a = r;
+			sl++;
+		}
+		else
+			c = 0;
+	}
+
+	if (p4h)
+		_pha(vm, pushed);
+	_wr(vm, ZP(rt, RT_PTR1), a);
+	_wr(vm, ZP(rt, RT_PTR1) + 1, p1h);
+	_wr(vm, ZP(rt, RT_SREG), sl);
+	_wr(vm, ZP(rt, RT_SREG) + 1, sh);
+	vm->a = a;
+	vm->x = p4h;
+	_cv(vm, c, v);
+	_nz(vm, 0);
+}
+
+// tosudivax and tosumodax, up to the call to udiv16 at pc + 7
+static void
+_udiv(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_wr(vm, ZP(rt, RT_PTR4), vm->a);
+	_wr(vm, ZP(rt, RT_PTR4) + 1, vm->x);
+	_jsr(vm, pc + 4);
+	_popsreg(rt, vm);
+	_rts(vm);
+	_jsr(vm, pc + 7);
+	_udiv16(rt, vm);
+	_rts(vm);
+}
+
+static void
+_tosudivax(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_udiv(rt, vm, pc);
+	vm->a = _rd(vm, ZP(rt, RT_SREG));
+	vm->x = _rd(vm, ZP(rt, RT_SREG) + 1);
+	_nz(vm, vm->x);
+}
+
+static void
+_tosudiva0(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	vm->x = 0;
+	_tosudivax(rt, vm, pc + 2);
+}
+
+static void
+_tosumodax(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_udiv(rt, vm, pc);
+	vm->a = _rd(vm, ZP(rt, RT_PTR1));
+	vm->x = _rd(vm, ZP(rt, RT_PTR1) + 1);
+	_nz(vm, vm->x);
+}
+
+static void
+_tosumoda0(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	vm->x = 0;
+	_tosumodax(rt, vm, pc + 2);
+}
+
+// divisor in AX and dividend in the C stack, keeping the signs in tmp2 and tmp1
+static void
+_popsargs(struct rt_state *rt, struct vm_state *vm)
+{
+	uint16_t pc = rt->sym[RT_POPSARGS];
+
+	_wr(vm, ZP(rt, RT_TMP2), vm->x);
+	vm->s |= sbit(Cf);
+	_nz(vm, vm->x);
+	if (vm->x & 0x80)
+	{
+		_jsr(vm, pc + 6);
+		_negax(rt, vm);
+		_rts(vm);
+	}
+	_wr(vm, ZP(rt, RT_PTR4), vm->a);
+	_wr(vm, ZP(rt, RT_PTR4) + 1, vm->x);
+	_jsr(vm, pc + 0x0d);
+	_popax(rt, vm);
+	_rts(vm);
+	_wr(vm, ZP(rt, RT_TMP1), vm->x);
+	vm->s |= sbit(Cf);
+	_nz(vm, vm->x);
+	if (vm->x & 0x80)
+	{
+		_jsr(vm, pc + 0x16);
+		_negax(rt, vm);
+		_rts(vm);
+	}
+	_wr(vm, ZP(rt, RT_SREG), vm->a);
+	_wr(vm, ZP(rt, RT_SREG) + 1, vm->x);
+}
+
+// tosdivax and tosmodax, up to the call to udiv16 at pc + 3
+static void
+_div(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_jsr(vm, pc);
+	_popsargs(rt, vm);
+	_rts(vm);
+	_jsr(vm, pc + 3);
+	_udiv16(rt, vm);
+	_rts(vm);
+}
+
+static void
+_tosdivax(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	_div(rt, vm, pc);
+	vm->x = _rd(vm, ZP(rt, RT_SREG) + 1);
+	vm->a = _rd(vm, ZP(rt, RT_SREG));
+	if ((_rd(vm, ZP(rt, RT_TMP1)) ^ _rd(vm, ZP(rt, RT_TMP2))) & 0x80)
+		_negax(rt, vm);
+	else
+		_nz(vm, vm->a);
+}
+
+static void
+_tosdiva0(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	vm->x = 0;
+	_tosdivax(rt, vm, pc + 2);
+}
+
+static void
+_tosmodax(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	uint8_t t;
+
+	_div(rt, vm, pc);
+	vm->a = _rd(vm, ZP(rt, RT_PTR1));
+	vm->x = _rd(vm, ZP(rt, RT_PTR1) + 1);
+	// BIT tmp1
+	t = _rd(vm, ZP(rt, RT_TMP1));
+	vm->s = (vm->s & ~(sbit(Nf) | sbit(Vf) | sbit(Zf))) | testN(t) | testV(t) | testZ(t & vm->a);
+	if (t & 0x80)
+		_negax(rt, vm);
+}
+
+static void
+_tosmoda0(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	vm->x = 0;
+	_tosmodax(rt, vm, pc + 2);
+}
+
+// memcpy.s and memset.s
+
+// the destination can't be in the zero page, the stack or the C stack arguments
+static uint8_t
+_dst_ok(struct rt_state *rt, struct vm_state *vm, uint16_t dst, uint16_t size, uint8_t args)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+
+	if (!size)
+		return 1;
+	if ((uint32_t)dst + size > 0x10000 || dst < 0x200)
+		return 0;
+	return dst + size <= sp || dst >= (uint32_t)sp + args;
+}
+
+static void
+_copy(struct vm_state *vm, uint16_t dst, uint16_t src, uint16_t size)
+{
+	uint8_t buf[128], n;
+
+	while (size)
+	{
+		n = size < sizeof(buf) ? size : sizeof(buf);
+		// overlapping forward, copy the bytes the same way
+		if (dst > src && dst - src < n)
+			n = dst - src;
+		vm->ram_read(vm, src, buf, n);
+		vm->ram_write(vm, dst, buf, n);
+		src += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+static void
+_fill(struct vm_state *vm, uint16_t dst, uint8_t v, uint16_t size)
+{
+	uint8_t buf[128], n;
+
+	memset(buf, v, sizeof(buf));
+	while (size)
+	{
+		n = size < sizeof(buf) ? size : sizeof(buf);
+		vm->ram_write(vm, dst, buf, n);
+		dst += n;
+		size -= n;
+	}
+}
+
+static uint8_t
+_memcpy(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	uint16_t size = addr16(vm->a, vm->x), sp = _rd16(vm, SP(rt));
+	uint16_t src = addr16(_rd(vm, sp), _rd(vm, sp + 1));
+	uint16_t dst = addr16(_rd(vm, sp + 2), _rd(vm, sp + 3));
+
+	if (!_dst_ok(rt, vm, dst, size, 4))
+		return 0;
+
+	// memcpy_getparams at pc + 0x29
+	_jsr(vm, pc);
+	_wr16(vm, ZP(rt, RT_PTR3), size);
+	_jsr(vm, pc + 0x2d);
+	_popax(rt, vm);
+	_rts(vm);
+	_rts(vm);
+
+	_copy(vm, dst, src, size);
+
+	_wr16(vm, ZP(rt, RT_PTR1), src + (size & 0xff00));
+	_wr16(vm, ZP(rt, RT_PTR2), dst + (size & 0xff00));
+	_popax(rt, vm);
+
+	if (size)
+		vm_invalidate(vm, dst, size);
+	return 1;
+}
+
+// bzero and memset from the point they get the destination
+static void
+_memset_dst(struct rt_state *rt, struct vm_state *vm, uint16_t size, uint8_t v)
+{
+	uint16_t sp = _rd16(vm, SP(rt));
+	uint16_t dst = addr16(_rd(vm, sp), _rd(vm, sp + 1)), p1 = dst, half = size >> 1;
+	uint16_t r;
+
+	_wr16(vm, ZP(rt, RT_PTR3), half);
+	_fill(vm, dst, v, size);
+
+	if (size & 1)
+		p1++;
+
+	// ptr2 = ptr1 + half, the flags from the high byte
+	r = (uint8_t)p1 + (uint8_t)half;
+	r = (p1 >> 8) + (half >> 8) + (r >> 8);
+	_cv(vm, r > 0xff, ~((p1 >> 8) ^ (half >> 8)) & ((p1 >> 8) ^ r) & 0x80);
+
+	_wr16(vm, ZP(rt, RT_PTR1), p1 + (half & 0xff00));
+	_wr16(vm, ZP(rt, RT_PTR2), p1 + half + (half & 0xff00));
+	_popax(rt, vm);
+
+	if (size)
+		vm_invalidate(vm, dst, size);
+}
+
+static uint8_t
+_memset(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	uint16_t size = addr16(vm->a, vm->x), sp = _rd16(vm, SP(rt));
+
+	if (!_dst_ok(rt, vm, addr16(_rd(vm, sp + 2), _rd(vm, sp + 3)), size, 4))
+		return 0;
+
+	_jsr(vm, pc + 4);
+	_popax(rt, vm);
+	_rts(vm);
+	_memset_dst(rt, vm, size, vm->a);
+	return 1;
+}
+
+static uint8_t
+_bzero(struct rt_state *rt, struct vm_state *vm, uint16_t pc)
+{
+	uint16_t size = addr16(vm->a, vm->x), sp = _rd16(vm, SP(rt));
+
+	if (!_dst_ok(rt, vm, addr16(_rd(vm, sp), _rd(vm, sp + 1)), size, 2))
+		return 0;
+
+	_memset_dst(rt, vm, size, 0);
+	return 1;
+}
+
+// routine table
+
+// the simple routines don't need the address they were called at
+#define RT_FN(f) \
+	static uint8_t \
+	f##_rt(struct rt_state *rt, struct vm_state *vm, uint16_t pc) \
+	{ \
+		f(rt, vm); \
+		return 1; \
+	}
+
+#define RT_PC(f) \
+	static uint8_t \
+	f##_rt(struct rt_state *rt, struct vm_state *vm, uint16_t pc) \
+	{ \
+		f(rt, vm, pc); \
+		return 1; \
+	}
+
+RT_FN(_push0) RT_FN(_pusha0) RT_FN(_pushax) RT_FN(_pusha) RT_FN(_pushaysp)
+RT_FN(_pusha0sp) RT_FN(_popa) RT_FN(_popax) RT_FN(_incsp1) RT_FN(_incsp2)
+RT_FN(_incsp3) RT_FN(_incsp4) RT_FN(_incsp5) RT_FN(_incsp6) RT_FN(_incsp7)
+RT_FN(_incsp8) RT_FN(_addysp) RT_FN(_addysp1) RT_FN(_ldaxysp) RT_FN(_ldax0sp)
+RT_FN(_staxysp) RT_FN(_stax0sp) RT_FN(_tosaddax) RT_FN(_tosadda0)
+RT_FN(_tossubax) RT_FN(_tossuba0) RT_FN(_negax) RT_FN(_popsreg)
+RT_PC(_tosmulax) RT_PC(_tosmula0) RT_PC(_tosudivax) RT_PC(_tosudiva0)
+RT_PC(_tosumodax) RT_PC(_tosumoda0) RT_PC(_tosdivax) RT_PC(_tosdiva0)
+RT_PC(_tosmodax) RT_PC(_tosmoda0)
+
+#define _memcpy_rt	_memcpy
+#define _memset_rt	_memset
+#define _bzero_rt	_bzero
+
+struct rt_routine
+{
+	const char *name;
+	uint8_t (*run)(struct rt_state *rt, struct vm_state *vm, uint16_t pc);
+	// symbols needed
+	uint16_t syms;
+};
+
+#define ROUTINE(name, f, syms)	{ name, f##_rt, RT_ZP | (syms) }
+
+// index 0 is no routine
+static const struct rt_routine _routines[] = {
+	{ NULL, NULL, 0 },
+	ROUTINE("push0", _push0, 0),
+	ROUTINE("pusha0", _pusha0, 0),
+	ROUTINE("pushax", _pushax, 0),
+	ROUTINE("pusha", _pusha, 0),
+	ROUTINE("pushaysp", _pushaysp, 0),
+	ROUTINE("pusha0sp", _pusha0sp, 0),
+	ROUTINE("popa", _popa, 0),
+	ROUTINE("popax", _popax, 0),
+	ROUTINE("incsp1", _incsp1, 0),
+	ROUTINE("incsp2", _incsp2, 0),
+	ROUTINE("incsp3", _incsp3, 0),
+	ROUTINE("incsp4", _incsp4, 0),
+	ROUTINE("incsp5", _incsp5, 0),
+	ROUTINE("incsp6", _incsp6, 0),
+	ROUTINE("incsp7", _incsp7, 0),
+	ROUTINE("incsp8", _incsp8, 0),
+	ROUTINE("addysp", _addysp, 0),
+	ROUTINE("addysp1", _addysp1, 0),
+	ROUTINE("ldaxysp", _ldaxysp, 0),
+	ROUTINE("ldax0sp", _ldax0sp, 0),
+	ROUTINE("staxysp", _staxysp, 0),
+	ROUTINE("stax0sp", _stax0sp, 0),
+	ROUTINE("tosaddax", _tosaddax, 0),
+	ROUTINE("tosadda0", _tosadda0, 0),
+	ROUTINE("tossubax", _tossubax, 0),
+	ROUTINE("tossuba0", _tossuba0, 0),
+	ROUTINE("negax", _negax, 0),
+	ROUTINE("popsreg", _popsreg, 0),
+	ROUTINE("tosmulax", _tosmulax, 1 << RT_MUL8X16),
+	ROUTINE("tosumulax", _tosmulax, 1 << RT_MUL8X16),
+	ROUTINE("tosmula0", _tosmula0, 0),
+	ROUTINE("tosumula0", _tosmula0, 0),
+	ROUTINE("tosudivax", _tosudivax, 0),
+	ROUTINE("tosudiva0", _tosudiva0, 0),
+	ROUTINE("tosumodax", _tosumodax, 0),
+	ROUTINE("tosumoda0", _tosumoda0, 0),
+	ROUTINE("tosdivax", _tosdivax, 1 << RT_POPSARGS),
+	ROUTINE("tosdiva0", _tosdiva0, 1 << RT_POPSARGS),
+	ROUTINE("tosmodax", _tosmodax, 1 << RT_POPSARGS),
+	ROUTINE("tosmoda0", _tosmoda0, 1 << RT_POPSARGS),
+	ROUTINE("_memcpy", _memcpy, 0),
+	ROUTINE("_memset", _memset, 0),
+	ROUTINE("_bzero", _bzero, 0),
+	ROUTINE("__bzero", _bzero, 0),
+};
+
+#define RT_ROUTINES		(sizeof(_routines) / sizeof(_routines[0]))
+
+static uint8_t
+_trap(struct vm_state *vm)
+{
+	// the traps are the first thing in the state
+	struct rt_state *rt = (struct rt_state *)vm->traps;
+
+	// the native code is binary only
+	if (testD(vm->s))
+		return 0;
+
+	if (!_routines[rt->fn[vm->pc]].run(rt, vm, vm->pc))
+		return 0;
+
+	_return(vm);
+	rt->calls++;
+	return 1;
+}
+
+void
+rt_init(struct rt_state *rt)
+{
+	memset(rt, 0, sizeof(struct rt_state));
+}
+
+int
+rt_load(struct rt_state *rt, const char *filename)
+{
+	char line[256], name[128];
+	unsigned int addr;
+	uint16_t found = 0;
+	uint16_t pcs[RT_ROUTINES];
+	uint8_t i;
+	FILE *fd;
+	int count = 0;
+
+	fd = fopen(filename, "r");
+	if (!fd)
+		return -1;
+
+	memset(pcs, 0, sizeof(pcs));
+	while (fgets(line, sizeof(line), fd))
+	{
+		// al 001A04 .pushax
+		if (sscanf(line, "al %x .%127s", &addr, name) != 2 || addr > 0xffff)
+			continue;
+
+		for (i = 0; i < RT_SYMS; i++)
+			if (!strcmp(name, _syms[i]))
+			{
+				rt->sym[i] = addr;
+				found |= 1 << i;
+			}
+
+		for (i = 1; i < RT_ROUTINES; i++)
+			if (!strcmp(name, _routines[i].name))
+				pcs[i] = addr;
+	}
+	fclose(fd);
+
+	// only the routines with all the symbols they need
+	for (i = 1; i < RT_ROUTINES; i++)
+		if (pcs[i] && (_routines[i].syms & found) == _routines[i].syms)
+		{
+			rt->fn[pcs[i]] = i;
+			rt->traps[pcs[i] >> 3] |= 1 << (pcs[i] & 7);
+			count++;
+		}
+
+	return count;
+}
+
+void
+rt_attach(struct rt_state *rt, struct vm_state *vm)
+{
+	vm->traps = rt ? rt->traps : NULL;
+	vm->trap = rt ? _trap : NULL;
+}
@@ -0,0 +1,253 @@
+/*
+ * snap.c (VM snapshots with copy-on-write memory)
+ * Copyright (C) 2015 by Juan J. Martinez <jjm@usebox.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snap.h"
+
+// forks on other threads share the pages, so the counts are atomic; the
+// last one to drop a page frees it after the others are done with it
+static void
+_hold(struct snap_page *p)
+{
+	if (p)
+		__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+_release(struct snap_page *p)
+{
+	if (p && !__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		free(p);
+}
+
+// the page not shared, to write to it
+static struct snap_page *
+_own(struct snap_mem *mem, uint8_t page)
+{
+	struct snap_page *p = mem->pages[page], *copy;
+
+	// nobody else holds it, so nobody else can share it now
+	if (p && __atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) == 1)
+		return p;
+
+	copy = malloc(sizeof(struct snap_page));
+	if (!copy)
+	{
+		fprintf(stderr, "snap: out of memory\n");
+		abort();
+	}
+
+	copy->refs = 1;
+	if (p)
+	{
+		memcpy(copy->data, p->data, 256);
+		_release(p);
+	}
+	else
+		memset(copy->data, 0, 256);
+
+	mem->pages[page] = copy;
+	mem->copies++;
+
+	return copy;
+}
+
+static void
+_ram_read(struct vm_state *vm, uint16_t addr, uint8_t *dst, uint8_t size)
+{
+	struct snap_mem *mem = vm->data;
+	struct snap_page *p;
+	uint16_t part;
+
+	while (size)
+	{
+		part = 0x100 - (addr & 0xff);
+		if (part > size)
+			part = size;
+
+		p = mem->pages[addr >> 8];
+		if (p)
+			memcpy(dst, p->data + (addr & 0xff), part);
+		else
+			memset(dst, 0, part);
+
+		addr += part;
+		dst += part;
+		size -= part;
+	}
+}
+
+static void
+_ram_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	struct snap_mem *mem = vm->data;
+	uint16_t part;
+
+	while (size)
+	{
+		part = 0x100 - (addr & 0xff);
+		if (part > size)
+			part = size;
+
+		memcpy(_own(mem, addr >> 8)->data + (addr & 0xff), src, part);
+
+		addr += part;
+		src += part;
+		size -= part;
+	}
+}
+
+void
+snap_mem_init(struct snap_mem *mem)
+{
+	memset(mem, 0, sizeof(struct snap_mem));
+}
+
+void
+snap_mem_free(struct snap_mem *mem)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		_release(mem->pages[i]);
+	snap_mem_init(mem);
+}
+
+void
+snap_mem_load(struct snap_mem *mem, uint16_t addr, const uint8_t *src, uint32_t size)
+{
+	struct vm_state vm;
+	uint32_t part;
+
+	// the write callback does the copies
+	vm.data = mem;
+	while (size)
+	{
+		part = size < 0x80 ? size : 0x80;
+		_ram_write(&vm, addr, (uint8_t *)src, part);
+		addr += part;
+		src += part;
+		size -= part;
+	}
+}
+
+void
+snap_attach(struct snap_mem *mem, struct vm_state *vm)
+{
+	vm->ram_read = _ram_read;
+	vm->ram_write = _ram_write;
+	vm->data = mem;
+}
+
+void
+snap_take(struct snap *snap, const struct vm_state *vm)
+{
+	const struct snap_mem *mem = vm->data;
+	int i;
+
+	snap->a = vm->a;
+	snap->x = vm->x;
+	snap->y = vm->y;
+	snap->sp = vm->sp;
+	snap->s = vm->s;
+	snap->pc = vm->pc;
+	snap->cycles = vm->cycles;
+	snap->irq = vm->irq;
+	snap->nmi = vm->nmi;
+	snap->sys_pc = vm->sys_pc;
+	snap->sys_cycles = vm->sys_cycles;
+	snap->idle = vm->idle;
+
+	snap->syscall = vm->syscall;
+	snap->sys_data = vm->sys_data;
+	snap->traps = vm->traps;
+	snap->trap = vm->trap;
+
+	for (i = 0; i < 256; i++)
+	{
+		snap->mem.pages[i] = mem->pages[i];
+		_hold(mem->pages[i]);
+	}
+	snap->mem.copies = 0;
+}
+
+void
+snap_restore(const struct snap *snap, struct vm_state *vm)
+{
+	struct snap_mem *mem = vm->data;
+	struct snap_page *p;
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		p = snap->mem.pages[i];
+		_hold(p);
+		_release(mem->pages[i]);
+		mem->pages[i] = p;
+	}
+
+	// drops the prefetch window and decoded blocks
+	vm_init(vm);
+
+	vm->a = snap->a;
+	vm->x = snap->x;
+	vm->y = snap->y;
+	vm->sp = snap->sp;
+	vm->s = snap->s;
+	vm->pc = snap->pc;
+	vm->cycles = snap->cycles;
+	vm->irq = snap->irq;
+	vm->nmi = snap->nmi;
+	vm->event = snap->irq | snap->nmi;
+	vm->sys_pc = snap->sys_pc;
+	vm->sys_cycles = snap->sys_cycles;
+	vm->idle = snap->idle;
+
+	vm->syscall = snap->syscall;
+	vm->sys_data = snap->sys_data;
+	vm->traps = snap->traps;
+	vm->trap = snap->trap;
+}
+
+void
+snap_free(struct snap *snap)
+{
+	snap_mem_free(&snap->mem);
+}
+
+void
+snap_fork(const struct snap *snap, struct vm_state *vms, struct snap_mem *mems, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		snap_mem_init(&mems[i]);
+		snap_attach(&mems[i], &vms[i]);
+		snap_restore(snap, &vms[i]);
+	}
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+#include "ram.h"
+
+#if defined(VM_BLOCKS)
+#define DISPATCH_NAME "blocks"
+#elif defined(VM_THREADED)
+#define DISPATCH_NAME "threaded"
+#else
+#define DISPATCH_NAME "switch"
+#endif
+
+#ifdef VM_TRACE
+#define TRACE_NAME(vm)	((vm).trace ? " (trace on)" : " (trace off)")
+#else
+#define TRACE_NAME(vm)	""
+#endif
+
+#define BATCH 1000
+
+uint8_t ram[65536];
+
+// with VM_TRACE, any argument turns tracing on
+int
+main(int argc, char *argv[])
+{
+	const char *image = "images/6502_functional_test.bin";
+	const uint16_t result = 0x3399;
+	static struct vm_state vm;
+	uint16_t old;
+	uint32_t ops = 0;
+	clock_t start;
+	double secs;
+#ifdef VM_TRACE
+	struct vm_trace *tr;
+#endif
+
+	if (!ram_load(image, ram, 0x10000))
+		return 1;
+
+	ram_attach(&vm, ram, syscall_stub);
+
+	vm_init(&vm);
+	vm.pc = 0x400;
+#ifdef VM_TRACE
+	vm.trace = argc > 1;
+#endif
+
+	start = clock();
+	while (vm.pc != result)
+	{
+		if (vm_run(&vm, BATCH) != VM_BUDGET)
+			break;
+		ops += vm.ran;
+
+		// the test traps with a branch or jump to itself on failure
+		old = vm.pc;
+		if (vm_run(&vm, 1) != VM_BUDGET)
+			break;
+		ops++;
+		if (vm.pc == old)
+			break;
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	if (vm.pc != result)
+	{
+		fprintf(stderr, "%s%s: failed at %04x\n", DISPATCH_NAME, TRACE_NAME(vm), vm.pc);
+		return 1;
+	}
+
+#ifdef VM_TRACE
+	// the ring is full and ends with the jump to the success trap
+	tr = &vm.traces[(uint8_t)(vm.trace_pos - 1) & (VM_TRACE - 1)];
+	if (vm.trace && (vm.trace_len != VM_TRACE || ram[tr->pc] != tr->op || tr->op != 0x4c))
+	{
+		fprintf(stderr, "%s%s: bad trace ending at %04x\n", DISPATCH_NAME, TRACE_NAME(vm), tr->pc);
+		return 1;
+	}
+#endif
+
+	printf("%s%s: %u instructions, %u cycles, %.3f s, %.2f MIPS\n",
+			DISPATCH_NAME, TRACE_NAME(vm), ops, vm.cycles, secs, secs > 0 ? ops / secs / 1e6 : 0);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "ram.h"
+
+#ifndef VM_65C02
+#error "build with -DVM_65C02"
+#endif
+
+uint8_t ram[65536];
+
+struct vm_state vm;
+
+struct c02_case
+{
+	const char *name;
+	uint8_t code[5];
+	uint8_t a, x, y, s;
+	// expected registers, PC after the SYS and one memory location
+	uint8_t ea, ex, ey, es;
+	uint16_t pc, addr;
+	uint8_t value;
+};
+
+// the code runs at 0x400 and ends with SYS; ($10) points to 0x1234 (0x5a),
+// 0x20 is 0xf0, ($1000) points to a SYS at 0x410 and BRK to one at 0x420
+static const struct c02_case cases[] = {
+	{ "LDA (zp)", { 0xb2, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x5a, 2, 3, 0, 0x403, 0x1234, 0x5a },
+	{ "ORA (zp)", { 0x12, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x5f, 2, 3, 0, 0x403, 0x1234, 0x5a },
+	{ "AND (zp)", { 0x32, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x0a, 2, 3, 0, 0x403, 0x1234, 0x5a },
+	{ "EOR (zp)", { 0x52, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x55, 2, 3, 0, 0x403, 0x1234, 0x5a },
+	{ "ADC (zp)", { 0x72, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x69, 2, 3, 0, 0x403, 0x1234, 0x5a },
+	{ "SBC (zp)", { 0xf2, 0x10, 0x02 }, 0x0f, 2, 3, 0x01, 0xb5, 2, 3, 0x80, 0x403, 0x1234, 0x5a },
+	{ "CMP (zp)", { 0xd2, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0x80, 0x403, 0x1234, 0x5a },
+	{ "STA (zp)", { 0x92, 0x10, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x403, 0x1234, 0x0f },
+	{ "STZ zp", { 0x64, 0x20, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x403, 0x20, 0 },
+	{ "STZ zp,x", { 0x74, 0x1e, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x403, 0x20, 0 },
+	{ "STZ abs", { 0x9c, 0x34, 0x12, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x404, 0x1234, 0 },
+	{ "STZ abs,x", { 0x9e, 0x32, 0x12, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x404, 0x1234, 0 },
+	{ "INC a", { 0x1a, 0x02 }, 0xff, 2, 3, 0, 0, 2, 3, 0x02, 0x402, 0x1234, 0x5a },
+	{ "DEC a", { 0x3a, 0x02 }, 0, 2, 3, 0, 0xff, 2, 3, 0x80, 0x402, 0x1234, 0x5a },
+	{ "PHX, PLA", { 0xda, 0x68, 0x02 }, 0x0f, 2, 3, 0, 2, 2, 3, 0, 0x403, 0x1ff, 2 },
+	{ "PHY, PLX", { 0x5a, 0xfa, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 3, 3, 0, 0x403, 0x1ff, 3 },
+	{ "PHA, PLY", { 0x48, 0x7a, 0x02 }, 0x8f, 2, 3, 0, 0x8f, 2, 0x8f, 0x80, 0x403, 0x1ff, 0x8f },
+	{ "BRA", { 0x80, 0x01, 0x00, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x404, 0x1234, 0x5a },
+	{ "JMP (abs,x)", { 0x7c, 0xfe, 0x0f }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x411, 0x1234, 0x5a },
+	{ "BIT #n", { 0x89, 0x80, 0x02 }, 0x0f, 2, 3, 0x80, 0x0f, 2, 3, 0x82, 0x403, 0x1234, 0x5a },
+	{ "BIT zp,x", { 0x34, 0x1e, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0xc2, 0x403, 0x20, 0xf0 },
+	{ "BIT abs,x", { 0x3c, 0x32, 0x12, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0x40, 0x404, 0x1234, 0x5a },
+	{ "TSB zp", { 0x04, 0x20, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0x02, 0x403, 0x20, 0xff },
+	{ "TSB abs", { 0x0c, 0x34, 0x12, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x404, 0x1234, 0x5f },
+	{ "TRB zp", { 0x14, 0x20, 0x02 }, 0x30, 2, 3, 0, 0x30, 2, 3, 0, 0x403, 0x20, 0xc0 },
+	{ "TRB abs", { 0x1c, 0x34, 0x12, 0x02 }, 0x0f, 2, 3, 0, 0x0f, 2, 3, 0, 0x404, 0x1234, 0x50 },
+	// N and Z are valid in decimal mode
+	{ "ADC #n (D)", { 0x69, 0x01, 0x02 }, 0x99, 2, 3, 0x08, 0, 2, 3, 0x0b, 0x403, 0x1234, 0x5a },
+	// BRK clears D
+	{ "BRK", { 0x00 }, 0x0f, 2, 3, 0x08, 0x0f, 2, 3, 0x04, 0x421, 0x1234, 0x5a },
+};
+
+struct c02_timing
+{
+	const char *name;
+	uint8_t code[4];
+	uint8_t x;
+	// cycles including the 2 of the SYS
+	uint32_t cycles;
+};
+
+static const struct c02_timing timings[] = {
+	{ "JMP (abs)", { 0x6c, 0x00, 0x10 }, 0, 6 + 2 },
+	{ "ASL abs,x", { 0x1e, 0x00, 0x12 }, 0x10, 6 + 2 },
+	{ "ROL abs,x", { 0x3e, 0x00, 0x12 }, 0x10, 6 + 2 },
+	{ "LSR abs,x", { 0x5e, 0x00, 0x12 }, 0x10, 6 + 2 },
+	{ "ROR abs,x", { 0x7e, 0x00, 0x12 }, 0x10, 6 + 2 },
+	{ "ASL abs,x page", { 0x1e, 0xf0, 0x12 }, 0x10, 7 + 2 },
+	{ "ROL abs,x page", { 0x3e, 0xf0, 0x12 }, 0x10, 7 + 2 },
+	{ "LSR abs,x page", { 0x5e, 0xf0, 0x12 }, 0x10, 7 + 2 },
+	{ "ROR abs,x page", { 0x7e, 0xf0, 0x12 }, 0x10, 7 + 2 },
+};
+
+int
+main()
+{
+	const struct c02_case *c;
+	const struct c02_timing *t;
+	uint8_t i, failed = 0;
+
+	ram_attach(&vm, ram, syscall_stub);
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		c = &cases[i];
+
+		memset(ram, 0, sizeof(ram));
+		ram[0x10] = 0x34;
+		ram[0x11] = 0x12;
+		ram[0x1234] = 0x5a;
+		ram[0x20] = 0xf0;
+		ram[0x1000] = 0x10;
+		ram[0x1001] = 0x04;
+		ram[0x410] = 0x02;
+		ram[0xfffe] = 0x20;
+		ram[0xffff] = 0x04;
+		ram[0x420] = 0x02;
+		memcpy(ram + 0x400, c->code, sizeof(c->code));
+
+		vm_init(&vm);
+		vm.pc = 0x400;
+		vm.a = c->a;
+		vm.x = c->x;
+		vm.y = c->y;
+		vm.s = c->s;
+
+		if (vm_run(&vm, 16) != VM_SYS || vm.pc != c->pc
+				|| vm.a != c->ea || vm.x != c->ex || vm.y != c->ey || vm.s != c->es
+				|| ram[c->addr] != c->value)
+		{
+			fprintf(stderr, "** %s failed\n"
+					"  PC: %04x A: %02x X: %02x Y: %02x S: %02x (%04x): %02x\n"
+					"  expected PC: %04x A: %02x X: %02x Y: %02x S: %02x (%04x): %02x\n",
+					c->name, vm.pc, vm.a, vm.x, vm.y, vm.s, c->addr, ram[c->addr],
+					c->pc, c->ea, c->ex, c->ey, c->es, c->addr, c->value);
+			failed = 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(timings) / sizeof(timings[0]); i++)
+	{
+		t = &timings[i];
+
+		// JMP goes to the SYS at 0x410, the others run into the one at 0x403
+		memset(ram, 0, sizeof(ram));
+		ram[0x1000] = 0x10;
+		ram[0x1001] = 0x04;
+		ram[0x410] = 0x02;
+		memcpy(ram + 0x400, t->code, sizeof(t->code));
+		ram[0x403] = 0x02;
+
+		vm_init(&vm);
+		vm.pc = 0x400;
+		vm.x = t->x;
+
+		if (vm_run(&vm, 16) != VM_SYS || vm.cycles != t->cycles)
+		{
+			fprintf(stderr, "** %s failed: %u cycles, expected %u\n",
+					t->name, vm.cycles, t->cycles);
+			failed = 1;
+		}
+	}
+
+	printf(failed ? "** 65C02 Failed\n" : "** 65C02 Ok\n");
+
+	return failed;
+}
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "dasm.h"
+#include "fuzz.h"
+
+#ifdef VM_65C02
+#define CPU_NAME "65c02"
+#elif defined(FUZZ_JIT)
+#define CPU_NAME "6502 JIT"
+#else
+#define CPU_NAME "6502"
+#endif
+
+// instructions run per case
+#define COUNT 256
+
+// the random program, jumps and branches stay around it
+#define CODE 0x400
+#define CODE_LEN 0x100
+
+#define MAX_THREADS 64
+
+// instructions shown in a reproducer
+#define PATH_LEN 32
+
+struct fuzz_thread
+{
+	pthread_t id;
+	void *ref, *opt;
+	// the program and each core's copy of it
+	uint8_t mem[65536], ref_mem[65536], opt_mem[65536];
+	struct fuzz_regs regs, ref_regs, opt_regs;
+};
+
+static uint32_t cases = 50000, seed = 64;
+static uint32_t next_case, failed;
+static pthread_mutex_t report = PTHREAD_MUTEX_INITIALIZER;
+
+// xorshift, rand() is shared by the threads
+static uint32_t
+next(uint32_t *r)
+{
+	*r ^= *r << 13;
+	*r ^= *r >> 17;
+	*r ^= *r << 5;
+	return *r;
+}
+
+// random memory with a program at CODE of valid opcodes (and some invalid
+// ones) whose operands point to the zero page, the stack and the program
+static void
+generate(struct fuzz_thread *t, uint32_t n)
+{
+	uint32_t r = (seed * 2654435761u) ^ (n * 40503u + 1);
+	uint16_t addr, v;
+	const uint8_t *ent;
+	uint8_t mode;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		next(&r);
+
+	for (i = 0; i < 65536; i++)
+		t->mem[i] = next(&r);
+
+	// pointers in the zero page, some of them wrap around
+	for (i = 0; i < 0x20; i += 2)
+		t->mem[i + 1] = next(&r) & 7 ? next(&r) % 6 : 0xff;
+	t->mem[0xfffe] = (uint8_t)(CODE + (next(&r) & 0xff));
+	t->mem[0xffff] = CODE >> 8;
+	t->mem[0xfffa] = t->mem[0xfffe];
+	t->mem[0xfffb] = CODE >> 8;
+
+	for (addr = CODE; addr < CODE + CODE_LEN - 3; )
+	{
+		if (!(next(&r) % 50))
+		{
+			// likely invalid
+			t->mem[addr++] = next(&r);
+			continue;
+		}
+
+		ent = &vm_op_tbl[(next(&r) % pgm_read_byte(&vm_op_count)) * 5];
+		mode = pgm_read_byte(&ent[4]);
+		t->mem[addr] = pgm_read_byte(&ent[0]);
+
+		v = next(&r);
+		switch (next(&r) % 4)
+		{
+			case 0:
+				// zero page and stack
+				v &= 0x1ff;
+				break;
+			case 1:
+				// the program itself
+				v = CODE + (v & (CODE_LEN - 1));
+				break;
+			case 2:
+				v = v & 0x1f;
+				break;
+		}
+
+		switch (mode)
+		{
+			case AT_ABSOLUTE:
+			case AT_IND_ABS:
+			case AT_IND_ABS_X:
+			case AT_ABS_INDEX_X:
+			case AT_ABS_INDEX_Y:
+				if (t->mem[addr] == 0x4c || t->mem[addr] == 0x20)
+					v = CODE + (v & (CODE_LEN - 1));
+				t->mem[addr + 1] = (uint8_t)v;
+				t->mem[addr + 2] = v >> 8;
+				addr += 3;
+				break;
+			case AT_RELATIVE:
+				t->mem[addr + 1] = (next(&r) & 0x1f) - 0x10;
+				addr += 2;
+				break;
+			case AT_IMPLIED:
+			case AT_ACCUMULATOR:
+				addr++;
+				break;
+			default:
+				t->mem[addr + 1] = (uint8_t)v;
+				addr += 2;
+				break;
+		}
+	}
+
+	t->regs.a = next(&r);
+	t->regs.x = next(&r);
+	t->regs.y = next(&r);
+	t->regs.sp = next(&r);
+	// decimal mode half of the time
+	t->regs.s = next(&r);
+	t->regs.pc = CODE;
+}
+
+// runs both from the program, 1 if they end differently
+static int
+differs(struct fuzz_thread *t, uint32_t count)
+{
+	memcpy(t->ref_mem, t->mem, 65536);
+	memcpy(t->opt_mem, t->mem, 65536);
+	t->ref_regs = t->opt_regs = t->regs;
+
+	ref_run(t->ref, &t->ref_regs, t->ref_mem, count);
+	opt_run(t->opt, &t->opt_regs, t->opt_mem, count);
+
+	return t->ref_regs.a != t->opt_regs.a || t->ref_regs.x != t->opt_regs.x
+		|| t->ref_regs.y != t->opt_regs.y || t->ref_regs.sp != t->opt_regs.sp
+		|| t->ref_regs.s != t->opt_regs.s || t->ref_regs.pc != t->opt_regs.pc
+		|| t->ref_regs.cycles != t->opt_regs.cycles
+		|| t->ref_regs.syscalls != t->opt_regs.syscalls
+		|| t->ref_regs.halted != t->opt_regs.halted
+		|| memcmp(t->ref_mem, t->opt_mem, 65536);
+}
+
+// the fewest instructions that make them differ
+static uint32_t
+first_divergence(struct fuzz_thread *t, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 1; i < count; i++)
+		if (differs(t, i))
+			return i;
+	return count;
+}
+
+// clears (to BRK) the memory and registers that are not needed to differ
+static uint32_t
+minimise(struct fuzz_thread *t, uint32_t count)
+{
+	uint8_t saved[4096], *regs[] = { &t->regs.a, &t->regs.x, &t->regs.y, &t->regs.s }, r;
+	uint32_t size, i;
+
+	count = first_divergence(t, count);
+
+	for (size = 4096; size; size >>= 1)
+	{
+		for (i = 0; i < 65536; i += size)
+		{
+			memcpy(saved, t->mem + i, size);
+			memset(t->mem + i, 0, size);
+			if (!memcmp(saved, t->mem + i, size) || differs(t, count))
+				continue;
+			memcpy(t->mem + i, saved, size);
+		}
+		count = first_divergence(t, count);
+	}
+
+	for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+	{
+		r = *regs[i];
+		*regs[i] = 0;
+		if (!differs(t, count))
+			*regs[i] = r;
+	}
+
+	return first_divergence(t, count);
+}
+
+static void
+print_regs(const char *name, struct fuzz_regs *r)
+{
+	fprintf(stderr, "%s PC %04x A %02x X %02x Y %02x SP %02x S %02x cycles %u syscalls %u%s\n",
+			name, r->pc, r->a, r->x, r->y, r->sp, r->s, r->cycles, r->syscalls,
+			r->halted ? " halted" : "");
+}
+
+// the program that is left, the path the reference runs and how they end
+static void
+reproducer(struct fuzz_thread *t, uint32_t n, uint32_t count)
+{
+	struct fuzz_regs start = t->regs;
+	char text[32];
+	uint8_t op[3];
+	uint32_t i, j;
+
+	fprintf(stderr, "** %s: case %u (seed %u) differs after %u instructions\n",
+			CPU_NAME, n, seed, count);
+	print_regs("start:", &start);
+
+	fprintf(stderr, "memory (the rest is 0):\n");
+	for (i = 0; i < 65536; i += 8)
+	{
+		for (j = 0; j < 8 && !t->mem[i + j]; j++);
+		if (j == 8)
+			continue;
+		fprintf(stderr, "  %04x:", i);
+		for (j = 0; j < 8; j++)
+			fprintf(stderr, " %02x", t->mem[i + j]);
+		fprintf(stderr, "\n");
+	}
+
+	// up to the last PATH_LEN instructions
+	i = count > PATH_LEN ? count - PATH_LEN : 0;
+	fprintf(stderr, "path (from instruction %u):\n", i + 1);
+	for (; i < count; i++)
+	{
+		// the code as it is when it runs
+		differs(t, i);
+		for (j = 0; j < 3; j++)
+			op[j] = t->ref_mem[(uint16_t)(t->ref_regs.pc + j)];
+		dasm_das(t->ref_regs.pc, op, text);
+		fprintf(stderr, "  %04x: %s\n", t->ref_regs.pc, text);
+	}
+
+	differs(t, count);
+	print_regs("ref:  ", &t->ref_regs);
+	print_regs("opt:  ", &t->opt_regs);
+	for (i = 0; i < 65536; i++)
+		if (t->ref_mem[i] != t->opt_mem[i])
+		{
+			fprintf(stderr, "memory at %04x: ref %02x, opt %02x\n", i, t->ref_mem[i],
+					t->opt_mem[i]);
+			break;
+		}
+}
+
+static void *
+worker(void *arg)
+{
+	struct fuzz_thread *t = arg;
+	uint32_t n, count;
+
+	while (!__atomic_load_n(&failed, __ATOMIC_RELAXED))
+	{
+		n = __atomic_fetch_add(&next_case, 1, __ATOMIC_RELAXED);
+		if (n >= cases)
+			break;
+
+		generate(t, n);
+		if (!differs(t, COUNT))
+			continue;
+
+		// one report is enough
+		if (__atomic_exchange_n(&failed, 1, __ATOMIC_RELAXED))
+			break;
+
+		count = minimise(t, COUNT);
+		pthread_mutex_lock(&report);
+		reproducer(t, n, count);
+		pthread_mutex_unlock(&report);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct fuzz_thread threads[MAX_THREADS];
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (argc > 3)
+	{
+		fprintf(stderr, "usage: %s [cases [seed]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 1)
+		cases = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		seed = strtoul(argv[2], NULL, 0);
+
+	if (count < 1)
+		count = 1;
+	if (count > MAX_THREADS)
+		count = MAX_THREADS;
+
+	for (i = 0; i < count; i++)
+	{
+		threads[i].ref = ref_new();
+		threads[i].opt = opt_new();
+		if (!threads[i].ref || !threads[i].opt
+				|| pthread_create(&threads[i].id, NULL, worker, &threads[i]))
+		{
+			fprintf(stderr, "failed to start thread %d\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		pthread_join(threads[i].id, NULL);
+		ref_free(threads[i].ref);
+		opt_free(threads[i].opt);
+	}
+
+	if (failed)
+		return 1;
+
+	printf("** Fuzz Ok (%s, %u cases, %ld threads)\n", CPU_NAME, cases, count);
+
+	return 0;
+}
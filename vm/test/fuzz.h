@@ -0,0 +1,29 @@
+#ifndef _FUZZ_H
+#define _FUZZ_H
+
+#include <stdint.h>
+
+// the state compared after running the same program in both cores
+struct fuzz_regs
+{
+	uint8_t a, x, y, sp, s;
+	uint16_t pc;
+	uint32_t cycles;
+	uint32_t syscalls;
+	uint8_t halted;
+};
+
+// fuzz_core.c built for each core with its own VM dispatch: ref runs one
+// instruction at a time with vm_exec(), opt as many as it can with vm_run()
+
+void *ref_new();
+void ref_free(void *core);
+// runs up to count instructions (it stops on an invalid opcode) from regs in
+// 64KB of memory, leaving the result in both
+void ref_run(void *core, struct fuzz_regs *regs, uint8_t *mem, uint32_t count);
+
+void *opt_new();
+void opt_free(void *core);
+void opt_run(void *core, struct fuzz_regs *regs, uint8_t *mem, uint32_t count);
+
+#endif // _FUZZ_H
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "ram.h"
+#ifdef FUZZ_JIT
+#include "jit.h"
+#endif
+#include "fuzz.h"
+
+// FUZZ_CORE is the prefix of the functions (ref or opt), FUZZ_STEP runs one
+// instruction at a time and FUZZ_JIT runs the JIT (with its own memory)
+#define _core(p, n)		p##_##n
+#define core(p, n)		_core(p, n)
+
+// a result in A and a byte written where X and Y point, that may be code
+static void
+syscall_fuzz(struct vm_state *vm, uint8_t func)
+{
+	struct fuzz_regs *regs = vm->sys_data;
+	uint16_t addr = addr16(vm->x, vm->y);
+	uint8_t b = func ^ vm->x;
+
+	regs->syscalls++;
+	vm->a = func * 7 + vm->y;
+	vm->ram_write(vm, addr, &b, 1);
+#ifdef FUZZ_JIT
+	jit_invalidate(vm->data, addr, 1);
+#else
+	vm_invalidate(vm, addr, 1);
+#endif
+}
+
+#ifdef FUZZ_JIT
+void *
+core(FUZZ_CORE, new)()
+{
+	struct jit_state *jit = malloc(sizeof(struct jit_state));
+
+	if (jit && !jit_init(jit))
+	{
+		free(jit);
+		return NULL;
+	}
+	if (jit)
+		jit->vm.syscall = syscall_fuzz;
+	return jit;
+}
+
+void
+core(FUZZ_CORE, free)(void *core)
+{
+	jit_free(core);
+	free(core);
+}
+
+void
+core(FUZZ_CORE, run)(void *core, struct fuzz_regs *regs, uint8_t *mem, uint32_t count)
+{
+	struct jit_state *jit = core;
+	struct vm_state *vm = &jit->vm;
+
+	// nothing compiled from the last program
+	memcpy(jit->ram, mem, 65536);
+	jit_invalidate(jit, 0, 0);
+	vm->sys_data = regs;
+	vm_init(vm);
+	vm->a = regs->a;
+	vm->x = regs->x;
+	vm->y = regs->y;
+	vm->sp = regs->sp;
+	vm->s = regs->s;
+	vm->pc = regs->pc;
+	regs->syscalls = 0;
+	regs->halted = 0;
+
+	while (count)
+	{
+		if (jit_run(jit, count > 0xffff ? 0xffff : count) == VM_HALT)
+		{
+			regs->halted = 1;
+			break;
+		}
+		count -= vm->ran;
+	}
+
+	memcpy(mem, jit->ram, 65536);
+	regs->a = vm->a;
+	regs->x = vm->x;
+	regs->y = vm->y;
+	regs->sp = vm->sp;
+	regs->s = vm->s;
+	regs->pc = vm->pc;
+	regs->cycles = vm->cycles;
+}
+#else
+
+void *
+core(FUZZ_CORE, new)()
+{
+	struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+
+	if (vm)
+		ram_attach(vm, NULL, syscall_fuzz);
+	return vm;
+}
+
+void
+core(FUZZ_CORE, free)(void *core)
+{
+	free(core);
+}
+
+void
+core(FUZZ_CORE, run)(void *core, struct fuzz_regs *regs, uint8_t *mem, uint32_t count)
+{
+	struct vm_state *vm = core;
+
+	vm->data = mem;
+	vm->sys_data = regs;
+	vm_init(vm);
+	vm->a = regs->a;
+	vm->x = regs->x;
+	vm->y = regs->y;
+	vm->sp = regs->sp;
+	vm->s = regs->s;
+	vm->pc = regs->pc;
+	regs->syscalls = 0;
+	regs->halted = 0;
+
+#ifdef FUZZ_STEP
+	while (count--)
+		if (!vm_exec(vm))
+		{
+			regs->halted = 1;
+			break;
+		}
+#else
+	while (count)
+	{
+		if (vm_run(vm, count > 0xffff ? 0xffff : count) == VM_HALT)
+		{
+			regs->halted = 1;
+			break;
+		}
+		count -= vm->ran;
+	}
+#endif
+
+	regs->a = vm->a;
+	regs->x = vm->x;
+	regs->y = vm->y;
+	regs->sp = vm->sp;
+	regs->s = vm->s;
+	regs->pc = vm->pc;
+	regs->cycles = vm->cycles;
+}
+#endif // FUZZ_JIT
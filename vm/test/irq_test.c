@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "ram.h"
+
+uint8_t ram[65536];
+
+struct vm_state vm;
+
+// SEI, INX until X is 0x10, CLI and then INX forever; the IRQ handler does
+// INY and the NMI handler INY twice
+static const uint8_t code[] = {
+	0x78, 0xe8, 0xe0, 0x10, 0xd0, 0xfb, 0x58, 0xe8, 0x4c, 0x07, 0x04
+};
+
+static int
+check(const char *name, int ok)
+{
+	if (!ok)
+		fprintf(stderr, "** %s failed\n"
+				"  PC: %04x A: %02x X: %02x Y: %02x SP: %02x S: %02x irq: %d nmi: %d event: %d\n",
+				name, vm.pc, vm.a, vm.x, vm.y, vm.sp, vm.s, vm.irq, vm.nmi, vm.event);
+	return !ok;
+}
+
+int
+main()
+{
+	uint16_t pc;
+	uint8_t failed = 0;
+
+	memcpy(ram + 0x400, code, sizeof(code));
+	ram[0x500] = 0xc8;
+	ram[0x501] = 0x40;
+	ram[0x510] = 0xc8;
+	ram[0x511] = 0xc8;
+	ram[0x512] = 0x40;
+	ram[0xfffe] = 0x00;
+	ram[0xffff] = 0x05;
+	ram[0xfffa] = 0x10;
+	ram[0xfffb] = 0x05;
+
+	ram_attach(&vm, ram, syscall_stub);
+
+	vm_init(&vm);
+	vm.pc = 0x400;
+
+	// SEI, then the IRQ waits; vm_run() returns as for any other event
+	vm_run(&vm, 1);
+	vm_irq(&vm);
+	failed |= check("masked IRQ", vm_run(&vm, 8) == VM_EVENT && !vm.y && vm.irq && !vm.event);
+
+	// an event set by the host while the IRQ waits isn't lost
+	vm_run(&vm, 1);
+	pc = vm.pc;
+	vm.event = 1;
+	failed |= check("masked IRQ and event", vm_run(&vm, 8) == VM_EVENT && vm.pc == pc
+			&& !vm.y && vm.irq && !vm.event);
+
+	// taken after CLI, with B clear in the pushed status
+	vm_run(&vm, 64);
+	failed |= check("IRQ after CLI", vm.y == 1 && !vm.irq && vm.x > 0x10
+			&& vm.sp == 0xff && !(vm.s & sbit(If)) && !(ram[0x1fd] & sbit(Bf))
+			&& ram[0x1fe] == 0x07 && ram[0x1ff] == 0x04);
+
+	// taking it uses one instruction of the budget
+	vm_irq(&vm);
+	vm_run(&vm, 1);
+	failed |= check("IRQ", vm.pc == 0x500 && (vm.s & sbit(If)) && vm.sp == 0xfc);
+
+	// NMI before the IRQ handler runs
+	vm_nmi(&vm);
+	vm_run(&vm, 4);
+	failed |= check("NMI", vm.y == 3 && vm.pc == 0x500 && vm.sp == 0xfc && !vm.nmi);
+	vm_run(&vm, 2);
+	failed |= check("RTI", vm.y == 4 && vm.sp == 0xff && !(vm.s & sbit(If)));
+
+	// no interrupt pending, vm_run() returns
+	vm.event = 1;
+	failed |= check("event", vm_run(&vm, 8) == VM_EVENT && !vm.event);
+
+	printf(failed ? "** Interrupts Failed\n" : "** Interrupts Ok\n");
+
+	return failed;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "ram.h"
+#include "jit.h"
+
+#define BATCH 1000
+
+uint8_t ram[65536];
+
+static struct vm_state vm;
+static struct jit_state jit;
+
+// runs the test until the success trap, or any other trap; the instructions
+// are counted from vm->ran, as bench.c does
+double
+run(uint8_t (*step)(uint16_t), struct vm_state *vm, uint32_t *ops)
+{
+	const uint16_t result = 0x3399;
+	clock_t start = clock();
+	uint16_t old;
+
+	*ops = 0;
+	while (vm->pc != result)
+	{
+		if (step(BATCH) != VM_BUDGET)
+			break;
+		*ops += vm->ran;
+
+		// the test traps with a branch or jump to itself on failure
+		old = vm->pc;
+		if (step(1) != VM_BUDGET)
+			break;
+		*ops += vm->ran;
+		if (vm->pc == old)
+			break;
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+uint8_t
+vm_step(uint16_t budget)
+{
+	return vm_run(&vm, budget);
+}
+
+uint8_t
+jit_step(uint16_t budget)
+{
+	return jit_run(&jit, budget);
+}
+
+int
+main()
+{
+	const char *image = "images/6502_functional_test.bin";
+	uint32_t vm_ops, jit_ops;
+	double vm_secs, jit_secs;
+
+	if (!ram_load(image, ram, 0x10000))
+		return 1;
+
+	ram_attach(&vm, ram, syscall_stub);
+	vm_init(&vm);
+	vm.pc = 0x400;
+
+	if (!jit_init(&jit))
+	{
+		fprintf(stderr, "failed to init the JIT\n");
+		return 1;
+	}
+	if (!jit.arena)
+		printf("no executable memory, the JIT only interprets\n");
+	memcpy(jit.ram, ram, 0x10000);
+	jit.vm.syscall = syscall_stub;
+	jit.vm.pc = 0x400;
+
+	vm_secs = run(vm_step, &vm, &vm_ops);
+	jit_secs = run(jit_step, &jit.vm, &jit_ops);
+
+	// the JIT must end exactly as the interpreter
+	if (vm.pc != 0x3399 || jit.vm.pc != vm.pc || jit_ops != vm_ops
+			|| jit.vm.a != vm.a || jit.vm.x != vm.x || jit.vm.y != vm.y
+			|| jit.vm.sp != vm.sp || jit.vm.s != vm.s || jit.vm.cycles != vm.cycles
+			|| memcmp(jit.ram, ram, 0x10000))
+	{
+		fprintf(stderr, "** JIT failed\n"
+				"interp: PC %04x A %02x X %02x Y %02x SP %02x S %02x, %u ops %u cycles\n"
+				"jit:    PC %04x A %02x X %02x Y %02x SP %02x S %02x, %u ops %u cycles\n",
+				vm.pc, vm.a, vm.x, vm.y, vm.sp, vm.s, vm_ops, vm.cycles,
+				jit.vm.pc, jit.vm.a, jit.vm.x, jit.vm.y, jit.vm.sp, jit.vm.s, jit_ops, jit.vm.cycles);
+		jit_free(&jit);
+		return 1;
+	}
+
+	printf("interp: %u instructions, %u cycles, %.3f s, %.2f MIPS\n",
+			vm_ops, vm.cycles, vm_secs, vm_secs > 0 ? vm_ops / vm_secs / 1e6 : 0);
+	printf("jit: %u instructions, %u cycles, %.3f s, %.2f MIPS\n",
+			jit_ops, jit.vm.cycles, jit_secs, jit_secs > 0 ? jit_ops / jit_secs / 1e6 : 0);
+	printf("** JIT Ok\n");
+
+	jit_free(&jit);
+
+	return 0;
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "ram.h"
+#include "dasm.h"
+
+#ifdef VM_65C02
+#define CPU_NAME "65c02"
+#else
+#define CPU_NAME "6502"
+#endif
+
+// instructions run per opcode and pass
+#define RUNS 500000
+
+// timed passes per opcode, the fastest one is kept (the others had the
+// scheduler or the caches in the way)
+#define PASSES 5
+
+// copies of the instruction in the loop before the JMP back
+#define UNROLL 32
+
+// the loop, operands at 0x10 (zp), 0x1234 (abs), 0x3000 (indirect) and the
+// JMP pointers from 0x2100
+#define CODE 0x4040
+#define POINTERS 0x2100
+
+uint8_t ram[65536];
+
+// memory callbacks, each one is a SPI transaction on the device
+static uint32_t reads, writes;
+
+struct op_cost
+{
+	uint8_t op, dec;
+	char text[16];
+	double ns, cycles, reads, writes;
+};
+
+static struct op_cost costs[256 + 2], base;
+
+static void
+count_read(struct vm_state *vm, uint16_t addr, uint8_t *dst, uint8_t size)
+{
+	reads++;
+	ram_read(vm, addr, dst, size);
+}
+
+static void
+count_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	writes++;
+	ram_write(vm, addr, src, size);
+}
+
+// the instruction at addr with an operand for its addressing mode, k is the
+// copy (for the JMP pointers)
+static void
+operand(char *text, const uint8_t *ent, uint16_t addr, int k)
+{
+	const char *fmt = NULL;
+	uint16_t v = 0;
+
+	switch (ent[4])
+	{
+		case AT_IMPLIED:
+			fmt = "";
+			break;
+		case AT_ACCUMULATOR:
+			fmt = " A";
+			break;
+		case AT_IMMEDIATE:
+			fmt = " #$01";
+			break;
+		case AT_ZEROP:
+			fmt = " $10";
+			break;
+		case AT_ABSOLUTE:
+			// JMP and JSR go on to the next copy
+			fmt = " $%04x";
+			v = ent[1] == 'J' ? addr + 3 : 0x1234;
+			break;
+		case AT_IND_ABS:
+			fmt = " ($%04x)";
+			v = POINTERS + k * 2;
+			break;
+		case AT_IND_ABS_X:
+			fmt = " ($%04x,X)";
+			v = POINTERS + k * 2 - 0x10;
+			break;
+		case AT_ABS_INDEX_X:
+			fmt = " $1234,X";
+			break;
+		case AT_ABS_INDEX_Y:
+			fmt = " $1234,Y";
+			break;
+		case AT_ZP_INDEX_X:
+			fmt = " $10,X";
+			break;
+		case AT_ZP_INDEX_Y:
+			fmt = " $10,Y";
+			break;
+		case AT_INDEX_IND:
+			fmt = " ($10,X)";
+			break;
+		case AT_IND_INDEX:
+			fmt = " ($10),Y";
+			break;
+		case AT_ZP_IND:
+			fmt = " ($10)";
+			break;
+		case AT_RELATIVE:
+			// taken or not, the same place
+			fmt = " $%04x";
+			v = addr + 2;
+			break;
+	}
+
+	sprintf(text, "%.3s", ent + 1);
+	sprintf(text + 3, fmt, v);
+}
+
+static const uint8_t *
+find_op(uint8_t op)
+{
+	const uint8_t *ent = vm_op_tbl;
+
+	while (ent[0] != op)
+		ent += 5;
+	return ent;
+}
+
+// assembles the loop for an opcode, -1 on error or 1 if the instruction
+// loops by itself (no JMP back)
+static int
+setup(struct vm_state *vm, const uint8_t *ent, uint8_t dec, char *text)
+{
+	uint16_t addr, start = CODE;
+	uint8_t out[3], self = 0;
+	char line[32];
+	int k, len;
+
+	memset(ram, 0, sizeof(ram));
+	ram[0x11] = ram[0x21] = 0x30;
+	// RTS returns to 0x4041 and RTI to 0x4040, pulling the status as 0x40
+	memset(ram + 0x100, 0x40, 0x100);
+
+	switch (ent[0])
+	{
+		case 0x00:
+		case 0x40:
+		case 0x60:
+			// BRK, RTI and RTS loop by themselves
+			self = 1;
+			start = ent[0] == 0x60 ? CODE + 1 : CODE;
+			ram[0xfffe] = (uint8_t)start;
+			ram[0xffff] = start >> 8;
+			break;
+	}
+
+	addr = start;
+	for (k = 0; k < (self ? 1 : UNROLL); k++)
+	{
+		operand(line, ent, addr, k);
+		if (!k)
+			strcpy(text, line);
+
+		len = dasm_as(addr, line, out);
+		if (len <= 0 || out[0] != ent[0])
+		{
+			fprintf(stderr, "** %02x: \"%s\" assembles to %02x\n", ent[0], text,
+					len > 0 ? out[0] : 0);
+			return -1;
+		}
+		memcpy(ram + addr, out, len);
+		addr += len;
+
+		// JMP pointers to the next copy
+		ram[POINTERS + k * 2] = (uint8_t)addr;
+		ram[POINTERS + k * 2 + 1] = addr >> 8;
+	}
+	if (!self)
+	{
+		ram[addr] = 0x4c;
+		ram[addr + 1] = (uint8_t)start;
+		ram[addr + 2] = start >> 8;
+	}
+
+	vm_init(vm);
+	vm->pc = start;
+	vm->a = 0x01;
+	vm->x = vm->y = 0x10;
+	vm->s = dec ? sbit(Df) : 0;
+
+	return self;
+}
+
+// runs the loop, the costs per instruction without the JMP back
+static int
+measure(struct vm_state *vm, struct op_cost *c, uint8_t self)
+{
+	struct timespec start, end;
+	struct op_cost pass;
+	uint64_t insns;
+	double secs, jumps, ops;
+	uint32_t cycles;
+	int i;
+
+	for (i = 0; i < PASSES; i++)
+	{
+		insns = 0;
+		cycles = vm->cycles;
+		reads = writes = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (insns < RUNS)
+		{
+			if (vm_run(vm, 0xffff) == VM_HALT)
+			{
+				fprintf(stderr, "** %s: halted at %04x\n", c->text,
+						vm->pc);
+				return 0;
+			}
+			insns += vm->ran;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		secs = (end.tv_sec - start.tv_sec)
+			+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		jumps = self ? 0 : (double)insns / (UNROLL + 1);
+		ops = insns - jumps;
+
+		pass.ns = (secs * 1e9 - jumps * base.ns) / ops;
+		pass.cycles = ((vm->cycles - cycles) - jumps * base.cycles) / ops;
+		pass.reads = (reads - jumps * base.reads) / ops;
+		pass.writes = (writes - jumps * base.writes) / ops;
+
+		if (!i || pass.ns < c->ns)
+		{
+			c->ns = pass.ns;
+			c->cycles = pass.cycles;
+			c->reads = pass.reads;
+			c->writes = pass.writes;
+		}
+	}
+
+	return 1;
+}
+
+static int
+by_cost(const void *a, const void *b)
+{
+	const struct op_cost *ca = a, *cb = b;
+
+	return ca->ns < cb->ns ? 1 : ca->ns > cb->ns ? -1 : 0;
+}
+
+int
+main()
+{
+	static struct vm_state vm;
+	const uint8_t *ent;
+	struct op_cost *c;
+	int i, self, count = 0;
+
+	ram_attach(&vm, ram, syscall_stub);
+	vm.ram_read = count_read;
+	vm.ram_write = count_write;
+
+	// JMP to itself (a copy of JMP abs), to take the loop out of the others
+	self = setup(&vm, find_op(0x4c), 0, base.text);
+	ram[CODE + 1] = (uint8_t)CODE;
+	ram[CODE + 2] = CODE >> 8;
+	if (self < 0 || !measure(&vm, &base, 1))
+		return 1;
+
+	// every opcode, and ADC and SBC in decimal mode
+	for (i = 0; i < pgm_read_byte(&vm_op_count) + 2; i++)
+	{
+		c = &costs[count];
+		if (i < pgm_read_byte(&vm_op_count))
+			ent = &vm_op_tbl[i * 5];
+		else
+		{
+			ent = find_op(i == pgm_read_byte(&vm_op_count) ? 0x69 : 0xe9);
+			c->dec = 1;
+		}
+		c->op = ent[0];
+
+		self = setup(&vm, ent, c->dec, c->text);
+		if (self < 0 || !measure(&vm, c, self))
+			return 1;
+		if (c->dec)
+			strcat(c->text, " (D)");
+		count++;
+	}
+
+	qsort(costs, count, sizeof(struct op_cost), by_cost);
+
+	printf("%s: %d loops, best of %d passes of %d instructions, "
+			"loop JMP %.2f ns\n"
+			"op  instruction           ns/op  cycles   reads  writes\n",
+			CPU_NAME, count, PASSES, RUNS, base.ns);
+	for (i = 0; i < count; i++)
+		printf("%02x  %-18s %8.2f %7.2f %7.2f %7.2f\n", costs[i].op, costs[i].text,
+				costs[i].ns, costs[i].cycles, costs[i].reads, costs[i].writes);
+
+	return 0;
+}
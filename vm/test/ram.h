@@ -0,0 +1,71 @@
+#ifndef _RAM_H
+#define _RAM_H
+
+// shared by the VM tests: a flat 64 KB memory behind the VM callbacks and
+// the image loader
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// the memory callbacks, vm->data is the 64 KB array
+static inline void
+ram_read(struct vm_state *vm, uint16_t addr, uint8_t *dst, uint8_t size)
+{
+	uint8_t *mem = vm->data;
+
+	while(size--)
+		*dst++ = mem[addr++];
+}
+
+static inline void
+ram_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	uint8_t *mem = vm->data;
+
+	while(size--)
+		mem[addr++] = *src++;
+}
+
+static inline void
+syscall_stub(struct vm_state *vm, uint8_t func)
+{
+	// do nothing
+}
+
+// the VM uses mem through the callbacks above, and syscall for its syscalls
+static inline void
+ram_attach(struct vm_state *vm, uint8_t *mem,
+		void (*syscall)(struct vm_state *vm, uint8_t func))
+{
+	vm->ram_read = ram_read;
+	vm->ram_write = ram_write;
+	vm->syscall = syscall;
+	vm->data = mem;
+}
+
+// reads up to size bytes of image into mem, the bytes read or 0 on error
+// (after reporting it)
+static inline size_t
+ram_load(const char *image, uint8_t *mem, size_t size)
+{
+	FILE *fd;
+	size_t n;
+
+	fd = fopen(image, "rb");
+	if (!fd)
+	{
+		fprintf(stderr, "failed to open %s\n", image);
+		return 0;
+	}
+
+	n = fread(mem, 1, size, fd);
+	fclose(fd);
+	if (!n)
+		fprintf(stderr, "failed to read from %s\n", image);
+
+	return n;
+}
+
+#endif // _RAM_H
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "ram.h"
+#include "rt.h"
+
+#define RUNS 2000
+
+// a JSR to the routine followed by a syscall
+#define HARNESS 0x400
+
+uint8_t base[65536], ram[2][65536];
+
+static struct vm_state vm[2];
+static struct rt_state rt;
+
+static uint8_t
+run(struct vm_state *vm)
+{
+	uint8_t rc;
+
+	while ((rc = vm_run(vm, 0xffff)) == VM_BUDGET);
+	return rc;
+}
+
+static void
+put16(uint8_t *mem, uint16_t addr, uint16_t v)
+{
+	mem[addr] = v;
+	mem[addr + 1] = v >> 8;
+}
+
+static int
+differs(const char *when)
+{
+	if (vm[0].pc == vm[1].pc && vm[0].a == vm[1].a && vm[0].x == vm[1].x
+			&& vm[0].y == vm[1].y && vm[0].sp == vm[1].sp && vm[0].s == vm[1].s
+			&& !memcmp(ram[0], ram[1], 0x10000))
+		return 0;
+
+	fprintf(stderr, "** %s\n"
+			"6502:   PC %04x A %02x X %02x Y %02x SP %02x S %02x\n"
+			"native: PC %04x A %02x X %02x Y %02x SP %02x S %02x\n", when,
+			vm[0].pc, vm[0].a, vm[0].x, vm[0].y, vm[0].sp, vm[0].s,
+			vm[1].pc, vm[1].a, vm[1].x, vm[1].y, vm[1].sp, vm[1].s);
+	return 1;
+}
+
+// each routine with random arguments, called from a harness
+static int
+check_routines(const char *image, int count)
+{
+	uint16_t pc, sp, dst;
+	uint32_t runs = 0, calls;
+	int i, j;
+
+	srand(64);
+	for (i = 0; i < 0x10000; i++)
+		base[i] = rand();
+
+	if (!ram_load(image, base + PROG_START, 0x10000 - PROG_START))
+		return 1;
+
+	base[HARNESS] = 0x20;
+	base[HARNESS + 3] = 0x02;
+
+	for (pc = PROG_START; pc; pc++)
+	{
+		if (!rt.fn[pc])
+			continue;
+
+		for (j = 0; j < RUNS; j++)
+		{
+			// fresh zero page and stack, the rest is the same random memory
+			memcpy(ram[0], base, 0x10000);
+			for (i = 0; i < 0x200; i++)
+				ram[0][i] = rand();
+
+			put16(ram[0], HARNESS + 1, pc);
+
+			// C stack (sp is the first symbol) with two arguments as memcpy
+			// and memset expect, sometimes overlapping the destination
+			sp = 0x8000 + (rand() & 0x3fff);
+			dst = j & 3 ? 0x3000 + (rand() & 0x3fff) : sp + 4 - (rand() & 0x7ff);
+			put16(ram[0], rt.sym[0], sp);
+			put16(ram[0], sp, 0x3000 + (rand() & 0x3fff));
+			put16(ram[0], sp + 2, dst);
+
+			vm_init(&vm[0]);
+			vm[0].a = rand();
+			// memcpy and memset sizes that don't overwrite the routines
+			vm[0].x = rand() & (j & 1 ? 0x3f : 7);
+			vm[0].y = rand();
+			vm[0].sp = 0x40 + (rand() & 0xbf);
+			vm[0].s = rand() & ~sbit(Df);
+			vm[0].pc = HARNESS;
+
+			memcpy(ram[1], ram[0], 0x10000);
+			vm_init(&vm[1]);
+			vm[1].a = vm[0].a;
+			vm[1].x = vm[0].x;
+			vm[1].y = vm[0].y;
+			vm[1].sp = vm[0].sp;
+			vm[1].s = vm[0].s;
+			vm[1].pc = HARNESS;
+
+			calls = rt.calls;
+			if (run(&vm[0]) != VM_SYS || run(&vm[1]) != VM_SYS
+					|| differs("routine failed"))
+			{
+				fprintf(stderr, "at %04x, run %d\n", pc, j);
+				return 1;
+			}
+			runs += rt.calls - calls;
+		}
+	}
+
+	if (!runs)
+	{
+		fprintf(stderr, "** no routine was run natively\n");
+		return 1;
+	}
+
+	printf("%d routines, %u of %u runs native\n", count, runs, count * RUNS);
+
+	return 0;
+}
+
+// a program built with ld65 -Ln, both ways in lockstep from syscall to
+// syscall (they do nothing) until it exits or halts
+static int
+check_program(const char *image)
+{
+	uint32_t syscalls;
+	uint8_t rc[2];
+	int i;
+
+	if (!ram_load(image, ram[0] + PROG_START, 0x10000 - PROG_START))
+		return 1;
+	memcpy(ram[1], ram[0], 0x10000);
+
+	for (i = 0; i < 2; i++)
+	{
+		vm_init(&vm[i]);
+		vm[i].pc = PROG_START;
+	}
+
+	for (syscalls = 0; syscalls < 1000000; syscalls++)
+	{
+		rc[0] = run(&vm[0]);
+		rc[1] = run(&vm[1]);
+		if (rc[0] != rc[1] || differs("program failed"))
+		{
+			fprintf(stderr, "after %u syscalls\n", syscalls);
+			return 1;
+		}
+		// exit
+		if (rc[0] == VM_HALT || !vm[0].a)
+			break;
+	}
+
+	printf("%u syscalls, %u native calls\n", syscalls, rt.calls);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *labels = argc == 3 ? argv[2] : "images/rt.lbl";
+	int count, i;
+
+	if (argc != 1 && argc != 3)
+	{
+		fprintf(stderr, "usage: %s [program.bin program.lbl]\n", argv[0]);
+		return 1;
+	}
+
+	rt_init(&rt);
+	count = rt_load(&rt, labels);
+	if (count <= 0)
+	{
+		fprintf(stderr, "failed to load routines from %s\n", labels);
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		ram_attach(&vm[i], ram[i], syscall_stub);
+	}
+	rt_attach(&rt, &vm[1]);
+
+	if (argc == 3)
+		return check_program(argv[1]);
+
+	return check_routines("images/rt.bin", count);
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "ram.h"
+#include "journal.h"
+#include "prof.h"
+
+#ifdef VM_65C02
+#define CPU_NAME "65c02"
+#else
+#define CPU_NAME "6502"
+#endif
+
+// the programs are compared up to the same point
+#define MAX_SYSCALLS 100000
+
+uint8_t ram[65536];
+
+static uint8_t done, func;
+static uint16_t seed = 1;
+
+// input from stdin, no output and a fixed random sequence; at the end of
+// the input get char returns 0 (no key, as on the device) and read stops
+static uint8_t
+input()
+{
+	int c = getchar();
+
+	return c == EOF ? 0 : c;
+}
+
+void
+syscall_run(struct vm_state *vm, uint8_t f)
+{
+	uint8_t v[6];
+	uint16_t addr, count;
+	int c;
+
+	func = f;
+	switch (f)
+	{
+		case 0x20:
+			vm->a = input();
+			break;
+		case 0x22:
+			// read, only stdin
+			vm->ram_read(vm, addr16((uint8_t)(vm->sp + 1), 1), v, 6);
+			addr = addr16(v[3], v[2]);
+			count = addr16(v[5], v[4]);
+			vm->a = 0;
+			if (v[0] | v[1])
+				break;
+			for (; count && (c = getchar()) != EOF; count--, vm->a++)
+			{
+				*v = c;
+				vm->ram_write(vm, addr++, v, 1);
+			}
+			break;
+		case 0xa0:
+			seed = seed * 25173 + 13849;
+			vm->a = seed >> 8;
+			break;
+		case 0xf0:
+			vm->a = 1;
+#ifdef VM_65C02
+			vm->x = 1;
+#else
+			vm->x = 0;
+#endif
+			break;
+		default:
+			vm->a = 0;
+			break;
+	}
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b] [-r journal | -p journal] [-P labels] program.bin\n"
+			"  -b prints the results as key=value pairs for benchmarks\n"
+			"  -r records the syscalls to journal, -p replays them\n"
+			"  -P prints a profile using the labels file (ld65 -Ln)\n"
+			"the input comes from stdin; at its end get char returns 0 (no key)\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct vm_state vm;
+	static struct journal journal;
+	static struct prof_state prof;
+	const char *name = argv[argc - 1], *journal_name = NULL, *labels = NULL;
+	uint32_t syscalls = 0;
+	uint64_t insns = 0;
+	struct timespec start, end;
+	double secs;
+	char mode = 0, bench = 0;
+	size_t size;
+	uint8_t rc;
+	int i;
+
+	for (i = 1; i < argc - 1; i += 2)
+	{
+		if (!strcmp(argv[i], "-b"))
+		{
+			bench = 1;
+			i--;
+			continue;
+		}
+
+		if (argv[i][0] != '-' || i + 1 == argc - 1)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+
+		switch (argv[i][1])
+		{
+			case 'r':
+			case 'p':
+				mode = argv[i][1];
+				journal_name = argv[i + 1];
+				break;
+			case 'P':
+				labels = argv[i + 1];
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (argc < 2 || i != argc - 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	size = ram_load(name, ram + PROG_START, 0x10000 - PROG_START);
+	if (!size)
+		return 1;
+
+	ram_attach(&vm, ram, syscall_run);
+	vm_init(&vm);
+
+	if (mode && (mode == 'r' ? journal_record(&journal, &vm, journal_name)
+				: journal_replay(&journal, &vm, journal_name)))
+	{
+		fprintf(stderr, "failed to open journal %s\n", journal_name);
+		return 1;
+	}
+
+	prof_init(&prof);
+	if (labels && prof_load(&prof, labels) < 0)
+	{
+		fprintf(stderr, "failed to load labels from %s\n", labels);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!done && syscalls < MAX_SYSCALLS)
+	{
+		rc = labels ? prof_run(&prof, &vm, 0xffff) : vm_run(&vm, 0xffff);
+		insns += vm.ran;
+		if (rc == VM_HALT)
+		{
+			fprintf(stderr, "%s: invalid opcode %02x at %04x\n", name, ram[vm.pc], vm.pc);
+			return 1;
+		}
+		if (rc == VM_SYS)
+		{
+			if (journal.error)
+			{
+				fprintf(stderr, "%s: replay diverged from %s at syscall %u\n", name,
+						journal_name, journal.count);
+				return 1;
+			}
+			syscalls++;
+			// the function, A has its result now
+			done = (mode == 'p' ? journal.func : func) == 0x00;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (mode)
+		journal_close(&journal, &vm);
+
+	if (bench)
+		printf("program=%s cpu=%s bytes=%zu instructions=%lu cycles=%u syscalls=%u "
+				"seconds=%.6f mips=%.2f finished=%d\n", name, CPU_NAME, size,
+				(unsigned long)insns, vm.cycles, syscalls, secs,
+				secs > 0 ? insns / secs / 1e6 : 0, done);
+	else
+		printf("%s (%s): %zu bytes, %u cycles, %u syscalls%s\n", name, CPU_NAME,
+				size, vm.cycles, syscalls, done ? "" : " (not finished)");
+
+	if (labels)
+		prof_report(&prof, &vm, stdout);
+
+	return 0;
+}
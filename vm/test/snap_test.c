@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "snap.h"
+#include "ram.h"
+
+#define FORKS 4
+
+// the functional test ends at its success trap
+#define SUCCESS 0x3399
+
+// snapshot taken after this many instructions
+#define SNAP_AT 1000000
+
+uint8_t image[65536];
+
+static struct vm_state vm, forks[FORKS];
+static struct snap_mem mem, mems[FORKS];
+static struct snap snap;
+
+// until it gets stuck in a trap (an instruction jumping to itself), 0 if
+// it is the success one
+static int
+run(struct vm_state *vm)
+{
+	uint16_t pc;
+
+	do
+	{
+		vm_run(vm, 0xffff);
+		pc = vm->pc;
+		vm_run(vm, 1);
+	}
+	while (vm->pc != pc);
+
+	return pc != SUCCESS;
+}
+
+static int
+same(struct vm_state *a, struct vm_state *b)
+{
+	uint8_t pa[256], pb[256];
+	int i;
+
+	if (a->pc != b->pc || a->a != b->a || a->x != b->x || a->y != b->y
+			|| a->sp != b->sp || a->s != b->s || a->cycles != b->cycles)
+		return 0;
+
+	for (i = 0; i < 0x10000; i += 0x80)
+	{
+		a->ram_read(a, i, pa, 0x80);
+		b->ram_read(b, i, pb, 0x80);
+		if (memcmp(pa, pb, 0x80))
+			return 0;
+	}
+	return 1;
+}
+
+int
+main()
+{
+	uint32_t i, copies;
+
+	if (!ram_load("images/6502_functional_test.bin", image, 0x10000))
+		return 1;
+
+	snap_mem_init(&mem);
+	snap_mem_load(&mem, 0, image, 0x10000);
+	snap_attach(&mem, &vm);
+	vm.syscall = syscall_stub;
+	vm_init(&vm);
+	vm.pc = 0x400;
+
+	for (i = 0; i < SNAP_AT; i++)
+		vm_exec(&vm);
+	snap_take(&snap, &vm);
+
+	if (run(&vm))
+	{
+		fprintf(stderr, "** failed at %04x\n", vm.pc);
+		return 1;
+	}
+
+	// the forks run the rest of the test from the snapshot and end the same
+	snap_fork(&snap, forks, mems, FORKS);
+	for (i = 0; i < FORKS; i++)
+	{
+		if (run(&forks[i]) || !same(&vm, &forks[i]))
+		{
+			fprintf(stderr, "** fork %u failed at %04x\n", i, forks[i].pc);
+			return 1;
+		}
+	}
+
+	// none of the writes went to the snapshot
+	copies = mems[0].copies;
+	snap_restore(&snap, &vm);
+	snap_restore(&snap, &forks[0]);
+	if (!same(&vm, &forks[0]) || vm.cycles == forks[1].cycles || run(&vm)
+			|| !same(&vm, &forks[1]))
+	{
+		fprintf(stderr, "** restore failed\n");
+		return 1;
+	}
+
+	printf("** Snapshot Ok (%u of 256 pages copied by a fork)\n", copies);
+
+	for (i = 0; i < FORKS; i++)
+		snap_mem_free(&mems[i]);
+	snap_mem_free(&mem);
+	snap_free(&snap);
+
+	return 0;
+}
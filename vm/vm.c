@@ -24,982 +24,1780 @@
 
 #include "vm.h"
 
+#if defined(VM_THREADED) && defined(AVR)
+#error "VM_THREADED is for the host build only"
+#endif
+
+#ifdef VM_BLOCKS
+#include <string.h>
+
+#if VM_BLOCK_LEN > 85 || (VM_BLOCK_SLOTS & (VM_BLOCK_SLOTS - 1))
+#error "VM_BLOCK_LEN must fit in 255 code bytes and VM_BLOCK_SLOTS be a power of 2"
+#endif
+#endif // VM_BLOCKS
+
+#ifdef VM_TRACE
+#if VM_TRACE > 256 || (VM_TRACE & (VM_TRACE - 1))
+#error "VM_TRACE must be a power of 2 up to 256"
+#endif
+#endif // VM_TRACE
+
+#ifdef AVR
+#include <avr/pgmspace.h>
+#else // not AVR
+#define PROGMEM /* */
+#define pgm_read_byte(x) (*(x))
+#endif // AVR
+
+#ifdef VM_SINGLE
 // externally defined
 void vm_ram_read(uint16_t addr, uint8_t *dst, uint8_t size);
 void vm_ram_write(uint16_t addr, uint8_t *src, uint8_t size);
 void vm_syscall(uint8_t func);
 
-uint8_t r_a, r_x, r_y, r_sp, r_s;
-uint16_t r_pc;
+struct vm_state vm;
+
+#define mem_read(vm, addr, dst, size)	vm_ram_read(addr, dst, size)
+#define mem_write(vm, addr, src, size)	vm_ram_write(addr, src, size)
+#define sys_call(vm, func)				vm_syscall(func)
+#else // not VM_SINGLE
+#define mem_read(vm, addr, dst, size)	(vm)->ram_read(vm, addr, dst, size)
+#define mem_write(vm, addr, src, size)	(vm)->ram_write(vm, addr, src, size)
+#define sys_call(vm, func)				(vm)->syscall(vm, func)
+#endif // VM_SINGLE
+
+#ifdef VM_SINGLE
+#define TRAP()
+#else
+// jump to the native routine if there's one for PC
+#define TRAP() \
+	do { \
+		if (vm->traps && (vm->traps[pc >> 3] & (1 << (pc & 7)))) \
+			goto trap; \
+	} while (0)
+#endif
+
+// base cycles per opcode (0 for the ones that halt the VM)
+#ifdef VM_65C02
+static const uint8_t _cycles[256] PROGMEM = {
+	7, 6, 2, 0, 5, 3, 5, 0, 3, 2, 2, 0, 6, 4, 6, 0, // 0
+	2, 5, 5, 0, 5, 4, 6, 0, 2, 4, 2, 0, 6, 4, 6, 0, // 1
+	6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0, // 2
+	2, 5, 5, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 6, 0, // 3
+	6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0, // 4
+	2, 5, 5, 0, 0, 4, 6, 0, 2, 4, 3, 0, 0, 4, 6, 0, // 5
+	6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 6, 4, 6, 0, // 6
+	2, 5, 5, 0, 4, 4, 6, 0, 2, 4, 4, 0, 6, 4, 6, 0, // 7
+	2, 6, 0, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // 8
+	2, 6, 5, 0, 4, 4, 4, 0, 2, 5, 2, 0, 4, 5, 5, 0, // 9
+	2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // a
+	2, 5, 5, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0, // b
+	2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // c
+	2, 5, 5, 0, 0, 4, 6, 0, 2, 4, 3, 0, 0, 4, 7, 0, // d
+	2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // e
+	2, 5, 5, 0, 0, 4, 6, 0, 2, 4, 4, 0, 0, 4, 7, 0 // f
+};
+#else
+static const uint8_t _cycles[256] PROGMEM = {
+	7, 6, 2, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0, // 0
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 1
+	6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0, // 2
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 3
+	6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0, // 4
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 5
+	6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0, // 6
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 7
+	0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0, // 8
+	2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0, // 9
+	2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // a
+	2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0, // b
+	2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // c
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // d
+	2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // e
+	2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0 // f
+};
+#endif
+
+#ifdef VM_BLOCKS
+// instruction length, bit 7 set for the ones ending a block
+#ifdef VM_65C02
+static const uint8_t _decode[256] = {
+	0x81, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 0
+	0x82, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 1
+	0x83, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 2
+	0x82, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 3
+	0x81, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x83, 0x03, 0x03, 0x81, // 4
+	0x82, 0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x81, 0x03, 0x03, 0x81, // 5
+	0x81, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x83, 0x03, 0x03, 0x81, // 6
+	0x82, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x83, 0x03, 0x03, 0x81, // 7
+	0x82, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 8
+	0x82, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 9
+	0x02, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // a
+	0x82, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // b
+	0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // c
+	0x82, 0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x81, 0x03, 0x03, 0x81, // d
+	0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // e
+	0x82, 0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x81, 0x03, 0x03, 0x81 // f
+};
+#else
+static const uint8_t _decode[256] = {
+	0x81, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x81, 0x03, 0x03, 0x81, // 0
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81, // 1
+	0x83, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 2
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81, // 3
+	0x81, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x83, 0x03, 0x03, 0x81, // 4
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81, // 5
+	0x81, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x83, 0x03, 0x03, 0x81, // 6
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81, // 7
+	0x81, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x81, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // 8
+	0x82, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x81, 0x03, 0x81, 0x81, // 9
+	0x02, 0x02, 0x02, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // a
+	0x82, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x03, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // b
+	0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // c
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81, // d
+	0x02, 0x02, 0x81, 0x81, 0x02, 0x02, 0x02, 0x81, 0x01, 0x02, 0x01, 0x81, 0x03, 0x03, 0x03, 0x81, // e
+	0x82, 0x02, 0x81, 0x81, 0x81, 0x02, 0x02, 0x81, 0x01, 0x03, 0x81, 0x81, 0x81, 0x03, 0x03, 0x81 // f
+};
+#endif
+
+// no block decoded, look it up by PC
+static struct vm_insn _lookup;
+
+#define code_page(vm, p)	((vm)->code_pages[(p) >> 3] & (1 << ((p) & 7)))
+#endif // VM_BLOCKS
+
+// N and Z are evaluated lazily: N is bit 7 of res_n and Z is set when res_z is 0
+
+// status register with N and Z evaluated
+#define status()			((s & ~(sbit(Nf) | sbit(Zf))) | testN(res_n) | testZ(res_z))
+// take N and Z from the status register
+#define load_nz()			do { res_n = s; res_z = ~s & sbit(Zf); } while (0)
+
+// fetch the next instruction, the window is refilled only when it doesn't fit in it
+#define FETCH() \
+	do { \
+		if ((uint16_t)(pc - vm->win_addr) > vm->win_len - 3) \
+		{ \
+			mem_read(vm, pc, vm->win, VM_PREFETCH); \
+			vm->win_addr = pc; \
+			vm->win_len = VM_PREFETCH; \
+		} \
+		start = pt = vm->win + (uint16_t)(pc - vm->win_addr); \
+		op = *pt++; \
+		cycles += pgm_read_byte(&_cycles[op]); \
+	} while (0)
+
+#ifdef VM_TRACE
+// record the instruction about to run, a single branch when not tracing
+#define TRACE(o) \
+	do { \
+		if (vm->trace) \
+		{ \
+			struct vm_trace *tr = &vm->traces[vm->trace_pos++ & (VM_TRACE - 1)]; \
+			tr->pc = pc; \
+			tr->op = (o); \
+			tr->a = a; \
+			tr->x = x; \
+			tr->y = y; \
+			tr->sp = sp; \
+			tr->s = status(); \
+			if (vm->trace_len < VM_TRACE) \
+				vm->trace_len++; \
+		} \
+	} while (0)
+#else
+#define TRACE(o)
+#endif // VM_TRACE
+
+#ifdef VM_THREADED
+#ifdef VM_BLOCKS
+// each handler ends with its own copy of the dispatch code, running the
+// next instruction in the block or looking up a new block when it ends
+#define DISPATCH() \
+	do { \
+		if (!budget--) \
+			goto done; \
+		if (vm->event) \
+			goto event; \
+		if (!ins->handler) \
+		{ \
+			blk = &vm->blocks[pc & (VM_BLOCK_SLOTS - 1)]; \
+			ins = blk->ins[0].handler && blk->pc == pc ? blk->ins : _block(vm, blk, pc, ops); \
+		} \
+		start = ins->bytes; \
+		pt = start + 1; \
+		cycles += ins->cycles; \
+		TRACE(*start); \
+		goto *(ins++)->handler; \
+	} while (0)
+
+// done with the instruction, PC already updated
+#define JUMP				do { ins = &_lookup; DISPATCH(); } while (0)
+#else // not VM_BLOCKS
+// each handler ends with its own copy of the dispatch code
+#define DISPATCH() \
+	do { \
+		if (!budget--) \
+			goto done; \
+		if (vm->event) \
+			goto event; \
+		FETCH(); \
+		TRACE(op); \
+		goto *ops[op]; \
+	} while (0)
+
+// done with the instruction, PC already updated
+#define JUMP				DISPATCH()
+#endif // VM_BLOCKS
+
+#define CASE(n)				op_##n
+#define HALT				op_halt
+// done with the instruction, PC points to it
+#define NEXT				do { pc += (pt - start); DISPATCH(); } while (0)
+#else // not VM_THREADED
+#define CASE(n)				case n
+#define HALT				default
+#define NEXT				break
+#define JUMP				continue
+#endif // VM_THREADED
+
+// indexed read address, 1 extra cycle when crossing a page
+#define indexed(base, i)	({ uint16_t b = (base); cycles += ((uint8_t)b + (i)) >> 8; b + (i); })
+
+#ifdef VM_BLOCKS
+static void
+_drop_page(struct vm_state *vm, uint8_t page)
+{
+	struct vm_block *b;
+	uint8_t i;
 
-uint8_t op, r_t, r_ts;
-uint16_t addr, r_t16;
+	vm->code_pages[page >> 3] &= ~(1 << (page & 7));
 
-static uint8_t _op_cache[5];
+	// a block spans at most two pages
+	for (b = vm->blocks; b < vm->blocks + VM_BLOCK_SLOTS; b++)
+		if (b->ins[0].handler && ((b->pc >> 8) == page
+				|| ((uint16_t)(b->pc + b->len - 1) >> 8) == page))
+			for (i = 0; i <= VM_BLOCK_LEN; i++)
+				b->ins[i].handler = NULL;
+}
 
-void
-vm_init()
+static void
+_drop_code(struct vm_state *vm, uint16_t addr, uint8_t size)
 {
-	r_a = r_x = r_y = r_s = 0;
-	r_sp = 0xff;
-	r_pc = PROG_START;
+	struct vm_block *b;
+	uint16_t pc = addr - (VM_BLOCK_LEN * 3 - 1);
+	uint8_t i, j;
+
+	// only the blocks starting up to the longest block back can include addr
+	for (i = 0; i < VM_BLOCK_LEN * 3 - 1 + size; i++, pc++)
+	{
+		b = &vm->blocks[pc & (VM_BLOCK_SLOTS - 1)];
+		if (b->ins[0].handler && b->pc == pc
+				&& ((uint16_t)(addr - pc) < b->len || (uint16_t)(pc - addr) < size))
+			for (j = 0; j <= VM_BLOCK_LEN; j++)
+				b->ins[j].handler = NULL;
+	}
 }
 
-uint8_t
-vm_exec()
+static struct vm_insn *
+_block(struct vm_state *vm, struct vm_block *b, uint16_t pc, const void *const *ops)
 {
-	uint8_t *pt = _op_cache;
+	uint8_t code[VM_BLOCK_LEN * 3], *pt = code, n, d;
+	uint16_t page;
 
-	vm_ram_read(r_pc, pt, 3);
-	op = *pt++;
+	// decode up to the first branch, jump, return or halt
+	mem_read(vm, pc, code, sizeof(code));
+	for (n = 0, d = 0; n < VM_BLOCK_LEN && !(d & 0x80); n++)
+	{
+		d = _decode[*pt];
+		b->ins[n].handler = ops[*pt];
+		b->ins[n].cycles = pgm_read_byte(&_cycles[*pt]);
+		memcpy(b->ins[n].bytes, pt, 3);
+		pt += d & 0x7f;
+	}
+	b->ins[n].handler = NULL;
+	b->pc = pc;
+	b->len = pt - code;
+
+	page = pc >> 8;
+	vm->code_pages[page >> 3] |= 1 << (page & 7);
+	page = (uint16_t)(pc + b->len - 1) >> 8;
+	vm->code_pages[page >> 3] |= 1 << (page & 7);
 
-	switch(op)
+	return b->ins;
+}
+#endif // VM_BLOCKS
+
+static void
+_ram_write(struct vm_state *vm, uint16_t addr, uint8_t *src, uint8_t size)
+{
+	uint16_t off;
+
+	mem_write(vm, addr, src, size);
+
+#ifdef VM_BLOCKS
+	// self-modifying code drops the decoded blocks including the changed bytes
+	off = (uint16_t)(addr + size - 1) >> 8;
+	if (code_page(vm, addr >> 8) || code_page(vm, off))
+		_drop_code(vm, addr, size);
+#else
+	// keep the prefetch window coherent with self-modifying code
+	while (size--)
 	{
-		case 0x02:
-			// SYS
-			vm_syscall(r_a);
-			break;
-		case 0xca:
-			// DEX
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_x--;
-			r_s |=  testN(r_x) | testZ(r_x);;
-			break;
-
-		case 0x88:
-			// DEY
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_y--;
-			r_s |= testN(r_y) | testZ(r_y);
-			break;
-
-		case 0xaa:
-			// TAX
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_x = r_a;
-			r_s |= testN(r_x) | testZ(r_x);
-			break;
-
-		case 0x10:
-			// BPL
-			if (!testN(r_s))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0x90:
-			// BCC
-			if (!(r_s & sbit(Cf)))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0xe0:
-			// CPX #n
-			r_t = *pt++;
-			goto cpx_im;
-		case 0xe4:
-			// CPX zp
-			addr = *pt++;
-			goto cpx;
-		case 0xec:
-			// CPX abs
-			addr = addr16(*pt++, *pt++);
+		off = addr++ - vm->win_addr;
+		if (off < vm->win_len)
+			vm->win[off] = *src;
+		src++;
+	}
+#endif
+}
+
+// multi-byte stack accesses wrap inside page 1; one transaction unless they do
+static void
+_push(struct vm_state *vm, uint8_t sp, uint8_t *src, uint8_t size)
+{
+	uint8_t low = sp - size + 1;
+
+	if (low <= sp)
+		_ram_write(vm, addr16(low, 1), src, size);
+	else
+		while (size--)
+			_ram_write(vm, addr16(sp--, 1), src + size, 1);
+}
+
+static void
+_pull(struct vm_state *vm, uint8_t sp, uint8_t *dst, uint8_t size)
+{
+	uint8_t i;
+
+	if ((uint8_t)(sp + size) > sp)
+		mem_read(vm, addr16(sp + 1, 1), dst, size);
+	else
+		for (i = 0; i < size; i++)
+			mem_read(vm, addr16(++sp, 1), dst + i, 1);
+}
+
+static inline void
+_init(struct vm_state *vm)
+{
+#ifdef VM_BLOCKS
+	uint16_t i;
+
+	for (i = 0; i < VM_BLOCK_SLOTS; i++)
+		vm->blocks[i].ins[0].handler = NULL;
+	memset(vm->code_pages, 0, sizeof(vm->code_pages));
+#endif
+
+	vm->a = vm->x = vm->y = vm->s = 0;
+	vm->sp = 0xff;
+	vm->pc = PROG_START;
+	vm->cycles = 0;
+	vm->event = vm->irq = vm->nmi = 0;
+	vm->win_len = 0;
+	vm->sys_pc = 0;
+	vm->sys_cycles = 0;
+	vm->idle = 0;
+#ifdef VM_TRACE
+	// trace is left as it was
+	vm->trace_pos = vm->trace_len = 0;
+#endif
+}
+
+static inline uint8_t
+_run(struct vm_state *vm, uint16_t budget)
+{
+	uint8_t a = vm->a, x = vm->x, y = vm->y, sp = vm->sp, s = vm->s;
+	uint8_t res_n, res_z, t, ts, ret = VM_BUDGET;
+	uint8_t buf[3], *pt, *start;
+	uint16_t pc = vm->pc, addr, t16;
+	uint32_t cycles = vm->cycles;
+#ifndef VM_SINGLE
+	uint16_t total = budget;
+#endif
+#ifdef VM_BLOCKS
+	struct vm_insn *ins = &_lookup;
+	struct vm_block *blk;
+#else
+	uint8_t op;
+#endif
+
+#ifdef VM_THREADED
+	// one label per opcode, the rest halt
+	static const void *const ops[256] = {
+		[0 ... 255] = &&op_halt,
+		[0x00] = &&op_0x00, [0x01] = &&op_0x01, [0x02] = &&op_0x02, [0x05] = &&op_0x05, [0x06] = &&op_0x06, [0x08] = &&op_0x08,
+		[0x09] = &&op_0x09, [0x0a] = &&op_0x0a, [0x0d] = &&op_0x0d, [0x0e] = &&op_0x0e, [0x10] = &&op_0x10, [0x11] = &&op_0x11,
+		[0x15] = &&op_0x15, [0x16] = &&op_0x16, [0x18] = &&op_0x18, [0x19] = &&op_0x19, [0x1d] = &&op_0x1d, [0x1e] = &&op_0x1e,
+		[0x20] = &&op_0x20, [0x21] = &&op_0x21, [0x24] = &&op_0x24, [0x25] = &&op_0x25, [0x26] = &&op_0x26, [0x28] = &&op_0x28,
+		[0x29] = &&op_0x29, [0x2a] = &&op_0x2a, [0x2c] = &&op_0x2c, [0x2d] = &&op_0x2d, [0x2e] = &&op_0x2e, [0x30] = &&op_0x30,
+		[0x31] = &&op_0x31, [0x35] = &&op_0x35, [0x36] = &&op_0x36, [0x38] = &&op_0x38, [0x39] = &&op_0x39, [0x3d] = &&op_0x3d,
+		[0x3e] = &&op_0x3e, [0x40] = &&op_0x40, [0x41] = &&op_0x41, [0x45] = &&op_0x45, [0x46] = &&op_0x46, [0x48] = &&op_0x48,
+		[0x49] = &&op_0x49, [0x4a] = &&op_0x4a, [0x4c] = &&op_0x4c, [0x4d] = &&op_0x4d, [0x4e] = &&op_0x4e, [0x50] = &&op_0x50,
+		[0x51] = &&op_0x51, [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x58] = &&op_0x58, [0x59] = &&op_0x59, [0x5d] = &&op_0x5d,
+		[0x5e] = &&op_0x5e, [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x65] = &&op_0x65, [0x66] = &&op_0x66, [0x68] = &&op_0x68,
+		[0x69] = &&op_0x69, [0x6a] = &&op_0x6a, [0x6c] = &&op_0x6c, [0x6d] = &&op_0x6d, [0x6e] = &&op_0x6e, [0x70] = &&op_0x70,
+		[0x71] = &&op_0x71, [0x75] = &&op_0x75, [0x76] = &&op_0x76, [0x78] = &&op_0x78, [0x79] = &&op_0x79, [0x7d] = &&op_0x7d,
+		[0x7e] = &&op_0x7e, [0x81] = &&op_0x81, [0x84] = &&op_0x84, [0x85] = &&op_0x85, [0x86] = &&op_0x86, [0x88] = &&op_0x88,
+		[0x8a] = &&op_0x8a, [0x8c] = &&op_0x8c, [0x8d] = &&op_0x8d, [0x8e] = &&op_0x8e, [0x90] = &&op_0x90, [0x91] = &&op_0x91,
+		[0x94] = &&op_0x94, [0x95] = &&op_0x95, [0x96] = &&op_0x96, [0x98] = &&op_0x98, [0x99] = &&op_0x99, [0x9a] = &&op_0x9a,
+		[0x9d] = &&op_0x9d, [0xa0] = &&op_0xa0, [0xa1] = &&op_0xa1, [0xa2] = &&op_0xa2, [0xa4] = &&op_0xa4, [0xa5] = &&op_0xa5,
+		[0xa6] = &&op_0xa6, [0xa8] = &&op_0xa8, [0xa9] = &&op_0xa9, [0xaa] = &&op_0xaa, [0xac] = &&op_0xac, [0xad] = &&op_0xad,
+		[0xae] = &&op_0xae, [0xb0] = &&op_0xb0, [0xb1] = &&op_0xb1, [0xb4] = &&op_0xb4, [0xb5] = &&op_0xb5, [0xb6] = &&op_0xb6,
+		[0xb8] = &&op_0xb8, [0xb9] = &&op_0xb9, [0xba] = &&op_0xba, [0xbc] = &&op_0xbc, [0xbd] = &&op_0xbd, [0xbe] = &&op_0xbe,
+		[0xc0] = &&op_0xc0, [0xc1] = &&op_0xc1, [0xc4] = &&op_0xc4, [0xc5] = &&op_0xc5, [0xc6] = &&op_0xc6, [0xc8] = &&op_0xc8,
+		[0xc9] = &&op_0xc9, [0xca] = &&op_0xca, [0xcc] = &&op_0xcc, [0xcd] = &&op_0xcd, [0xce] = &&op_0xce, [0xd0] = &&op_0xd0,
+		[0xd1] = &&op_0xd1, [0xd5] = &&op_0xd5, [0xd6] = &&op_0xd6, [0xd8] = &&op_0xd8, [0xd9] = &&op_0xd9, [0xdd] = &&op_0xdd,
+		[0xde] = &&op_0xde, [0xe0] = &&op_0xe0, [0xe1] = &&op_0xe1, [0xe4] = &&op_0xe4, [0xe5] = &&op_0xe5, [0xe6] = &&op_0xe6,
+		[0xe8] = &&op_0xe8, [0xe9] = &&op_0xe9, [0xea] = &&op_0xea, [0xec] = &&op_0xec, [0xed] = &&op_0xed, [0xee] = &&op_0xee,
+		[0xf0] = &&op_0xf0, [0xf1] = &&op_0xf1, [0xf5] = &&op_0xf5, [0xf6] = &&op_0xf6, [0xf8] = &&op_0xf8, [0xf9] = &&op_0xf9,
+		[0xfd] = &&op_0xfd, [0xfe] = &&op_0xfe,
+#ifdef VM_65C02
+		[0x04] = &&op_0x04, [0x0c] = &&op_0x0c, [0x12] = &&op_0x12, [0x14] = &&op_0x14, [0x1a] = &&op_0x1a, [0x1c] = &&op_0x1c,
+		[0x32] = &&op_0x32, [0x34] = &&op_0x34, [0x3a] = &&op_0x3a, [0x3c] = &&op_0x3c, [0x52] = &&op_0x52, [0x5a] = &&op_0x5a,
+		[0x64] = &&op_0x64, [0x72] = &&op_0x72, [0x74] = &&op_0x74, [0x7a] = &&op_0x7a, [0x7c] = &&op_0x7c, [0x80] = &&op_0x80,
+		[0x89] = &&op_0x89, [0x92] = &&op_0x92, [0x9c] = &&op_0x9c, [0x9e] = &&op_0x9e, [0xb2] = &&op_0xb2, [0xd2] = &&op_0xd2,
+		[0xda] = &&op_0xda, [0xf2] = &&op_0xf2, [0xfa] = &&op_0xfa,
+#endif
+	};
+#endif
+
+	load_nz();
+
+#ifdef VM_THREADED
+	DISPATCH();
+#else // not VM_THREADED
+	while (budget--)
+	{
+		if (vm->event)
+			goto event;
+
+		FETCH();
+		TRACE(op);
+
+		switch(op)
+#endif // VM_THREADED
+		{
+			CASE(0x02):
+				// SYS, run once the registers are back in the state
+				pc++;
+				ret = VM_SYS;
+				goto done;
+			CASE(0xca):
+				// DEX
+				x--;
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0x88):
+				// DEY
+				y--;
+				res_n = res_z = y;
+				NEXT;
+
+			CASE(0xaa):
+				// TAX
+				x = a;
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0x10):
+				// BPL
+				if (!testN(res_n))
+					goto branch;
+				pc++;
+				NEXT;
+branch:
+				// taken branch, 1 extra cycle (2 when crossing a page)
+				addr = pc + 2;
+				pc = addr + (int8_t)*pt;
+				cycles += ((addr ^ pc) & 0xff00) ? 2 : 1;
+				JUMP;
+#ifdef VM_65C02
+			CASE(0x80):
+				// BRA
+				goto branch;
+#endif
+
+			CASE(0x90):
+				// BCC
+				if (!(s & sbit(Cf)))
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0xe0):
+				// CPX #n
+				t = *pt++;
+				goto cpx_im;
+			CASE(0xe4):
+				// CPX zp
+				addr = *pt++;
+				goto cpx;
+			CASE(0xec):
+				// CPX abs
+				addr = addr16(*pt++, *pt++);
 cpx:
-			vm_ram_read(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
 cpx_im:
-			r_ts = r_x - r_t;
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_ts) | testZ(r_ts) | (r_x >= r_t ? sbit(Cf) : 0);
-			break;
-
-		case 0x41:
-			// EOR (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto eor;
-		case 0x45:
-			// EOR zp
-			addr = *pt++;
-			goto eor;
-		case 0x49:
-			// EOR #n
-			r_a ^= *pt++;
-			goto eor_im;
-		case 0x4d:
-			// EOR abs
-			addr = addr16(*pt++, *pt++);
-			goto eor;
-		case 0x51:
-			// EOR (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto eor;
-		case 0x55:
-			// EOR zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto eor;
-		case 0x59:
-			// EOR abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto eor;
-		case 0x5d:
-			// EOR abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				ts = x - t;
+				s &= ~sbit(Cf);
+				s |= (x >= t ? sbit(Cf) : 0);
+				res_n = res_z = ts;
+				NEXT;
+
+			CASE(0x41):
+				// EOR (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto eor;
+			CASE(0x45):
+				// EOR zp
+				addr = *pt++;
+				goto eor;
+			CASE(0x49):
+				// EOR #n
+				a ^= *pt++;
+				goto eor_im;
+			CASE(0x4d):
+				// EOR abs
+				addr = addr16(*pt++, *pt++);
+				goto eor;
+			CASE(0x51):
+				// EOR (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto eor;
+			CASE(0x55):
+				// EOR zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto eor;
+			CASE(0x59):
+				// EOR abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto eor;
+#ifdef VM_65C02
+			CASE(0x52):
+				// EOR (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto eor;
+#endif
+			CASE(0x5d):
+				// EOR abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 eor:
-			vm_ram_read(addr, &r_t, 1);
-			r_a ^= r_t;
+				mem_read(vm, addr, &t, 1);
+				a ^= t;
 eor_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0xba:
-			// TSX
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_x = r_sp;
-			r_s |= testN(r_x) | testZ(r_x);
-			break;
-
-		case 0xc6:
-			// DEC zp
-			addr = *pt++;
-			goto dec;
-		case 0xce:
-			// DEC abs
-			addr = addr16(*pt++, *pt++);
-			goto dec;
-		case 0xd6:
-			// DEC zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto dec;
-		case 0xde:
-			// DEC abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0xba):
+				// TSX
+				x = sp;
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0xc6):
+				// DEC zp
+				addr = *pt++;
+				goto dec;
+			CASE(0xce):
+				// DEC abs
+				addr = addr16(*pt++, *pt++);
+				goto dec;
+			CASE(0xd6):
+				// DEC zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto dec;
+			CASE(0xde):
+				// DEC abs,x
+				addr = addr16(*pt++, *pt++) + x;
 dec:
-			vm_ram_read(addr, &r_t, 1);
-			r_t--;
-			vm_ram_write(addr, &r_t, 1);
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_t) | testZ(r_t);
-			break;
-
-		case 0x81:
-			// STA (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x85:
-			// STA zp
-			addr = *pt++;;
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x8d:
-			// STA abs
-			addr = addr16(*pt++, *pt++);
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x91:
-			// STA (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x95:
-			// STA zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x99:
-			// STA abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			vm_ram_write(addr, &r_a, 1);
-			break;
-		case 0x9d:
-			// STA abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
-			vm_ram_write(addr, &r_a, 1);
-			break;
-
-		case 0xa1:
-			// LDA (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto lda;
-		case 0xa5:
-			// LDA zp
-			addr = *pt++;
-			goto lda;
-		case 0xa9:
-			// LDA #n
-			r_a = *pt++;
-			goto lda_im;
-		case 0xad:
-			// LDA abs
-			addr = addr16(*pt++, *pt++);
-			goto lda;
-		case 0xb1:
-			// LDA (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto lda;
-		case 0xb5:
-			// LDA zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto lda;
-		case 0xb9:
-			// LDA abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto lda;
-		case 0xbd:
-			// LDA abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				mem_read(vm, addr, &t, 1);
+				t--;
+				_ram_write(vm, addr, &t, 1);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0x81):
+				// STA (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x85):
+				// STA zp
+				addr = *pt++;;
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x8d):
+				// STA abs
+				addr = addr16(*pt++, *pt++);
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x91):
+				// STA (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]) + y;
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x95):
+				// STA zp,x
+				addr = ((*pt++) + x) & 0xff;
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x99):
+				// STA abs,y
+				addr = addr16(*pt++, *pt++) + y;
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+			CASE(0x9d):
+				// STA abs,x
+				addr = addr16(*pt++, *pt++) + x;
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+#ifdef VM_65C02
+			CASE(0x92):
+				// STA (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				_ram_write(vm, addr, &a, 1);
+				NEXT;
+
+			CASE(0x64):
+				// STZ zp
+				addr = *pt++;
+				goto stz;
+			CASE(0x74):
+				// STZ zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto stz;
+			CASE(0x9c):
+				// STZ abs
+				addr = addr16(*pt++, *pt++);
+				goto stz;
+			CASE(0x9e):
+				// STZ abs,x
+				addr = addr16(*pt++, *pt++) + x;
+stz:
+				t = 0;
+				_ram_write(vm, addr, &t, 1);
+				NEXT;
+#endif
+
+			CASE(0xa1):
+				// LDA (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto lda;
+			CASE(0xa5):
+				// LDA zp
+				addr = *pt++;
+				goto lda;
+			CASE(0xa9):
+				// LDA #n
+				a = *pt++;
+				goto lda_im;
+			CASE(0xad):
+				// LDA abs
+				addr = addr16(*pt++, *pt++);
+				goto lda;
+			CASE(0xb1):
+				// LDA (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto lda;
+			CASE(0xb5):
+				// LDA zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto lda;
+			CASE(0xb9):
+				// LDA abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto lda;
+#ifdef VM_65C02
+			CASE(0xb2):
+				// LDA (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto lda;
+#endif
+			CASE(0xbd):
+				// LDA abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 lda:
-			vm_ram_read(addr, &r_a, 1);
+				mem_read(vm, addr, &a, 1);
 lda_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0xf0:
-			// BEQ
-			if (r_s & sbit(Zf))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0x26:
-			// ROL zp
-			addr = *pt++;
-			goto rol;
-		case 0x2a:
-			// ROL a
-			r_ts = r_a;
-			r_a = r_t = ((r_a << 1) & 0xfe) | testC(r_s);
-			goto rol_a;
-		case 0x2e:
-			// ROL abs
-			addr = addr16(*pt++, *pt++);
-			goto rol;
-		case 0x36:
-			// ROL zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto rol;
-		case 0x3e:
-			// ROL abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0xf0):
+				// BEQ
+				if (!res_z)
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0x26):
+				// ROL zp
+				addr = *pt++;
+				goto rol;
+			CASE(0x2a):
+				// ROL a
+				ts = a;
+				a = t = ((a << 1) & 0xfe) | testC(s);
+				goto rol_a;
+			CASE(0x2e):
+				// ROL abs
+				addr = addr16(*pt++, *pt++);
+				goto rol;
+			CASE(0x36):
+				// ROL zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto rol;
+			CASE(0x3e):
+				// ROL abs,x
+#ifdef VM_65C02
+				// 6 cycles on the 65C02, 7 when crossing a page
+				addr = indexed(addr16(*pt++, *pt++), x);
+#else
+				addr = addr16(*pt++, *pt++) + x;
+#endif
 rol:
-			vm_ram_read(addr, &r_t, 1);
-			r_ts = r_t;
-			r_t = ((r_t << 1) & 0xfe) | testC(r_s);
-			vm_ram_write(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
+				ts = t;
+				t = ((t << 1) & 0xfe) | testC(s);
+				_ram_write(vm, addr, &t, 1);
 rol_a:
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_t) | testZ(r_t) | (testN(r_ts) ? sbit(Cf) : 0);
-			break;
-
-		case 0x84:
-			// STY zp
-			addr = *pt++;
-			goto sty;
-		case 0x8c:
-			// STY abs
-			addr = addr16(*pt++, *pt++);
-			goto sty;
-		case 0x94:
-			// STY zp,x
-			addr = ((*pt++) + r_x) & 0xff;
+				s &= ~sbit(Cf);
+				s |= (testN(ts) ? sbit(Cf) : 0);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0x84):
+				// STY zp
+				addr = *pt++;
+				goto sty;
+			CASE(0x8c):
+				// STY abs
+				addr = addr16(*pt++, *pt++);
+				goto sty;
+			CASE(0x94):
+				// STY zp,x
+				addr = ((*pt++) + x) & 0xff;
 sty:
-			vm_ram_write(addr, &r_y, 1);
-			break;
-
-		case 0x4c:
-			// JMP abs
-			r_pc = addr16(*pt++, *pt++);
-			return 1;
-		case 0x6c:
-			// JMP (abs)
-			addr = addr16(*pt++, *pt++);
-			vm_ram_read(addr, pt, 2);
-			r_pc = addr16(pt[0], pt[1]);
-			return 1;
-
-		case 0x30:
-			// BMI
-			if (r_s & sbit(Nf))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0x40:
-			// RTI
-			vm_ram_read(addr16(r_sp + 1, 1), pt, 3);
-			r_s = pt[0];
-			r_pc = addr16(pt[1], pt[2]);
-			r_sp += 3;
-			return 1;
-
-		case 0xa8:
-			// TAY
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_y = r_a;
-			r_s |= testN(r_y) | testZ(r_y);
-			break;
-
-		case 0x8a:
-			// TXA
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_a = r_x;
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0x60:
-			// RTS
-			vm_ram_read(addr16(r_sp + 1, 1), pt, 2);
-			r_pc = addr16(pt[0], pt[1]) + 1;
-			r_sp += 2;
-			return 1;
-
-		case 0xf8:
-			// SED
-			r_s |= sbit(Df);
-			break;
-
-		case 0x46:
-			// LSR zp
-			addr = *pt++;
-			goto lsr;
-		case 0x4a:
-			// LSR a
-			r_ts = r_a;
-			r_a = r_t = (r_a >> 1) & 0x7f;
-			goto lsr_a;
-		case 0x4e:
-			// LSR abs
-			addr = addr16(*pt++, *pt++);
-			goto lsr;
-		case 0x56:
-			// LSR zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto lsr;
-		case 0x5e:
-			// LSR abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				_ram_write(vm, addr, &y, 1);
+				NEXT;
+
+			CASE(0x4c):
+				// JMP abs
+				pc = addr16(*pt++, *pt++);
+				TRAP();
+				JUMP;
+			CASE(0x6c):
+				// JMP (abs)
+				addr = addr16(*pt++, *pt++);
+#ifdef VM_65C02
+				mem_read(vm, addr, buf, 2);
+#else
+				// the NMOS 6502 doesn't carry into the high byte of the pointer
+				mem_read(vm, addr, buf, 1);
+				mem_read(vm, (addr & 0xff00) | ((addr + 1) & 0xff), buf + 1, 1);
+#endif
+				pc = addr16(buf[0], buf[1]);
+				JUMP;
+#ifdef VM_65C02
+			CASE(0x7c):
+				// JMP (abs,x)
+				addr = addr16(*pt++, *pt++) + x;
+				mem_read(vm, addr, buf, 2);
+				pc = addr16(buf[0], buf[1]);
+				JUMP;
+#endif
+
+			CASE(0x30):
+				// BMI
+				if (testN(res_n))
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0x40):
+				// RTI
+				_pull(vm, sp, buf, 3);
+				s = buf[0];
+				load_nz();
+				pc = addr16(buf[1], buf[2]);
+				sp += 3;
+				goto unmask;
+
+			CASE(0xa8):
+				// TAY
+				y = a;
+				res_n = res_z = y;
+				NEXT;
+
+			CASE(0x8a):
+				// TXA
+				a = x;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0x60):
+				// RTS
+				_pull(vm, sp, buf, 2);
+				pc = addr16(buf[0], buf[1]) + 1;
+				sp += 2;
+				JUMP;
+
+			CASE(0xf8):
+				// SED
+				s |= sbit(Df);
+				NEXT;
+
+			CASE(0x46):
+				// LSR zp
+				addr = *pt++;
+				goto lsr;
+			CASE(0x4a):
+				// LSR a
+				ts = a;
+				a = t = (a >> 1) & 0x7f;
+				goto lsr_a;
+			CASE(0x4e):
+				// LSR abs
+				addr = addr16(*pt++, *pt++);
+				goto lsr;
+			CASE(0x56):
+				// LSR zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto lsr;
+			CASE(0x5e):
+				// LSR abs,x
+#ifdef VM_65C02
+				// 6 cycles on the 65C02, 7 when crossing a page
+				addr = indexed(addr16(*pt++, *pt++), x);
+#else
+				addr = addr16(*pt++, *pt++) + x;
+#endif
 lsr:
-			vm_ram_read(addr, &r_ts, 1);
-			r_t = (r_ts >> 1) & 0x7f;
-			vm_ram_write(addr, &r_t, 1);
+				mem_read(vm, addr, &ts, 1);
+				t = (ts >> 1) & 0x7f;
+				_ram_write(vm, addr, &t, 1);
 lsr_a:
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testZ(r_t) | testC(r_ts);
-			break;
-
-		case 0x20:
-			// JSR abs
-			addr = r_pc + 2;
-			r_pc = addr16(*pt++, *pt++);
-			pt[0] = (int8_t)addr;
-			pt[1] = (addr >> 8);
-			vm_ram_write(addr16(r_sp - 1, 1), pt, 2);
-			r_sp -= 2;
-			return 1;
-
-		case 0xa0:
-			// LDY #n
-			r_y = *pt++;
-			goto ldy_im;
-		case 0xa4:
-			// LDY zp
-			addr = *pt++;
-			goto ldy;
-		case 0xac:
-			// LDY abs
-			addr = addr16(*pt++, *pt++);
-			goto ldy;
-		case 0xb4:
-			// LDY zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto ldy;
-		case 0xbc:
-			// LDY abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				s &= ~sbit(Cf);
+				s |= testC(ts);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0x20):
+				// JSR abs
+				addr = pc + 2;
+				pc = addr16(*pt++, *pt++);
+				buf[0] = (int8_t)addr;
+				buf[1] = (addr >> 8);
+				_push(vm, sp, buf, 2);
+				sp -= 2;
+				TRAP();
+				JUMP;
+#ifndef VM_SINGLE
+trap:
+				// the native routine runs on the state and returns as RTS would
+				vm->a = a;
+				vm->x = x;
+				vm->y = y;
+				vm->sp = sp;
+				vm->s = status();
+				vm->pc = pc;
+				vm->cycles = cycles;
+				if (vm->trap(vm))
+				{
+					a = vm->a;
+					x = vm->x;
+					y = vm->y;
+					sp = vm->sp;
+					s = vm->s;
+					load_nz();
+					pc = vm->pc;
+					cycles = vm->cycles;
+					// its writes don't go through _ram_write()
+					vm->win_len = 0;
+				}
+				JUMP;
+#endif
+
+			CASE(0xa0):
+				// LDY #n
+				y = *pt++;
+				goto ldy_im;
+			CASE(0xa4):
+				// LDY zp
+				addr = *pt++;
+				goto ldy;
+			CASE(0xac):
+				// LDY abs
+				addr = addr16(*pt++, *pt++);
+				goto ldy;
+			CASE(0xb4):
+				// LDY zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto ldy;
+			CASE(0xbc):
+				// LDY abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 ldy:
-			vm_ram_read(addr, &r_y, 1);
+				mem_read(vm, addr, &y, 1);
 ldy_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_y) | testZ(r_y);
-			break;
-
-		case 0x38:
-			// SEC
-			r_s |= sbit(Cf);
-			break;
-
-		case 0x24:
-		case 0x2c:
-			if (op == 0x24)
+				res_n = res_z = y;
+				NEXT;
+
+			CASE(0x38):
+				// SEC
+				s |= sbit(Cf);
+				NEXT;
+
+			CASE(0x24):
 				// BIT zp
 				addr = *pt++;
-			else
+				goto bit;
+#ifdef VM_65C02
+			CASE(0x34):
+				// BIT zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto bit;
+			CASE(0x3c):
+				// BIT abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
+				goto bit;
+			CASE(0x89):
+				// BIT #n, only Z is changed
+				res_z = *pt++ & a;
+				NEXT;
+#endif
+			CASE(0x2c):
 				// BIT abs
 				addr = addr16(*pt++, *pt++);
-
-			vm_ram_read(addr, &r_t, 1);
-
-			r_s &= ~(sbit(Nf) | sbit(Vf) | sbit(Zf));
-			r_s |= testN(r_t) | testV(r_t) | testZ(r_t & r_a);
-			break;
-
-		case 0xa2:
-			// LDX #n
-			r_x = *pt++;
-			goto ldx_im;
-		case 0xa6:
-			// LDX zp
-			addr = *pt++;
-			goto ldx;
-		case 0xae:
-			// LDX abs
-			addr = addr16(*pt++, *pt++);
-			goto ldx;
-		case 0xb6:
-			// LDX zp,y
-			addr = ((*pt++) + r_y) & 0xff;
-			goto ldx;
-		case 0xbe:
-			// LDX abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
+bit:
+				mem_read(vm, addr, &t, 1);
+
+				s &= ~sbit(Vf);
+				s |= testV(t);
+				res_n = t;
+				res_z = t & a;
+				NEXT;
+
+#ifdef VM_65C02
+			CASE(0x04):
+				// TSB zp
+				addr = *pt++;
+				goto tsb;
+			CASE(0x0c):
+				// TSB abs
+				addr = addr16(*pt++, *pt++);
+tsb:
+				mem_read(vm, addr, &t, 1);
+				res_z = t & a;
+				t |= a;
+				_ram_write(vm, addr, &t, 1);
+				NEXT;
+
+			CASE(0x14):
+				// TRB zp
+				addr = *pt++;
+				goto trb;
+			CASE(0x1c):
+				// TRB abs
+				addr = addr16(*pt++, *pt++);
+trb:
+				mem_read(vm, addr, &t, 1);
+				res_z = t & a;
+				t &= ~a;
+				_ram_write(vm, addr, &t, 1);
+				NEXT;
+#endif
+
+			CASE(0xa2):
+				// LDX #n
+				x = *pt++;
+				goto ldx_im;
+			CASE(0xa6):
+				// LDX zp
+				addr = *pt++;
+				goto ldx;
+			CASE(0xae):
+				// LDX abs
+				addr = addr16(*pt++, *pt++);
+				goto ldx;
+			CASE(0xb6):
+				// LDX zp,y
+				addr = ((*pt++) + y) & 0xff;
+				goto ldx;
+			CASE(0xbe):
+				// LDX abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
 ldx:
-			vm_ram_read(addr, &r_x, 1);
+				mem_read(vm, addr, &x, 1);
 ldx_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_x) | testZ(r_x);
-			break;
-
-		case 0x9a:
-			// TXS
-			r_sp = r_x;
-			break;
-
-		case 0x78:
-			// SEI
-			r_s |= sbit(If);
-			break;
-
-		case 0x06:
-			// ASL zp
-			addr = *pt++;
-			goto asl;
-		case 0x0a:
-			// ASL a
-			r_ts = r_a;
-			r_a = r_t = (r_a << 1) & 0xfe;
-			goto asl_a;
-		case 0x0e:
-			// ASL abs
-			addr = addr16(*pt++, *pt++);
-			goto asl;
-		case 0x16:
-			// ASL zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto asl;
-		case 0x1e:
-			// ASL abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0x9a):
+				// TXS
+				sp = x;
+				NEXT;
+
+			CASE(0x78):
+				// SEI
+				s |= sbit(If);
+				NEXT;
+
+			CASE(0x06):
+				// ASL zp
+				addr = *pt++;
+				goto asl;
+			CASE(0x0a):
+				// ASL a
+				ts = a;
+				a = t = (a << 1) & 0xfe;
+				goto asl_a;
+			CASE(0x0e):
+				// ASL abs
+				addr = addr16(*pt++, *pt++);
+				goto asl;
+			CASE(0x16):
+				// ASL zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto asl;
+			CASE(0x1e):
+				// ASL abs,x
+#ifdef VM_65C02
+				// 6 cycles on the 65C02, 7 when crossing a page
+				addr = indexed(addr16(*pt++, *pt++), x);
+#else
+				addr = addr16(*pt++, *pt++) + x;
+#endif
 asl:
-			vm_ram_read(addr, &r_t, 1);
-			r_ts = r_t;
-			r_t = (r_t << 1) & 0xfe;
-			vm_ram_write(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
+				ts = t;
+				t = (t << 1) & 0xfe;
+				_ram_write(vm, addr, &t, 1);
 asl_a:
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_t) | testZ(r_t) | (testN(r_ts) ? sbit(Cf) : 0);
-			break;
-
-		case 0x70:
-			// BVS
-			if (r_s & sbit(Vf))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0xc0:
-			// CPY #n
-			r_t = *pt++;
-			goto cpy_im;
-		case 0xc4:
-			// CPY zp
-			addr = *pt++;
-			goto cpy;
-		case 0xcc:
-			// CPY abs
-			addr = addr16(*pt++, *pt++);
+				s &= ~sbit(Cf);
+				s |= (testN(ts) ? sbit(Cf) : 0);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0x70):
+				// BVS
+				if (s & sbit(Vf))
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0xc0):
+				// CPY #n
+				t = *pt++;
+				goto cpy_im;
+			CASE(0xc4):
+				// CPY zp
+				addr = *pt++;
+				goto cpy;
+			CASE(0xcc):
+				// CPY abs
+				addr = addr16(*pt++, *pt++);
 cpy:
-			vm_ram_read(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
 cpy_im:
-			r_ts = r_y - r_t;
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_ts) | testZ(r_ts) | (r_y >= r_t ? sbit(Cf) : 0);
-			break;
-
-		case 0x58:
-			// CLI
-			r_s &= ~sbit(If);
-			break;
-
-		case 0xd8:
-			// CLD
-			r_s &= ~sbit(Df);
-			break;
-
-		case 0x18:
-			// CLC
-			r_s &= ~sbit(Cf);
-			break;
-
-		case 0xb0:
-			// BCS
-			if (r_s & sbit(Cf))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0x61:
-			// ADC (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto adc;
-		case 0x65:
-			// ADC zp
-			addr = *pt++;
-			goto adc;
-		case 0x69:
-			// ADC #n
-			r_t = *pt++;
-
-			if (testD(r_s))
-				goto adc_im_d;
-
-			goto adc_im;
-		case 0x6d:
-			// ADC abs
-			addr = addr16(*pt++, *pt++);
-			goto adc;
-		case 0x71:
-			// ADC (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto adc;
-		case 0x75:
-			// ADC zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto adc;
-		case 0x79:
-			// ADC abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto adc;
-		case 0x7d:
-			// ADC abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				ts = y - t;
+				s &= ~sbit(Cf);
+				s |= (y >= t ? sbit(Cf) : 0);
+				res_n = res_z = ts;
+				NEXT;
+
+			CASE(0x58):
+				// CLI
+				s &= ~sbit(If);
+				pc++;
+unmask:
+				// a pending IRQ is taken now
+				if (vm->irq)
+					vm->event = 1;
+				JUMP;
+
+			CASE(0xd8):
+				// CLD
+				s &= ~sbit(Df);
+				NEXT;
+
+			CASE(0x18):
+				// CLC
+				s &= ~sbit(Cf);
+				NEXT;
+
+			CASE(0xb0):
+				// BCS
+				if (s & sbit(Cf))
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0x61):
+				// ADC (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto adc;
+			CASE(0x65):
+				// ADC zp
+				addr = *pt++;
+				goto adc;
+			CASE(0x69):
+				// ADC #n
+				t = *pt++;
+
+				if (testD(s))
+					goto adc_im_d;
+
+				goto adc_im;
+			CASE(0x6d):
+				// ADC abs
+				addr = addr16(*pt++, *pt++);
+				goto adc;
+			CASE(0x71):
+				// ADC (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto adc;
+			CASE(0x75):
+				// ADC zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto adc;
+			CASE(0x79):
+				// ADC abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto adc;
+#ifdef VM_65C02
+			CASE(0x72):
+				// ADC (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto adc;
+#endif
+			CASE(0x7d):
+				// ADC abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 adc:
-			vm_ram_read(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
 adc_im_d:
-			if (testD(r_s))
-			{
-				uint16_t t;
-
-				r_t16 = (r_a & 0xf) + (r_t & 0xf) + testC(r_s);
-				if (r_t16 > 9)
-					r_t16 += 6;
-				t = (r_a >> 4) + (r_t >> 4) + (r_t16 > 15 ? 1 : 0);
-				if (t > 9)
-					t += 6;
-				r_s &= ~(sbit(Vf) | sbit(Nf) | sbit(Zf) | sbit(Cf));
-
-				r_a = (r_t16 & 0xf) | (t << 4);
-				r_s |= (t > 15 ? sbit(Cf) : 0) | testZ(r_a);
-				break;
-			}
+				if (testD(s))
+				{
+					uint16_t hi;
+
+					t16 = (a & 0xf) + (t & 0xf) + testC(s);
+					if (t16 > 9)
+						t16 += 6;
+					hi = (a >> 4) + (t >> 4) + (t16 > 15 ? 1 : 0);
+					if (hi > 9)
+						hi += 6;
+					s &= ~(sbit(Vf) | sbit(Cf));
+
+					a = (t16 & 0xf) | (hi << 4);
+					s |= (hi > 15 ? sbit(Cf) : 0);
+#ifdef VM_65C02
+					// valid N and Z, 1 extra cycle
+					res_n = res_z = a;
+					cycles++;
+#else
+					res_n = 0;
+					res_z = a;
+#endif
+					NEXT;
+				}
 
 adc_im:
-			r_t16 = r_a + r_t + testC(r_s);
-			r_s &= ~(sbit(Vf) | sbit(Nf) | sbit(Zf) | sbit(Cf));
-
-			r_s |= (testN(~(r_a ^ r_t) & (r_a ^ (r_t16 & 0xff))) ? sbit(Vf) : 0)
-				| ((r_t16 & 0xff00) ? sbit(Cf) : 0) | testN(r_t16) | testZ(r_t16 & 0xff);
-			r_a = r_t16 & 0xff;
-			break;
-
-		case 0xb8:
-			// CLV
-			r_s &= ~sbit(Vf);
-			break;
-
-		case 0x86:
-			// STX zp
-			addr = *pt++;
-			goto stx;
-		case 0x8e:
-			// STX abs
-			addr = addr16(*pt++, *pt++);
-			goto stx;
-		case 0x96:
-			// STX zp,y
-			addr = ((*pt++) + r_y) & 0xff;
+				t16 = a + t + testC(s);
+				s &= ~(sbit(Vf) | sbit(Cf));
+
+				s |= (testN(~(a ^ t) & (a ^ (t16 & 0xff))) ? sbit(Vf) : 0)
+					| ((t16 & 0xff00) ? sbit(Cf) : 0);
+				res_n = res_z = a = t16 & 0xff;
+				NEXT;
+
+			CASE(0xb8):
+				// CLV
+				s &= ~sbit(Vf);
+				NEXT;
+
+			CASE(0x86):
+				// STX zp
+				addr = *pt++;
+				goto stx;
+			CASE(0x8e):
+				// STX abs
+				addr = addr16(*pt++, *pt++);
+				goto stx;
+			CASE(0x96):
+				// STX zp,y
+				addr = ((*pt++) + y) & 0xff;
 stx:
-			vm_ram_write(addr, &r_x, 1);
-			break;
-
-		case 0x66:
-			// ROR zp
-			addr = *pt++;
-			goto ror;
-		case 0x6a:
-			// ROR a
-			r_ts = r_a;
-			r_a = r_t = ((r_a >> 1) & 0x7f) | (testC(r_s) ? 0x80 : 0);
-			goto ror_a;
-		case 0x6e:
-			// ROR abs
-			addr = addr16(*pt++, *pt++);
-			goto ror;
-		case 0x76:
-			// ROR zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto ror;
-		case 0x7e:
-			// ROR abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				_ram_write(vm, addr, &x, 1);
+				NEXT;
+
+			CASE(0x66):
+				// ROR zp
+				addr = *pt++;
+				goto ror;
+			CASE(0x6a):
+				// ROR a
+				ts = a;
+				a = t = ((a >> 1) & 0x7f) | (testC(s) ? 0x80 : 0);
+				goto ror_a;
+			CASE(0x6e):
+				// ROR abs
+				addr = addr16(*pt++, *pt++);
+				goto ror;
+			CASE(0x76):
+				// ROR zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto ror;
+			CASE(0x7e):
+				// ROR abs,x
+#ifdef VM_65C02
+				// 6 cycles on the 65C02, 7 when crossing a page
+				addr = indexed(addr16(*pt++, *pt++), x);
+#else
+				addr = addr16(*pt++, *pt++) + x;
+#endif
 ror:
-			vm_ram_read(addr, &r_t, 1);
-			r_ts = r_t;
-			r_t = ((r_t >> 1) & 0x7f) | (testC(r_s) ? 0x80 : 0);
-			vm_ram_write(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
+				ts = t;
+				t = ((t >> 1) & 0x7f) | (testC(s) ? 0x80 : 0);
+				_ram_write(vm, addr, &t, 1);
 ror_a:
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_t) | testZ(r_t) | testC(r_ts);
-			break;
-
-		case 0xd0:
-			// BNE
-			if (!(r_s & sbit(Zf)))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0x21:
-			// AND (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto and;
-		case 0x25:
-			// AND zp
-			addr = *pt++;
-			goto and;
-		case 0x29:
-			// AND #n
-			r_a &= *pt++;
-			goto and_im;
-		case 0x2d:
-			// AND abs
-			addr = addr16(*pt++, *pt++);
-			goto and;
-		case 0x31:
-			// AND (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto and;
-		case 0x35:
-			// AND zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto and;
-		case 0x39:
-			// AND abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto and;
-		case 0x3d:
-			// AND abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				s &= ~sbit(Cf);
+				s |= testC(ts);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0xd0):
+				// BNE
+				if (res_z)
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0x21):
+				// AND (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto and;
+			CASE(0x25):
+				// AND zp
+				addr = *pt++;
+				goto and;
+			CASE(0x29):
+				// AND #n
+				a &= *pt++;
+				goto and_im;
+			CASE(0x2d):
+				// AND abs
+				addr = addr16(*pt++, *pt++);
+				goto and;
+			CASE(0x31):
+				// AND (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto and;
+			CASE(0x35):
+				// AND zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto and;
+			CASE(0x39):
+				// AND abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto and;
+#ifdef VM_65C02
+			CASE(0x32):
+				// AND (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto and;
+#endif
+			CASE(0x3d):
+				// AND abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 and:
-			vm_ram_read(addr, &r_t, 1);
-			r_a &= r_t;
+				mem_read(vm, addr, &t, 1);
+				a &= t;
 and_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0xe8:
-			// INX
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_x++;
-			r_s |= testN(r_x) | testZ(r_x);
-			break;
-
-		case 0xc8:
-			// INY
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_y++;
-			r_s |= testN(r_y) | testZ(r_y);
-			break;
-
-		case 0x28:
-			// PLP
-			vm_ram_read(addr16(++r_sp, 1), &r_s, 1);
-			break;
-
-		case 0x48:
-			// PHA
-			vm_ram_write(addr16(r_sp--, 1), &r_a, 1);
-			break;
-
-		case 0xc1:
-			// CMP (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto cmp;
-		case 0xc5:
-			// CMP zp
-			addr = *pt++;
-			goto cmp;
-		case 0xc9:
-			// CMP #n
-			r_t = *pt++;
-			goto cmp_im;
-		case 0xcd:
-			// CMP abs
-			addr = addr16(*pt++, *pt++);
-			goto cmp;
-		case 0xd1:
-			// CMP (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto cmp;
-		case 0xd5:
-			// CMP zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto cmp;
-		case 0xd9:
-			// CMP abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto cmp;
-		case 0xdd:
-			// CMP abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0xe8):
+				// INX
+				x++;
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0xc8):
+				// INY
+				y++;
+				res_n = res_z = y;
+				NEXT;
+
+#ifdef VM_65C02
+			CASE(0x1a):
+				// INC a
+				a++;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0x3a):
+				// DEC a
+				a--;
+				res_n = res_z = a;
+				NEXT;
+#endif
+
+			CASE(0x28):
+				// PLP
+				mem_read(vm, addr16(++sp, 1), &s, 1);
+				load_nz();
+				pc++;
+				goto unmask;
+
+			CASE(0x48):
+				// PHA
+				_ram_write(vm, addr16(sp--, 1), &a, 1);
+				NEXT;
+
+#ifdef VM_65C02
+			CASE(0xda):
+				// PHX
+				_ram_write(vm, addr16(sp--, 1), &x, 1);
+				NEXT;
+
+			CASE(0x5a):
+				// PHY
+				_ram_write(vm, addr16(sp--, 1), &y, 1);
+				NEXT;
+
+			CASE(0xfa):
+				// PLX
+				mem_read(vm, addr16(++sp, 1), &x, 1);
+				res_n = res_z = x;
+				NEXT;
+
+			CASE(0x7a):
+				// PLY
+				mem_read(vm, addr16(++sp, 1), &y, 1);
+				res_n = res_z = y;
+				NEXT;
+#endif
+
+			CASE(0xc1):
+				// CMP (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto cmp;
+			CASE(0xc5):
+				// CMP zp
+				addr = *pt++;
+				goto cmp;
+			CASE(0xc9):
+				// CMP #n
+				t = *pt++;
+				goto cmp_im;
+			CASE(0xcd):
+				// CMP abs
+				addr = addr16(*pt++, *pt++);
+				goto cmp;
+			CASE(0xd1):
+				// CMP (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto cmp;
+			CASE(0xd5):
+				// CMP zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto cmp;
+			CASE(0xd9):
+				// CMP abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto cmp;
+#ifdef VM_65C02
+			CASE(0xd2):
+				// CMP (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto cmp;
+#endif
+			CASE(0xdd):
+				// CMP abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 cmp:
-			vm_ram_read(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
 cmp_im:
-			r_ts = r_a - r_t;
-			r_s &= ~(sbit(Nf) | sbit(Zf) | sbit(Cf));
-			r_s |= testN(r_ts) | testZ(r_ts) | (r_a >= r_t ? sbit(Cf) : 0);
-			break;
-
-		case 0x98:
-			// TYA
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_a = r_y;
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0x50:
-			// BVC
-			if (!(r_s & sbit(Vf)))
-				r_pc += (int8_t)*pt++;
-			else
-				r_pc++;
-			break;
-
-		case 0xe1:
-			// SBC (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto sbc;
-		case 0xe5:
-			// SBC zp
-			addr = *pt++;
-			goto sbc;
-		case 0xe9:
-			// SBC #n
-			r_t = *pt++;
-
-			if (testD(r_s))
-				goto sbc_im_d;
-
-			goto sbc_im;
-		case 0xed:
-			// SBC abs
-			addr = addr16(*pt++, *pt++);
-			goto sbc;
-		case 0xf1:
-			// SBC (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto sbc;
-		case 0xf5:
-			// SBC zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto sbc;
-		case 0xf9:
-			// SBC abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto sbc;
-		case 0xfd:
-			// SBC abs, x
-			addr = addr16(*pt++, *pt++) + r_x;
+				ts = a - t;
+				s &= ~sbit(Cf);
+				s |= (a >= t ? sbit(Cf) : 0);
+				res_n = res_z = ts;
+				NEXT;
+
+			CASE(0x98):
+				// TYA
+				a = y;
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0x50):
+				// BVC
+				if (!(s & sbit(Vf)))
+					goto branch;
+				pc++;
+				NEXT;
+
+			CASE(0xe1):
+				// SBC (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto sbc;
+			CASE(0xe5):
+				// SBC zp
+				addr = *pt++;
+				goto sbc;
+			CASE(0xe9):
+				// SBC #n
+				t = *pt++;
+
+				if (testD(s))
+					goto sbc_im_d;
+
+				goto sbc_im;
+			CASE(0xed):
+				// SBC abs
+				addr = addr16(*pt++, *pt++);
+				goto sbc;
+			CASE(0xf1):
+				// SBC (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto sbc;
+			CASE(0xf5):
+				// SBC zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto sbc;
+			CASE(0xf9):
+				// SBC abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto sbc;
+#ifdef VM_65C02
+			CASE(0xf2):
+				// SBC (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto sbc;
+#endif
+			CASE(0xfd):
+				// SBC abs, x
+				addr = indexed(addr16(*pt++, *pt++), x);
 sbc:
-			vm_ram_read(addr, &r_t, 1);
+				mem_read(vm, addr, &t, 1);
 
 sbc_im_d:
-			if (testD(r_s))
-			{
-				uint16_t t;
-
-				r_t16 = (r_a & 0xf) - (r_t & 0xf) - !testC(r_s);
-				if (r_t16 & 0x10)
-					r_t16 -= 6;
-				t = (r_a >> 4) - (r_t >> 4) - ((r_t16 & 0x10) >> 4);
-				if (t & 0x10)
-					t -= 6;
-				r_s &= ~(sbit(Vf) | sbit(Nf) | sbit(Zf) | sbit(Cf));
-
-				r_a = (r_t16 & 0xf) | (t << 4);
-				r_s |= (t > 15 ? 0 : sbit(Cf)) | testZ(r_a);
-				break;
-			}
+				if (testD(s))
+				{
+					uint16_t hi;
+
+					t16 = (a & 0xf) - (t & 0xf) - !testC(s);
+					if (t16 & 0x10)
+						t16 -= 6;
+					hi = (a >> 4) - (t >> 4) - ((t16 & 0x10) >> 4);
+					if (hi & 0x10)
+						hi -= 6;
+					s &= ~(sbit(Vf) | sbit(Cf));
+
+					a = (t16 & 0xf) | (hi << 4);
+					s |= (hi > 15 ? 0 : sbit(Cf));
+#ifdef VM_65C02
+					// valid N and Z, 1 extra cycle
+					res_n = res_z = a;
+					cycles++;
+#else
+					res_n = 0;
+					res_z = a;
+#endif
+					NEXT;
+				}
 sbc_im:
 
-			r_t16 = r_a - r_t - !testC(r_s);
-			r_s &= ~(sbit(Vf) | sbit(Nf) | sbit(Zf) | sbit(Cf));
-
-			r_s |= (testN((r_a ^ r_t) & (r_a ^ (r_t16 & 0xff))) ? sbit(Vf) : 0)
-				| ((r_t16 & 0xff00) ? 0 : sbit(Cf)) | testN(r_t16) | testZ(r_t16 & 0xff);
-			r_a = r_t16 & 0xff;
-			break;
-
-		case 0x00:
-			// BRK
-			r_pc += 2;
-			pt[0] = r_s | sbit(5) | sbit(Bf);
-			pt[1] = (uint8_t)r_pc;
-			pt[2] = (uint8_t)(r_pc >> 8);
-			vm_ram_write(addr16(r_sp - 2, 1), pt, 3);
-			r_sp -= 3;
-			vm_ram_read(0xfffe, pt, 2);
-			r_pc = addr16(pt[0], pt[1]);
-			r_s |= sbit(If);
-			return 1;
-
-		case 0x68:
-			// PLA
-			vm_ram_read(addr16(++r_sp, 1), &r_a, 1);
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
-
-		case 0x08:
-			// PHP
-			r_t = r_s | sbit(5) | sbit(Bf);
-			vm_ram_write(addr16(r_sp--, 1), &r_t, 1);
-			break;
-
-		case 0xea:
-			// NOP
-			break;
-
-		case 0xe6:
-			// INC zp
-			addr = *pt++;
-			goto inc;
-		case 0xee:
-			// INC abs
-			addr = addr16(*pt++, *pt++);
-			goto inc;
-		case 0xf6:
-			// INC zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto inc;
-		case 0xfe:
-			// INC abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				t16 = a - t - !testC(s);
+				s &= ~(sbit(Vf) | sbit(Cf));
+
+				s |= (testN((a ^ t) & (a ^ (t16 & 0xff))) ? sbit(Vf) : 0)
+					| ((t16 & 0xff00) ? 0 : sbit(Cf));
+				res_n = res_z = a = t16 & 0xff;
+				NEXT;
+
+			CASE(0x00):
+				// BRK
+				pc += 2;
+				buf[0] = status() | sbit(5) | sbit(Bf);
+				buf[1] = (uint8_t)pc;
+				buf[2] = (uint8_t)(pc >> 8);
+				_push(vm, sp, buf, 3);
+				sp -= 3;
+				mem_read(vm, 0xfffe, buf, 2);
+				pc = addr16(buf[0], buf[1]);
+				s |= sbit(If);
+#ifdef VM_65C02
+				s &= ~sbit(Df);
+#endif
+				JUMP;
+
+event:
+				// NMI, or IRQ if not masked (checked again when the I flag
+				// is cleared); with none that can be taken vm_run() returns,
+				// as the event may have been set for the host too
+				vm->event = 0;
+				if (vm->nmi)
+				{
+					vm->nmi = 0;
+					addr = 0xfffa;
+				}
+				else if (vm->irq && !(s & sbit(If)))
+				{
+					vm->irq = 0;
+					addr = 0xfffe;
+				}
+				else
+				{
+					ret = VM_EVENT;
+					goto done;
+				}
+				// as BRK with B clear, PC points to the next instruction
+				buf[0] = status() | sbit(5);
+				buf[1] = (uint8_t)pc;
+				buf[2] = (uint8_t)(pc >> 8);
+				_push(vm, sp, buf, 3);
+				sp -= 3;
+				mem_read(vm, addr, buf, 2);
+				pc = addr16(buf[0], buf[1]);
+				s |= sbit(If);
+#ifdef VM_65C02
+				s &= ~sbit(Df);
+#endif
+				cycles += 7;
+				JUMP;
+
+			CASE(0x68):
+				// PLA
+				mem_read(vm, addr16(++sp, 1), &a, 1);
+				res_n = res_z = a;
+				NEXT;
+
+			CASE(0x08):
+				// PHP
+				t = status() | sbit(5) | sbit(Bf);
+				_ram_write(vm, addr16(sp--, 1), &t, 1);
+				NEXT;
+
+			CASE(0xea):
+				// NOP
+				NEXT;
+
+			CASE(0xe6):
+				// INC zp
+				addr = *pt++;
+				goto inc;
+			CASE(0xee):
+				// INC abs
+				addr = addr16(*pt++, *pt++);
+				goto inc;
+			CASE(0xf6):
+				// INC zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto inc;
+			CASE(0xfe):
+				// INC abs,x
+				addr = addr16(*pt++, *pt++) + x;
 inc:
-			vm_ram_read(addr, &r_t, 1);
-			r_t++;
-			vm_ram_write(addr, &r_t, 1);
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_t) | testZ(r_t);
-			break;
-
-		case 0x01:
-			// ORA (zp,x)
-			addr = ((*pt++) + r_x) & 0xff;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]);
-			goto ora;
-		case 0x05:
-			// ORA zp
-			addr = *pt++;
-			goto ora;
-		case 0x09:
-			// ORA #n
-			r_a |= *pt++;
-			goto ora_im;
-		case 0x0d:
-			// ORA abs
-			addr = addr16(*pt++, *pt++);
-			goto ora;
-		case 0x11:
-			// ORA (zp),y
-			addr = *pt++;
-			vm_ram_read(addr, pt, 2);
-			addr = addr16(pt[0], pt[1]) + r_y;
-			goto ora;
-		case 0x15:
-			// ORA zp,x
-			addr = ((*pt++) + r_x) & 0xff;
-			goto ora;
-		case 0x19:
-			// ORA abs,y
-			addr = addr16(*pt++, *pt++) + r_y;
-			goto ora;
-		case 0x1d:
-			// ORA abs,x
-			addr = addr16(*pt++, *pt++) + r_x;
+				mem_read(vm, addr, &t, 1);
+				t++;
+				_ram_write(vm, addr, &t, 1);
+				res_n = res_z = t;
+				NEXT;
+
+			CASE(0x01):
+				// ORA (zp,x)
+				addr = ((*pt++) + x) & 0xff;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto ora;
+			CASE(0x05):
+				// ORA zp
+				addr = *pt++;
+				goto ora;
+			CASE(0x09):
+				// ORA #n
+				a |= *pt++;
+				goto ora_im;
+			CASE(0x0d):
+				// ORA abs
+				addr = addr16(*pt++, *pt++);
+				goto ora;
+			CASE(0x11):
+				// ORA (zp),y
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = indexed(addr16(buf[0], buf[1]), y);
+				goto ora;
+			CASE(0x15):
+				// ORA zp,x
+				addr = ((*pt++) + x) & 0xff;
+				goto ora;
+			CASE(0x19):
+				// ORA abs,y
+				addr = indexed(addr16(*pt++, *pt++), y);
+				goto ora;
+#ifdef VM_65C02
+			CASE(0x12):
+				// ORA (zp)
+				addr = *pt++;
+				mem_read(vm, addr, buf, 2);
+				addr = addr16(buf[0], buf[1]);
+				goto ora;
+#endif
+			CASE(0x1d):
+				// ORA abs,x
+				addr = indexed(addr16(*pt++, *pt++), x);
 ora:
-			vm_ram_read(addr, &r_t, 1);
-			r_a |= r_t;
+				mem_read(vm, addr, &t, 1);
+				a |= t;
 ora_im:
-			r_s &= ~(sbit(Nf) | sbit(Zf));
-			r_s |= testN(r_a) | testZ(r_a);
-			break;
+				res_n = res_z = a;
+				NEXT;
+
+			HALT:
+				// HALT
+				ret = VM_HALT;
+				goto done;
+		}
+#ifndef VM_THREADED
 
-		default:
-			// HALT
-			return 0;
+		pc += (pt - start);
+	}
+#endif // VM_THREADED
+
+done:
+	vm->a = a;
+	vm->x = x;
+	vm->y = y;
+	vm->sp = sp;
+	vm->s = status();
+	vm->pc = pc;
+	vm->cycles = cycles;
+#ifndef VM_SINGLE
+	// budget wrapped around if it was used up
+	vm->ran = ret == VM_BUDGET ? total : total - budget;
+#endif
+
+	if (ret == VM_SYS)
+	{
+		if (pc == vm->sys_pc && cycles - vm->sys_cycles < VM_IDLE_CYCLES)
+		{
+			if (vm->idle < 0xff)
+				vm->idle++;
+		}
+		else
+			vm->idle = 0;
+		vm->sys_pc = pc;
+
+		sys_call(vm, a);
+		// the syscall may count the cycles of the loop iterations it skipped
+		vm->sys_cycles = vm->cycles;
+		// the syscall may have loaded new code
+		vm->win_len = 0;
 	}
 
-	r_pc += (pt - _op_cache);
+	return ret;
+}
+
+#ifdef VM_SINGLE
+void
+vm_init()
+{
+	_init(&vm);
+}
+
+uint8_t
+vm_run(uint16_t budget)
+{
+	return _run(&vm, budget);
+}
+
+uint8_t
+vm_exec()
+{
+	return vm_run(1) != VM_HALT;
+}
+#else // not VM_SINGLE
+void
+vm_init(struct vm_state *vm)
+{
+	_init(vm);
+}
+
+uint8_t
+vm_run(struct vm_state *vm, uint16_t budget)
+{
+	return _run(vm, budget);
+}
 
-	return 1;
+uint8_t
+vm_exec(struct vm_state *vm)
+{
+	return vm_run(vm, 1) != VM_HALT;
 }
 
+void
+vm_invalidate(struct vm_state *vm, uint16_t addr, uint16_t size)
+{
+#ifdef VM_BLOCKS
+	uint8_t page = addr >> 8;
+	uint16_t pages = size ? (((addr & 0xff) + size - 1) >> 8) + 1 : 256;
+
+	if (pages > 256)
+		pages = 256;
+
+	while (pages--)
+	{
+		if (code_page(vm, page))
+			_drop_page(vm, page);
+		page++;
+	}
+#endif
+	vm->win_len = 0;
+}
+#endif // VM_SINGLE